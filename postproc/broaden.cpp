@@ -0,0 +1,134 @@
+#include "broaden.h"
+#include "math.h"
+
+#define MIN(a,b) ((a)>(b)?(b):(a))
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+/* ----------------------------------------------------------------------------
+ * Class Broaden convolves data of n points with spacing h with a broadening
+ * kernel by FFT, in O(n log n): kind = 1, Gaussian of standard deviation w1;
+ * kind = 2, Lorentzian of half width w2; kind = 3, Voigt, i.e., both. The data
+ * are zero-padded instead of taken as periodic, so that the weight near one
+ * end is not wrapped onto the other; what is spread beyond the ends is lost.
+ * The kernel is integrated over each bin, so that it keeps the total weight
+ * on the grid however narrow it is, and is truncated where it is below 1e-16
+ * of its peak (Gaussian) or at the length of the data (otherwise).
+ * ---------------------------------------------------------------------------- */
+Broaden::Broaden(const int npt, const double h, const int kind, const double w1, const double w2)
+{
+  memory = new Memory();
+  n = npt;
+
+  double sigma = kind != 2 ? MAX(0., w1) : 0.;
+  double gamma = kind >= 2 ? MAX(0., kind == 2 ? w1 : w2) : 0.;
+  int ng = MIN(n-1, int(ceil(8.5*sigma/h)));
+  nker = gamma > 0. ? n-1 : ng;
+
+  // the padded length, with factors 2, 3 and 5 only, to hold the linear convolution
+  npad = n + nker;
+  while (1){
+    int rest = npad;
+    while (rest%2 == 0) rest /= 2;
+    while (rest%3 == 0) rest /= 3;
+    while (rest%5 == 0) rest /= 5;
+    if (rest == 1) break;
+    npad++;
+  }
+
+  // the kernel; the Voigt one is the discrete convolution of the other two
+  doublecomplex *ker;
+  ker = memory->create(ker, npad, "Broaden:ker");
+  for (int i=0; i<npad; i++) ker[i].r = ker[i].i = 0.;
+  for (int j=-nker; j<=nker; j++){
+    double w = 0.;
+    if (gamma <= 0.) w = gauss(j, h, sigma);
+    else if (sigma <= 0.) w = lorentz(j, h, gamma);
+    else for (int l=-ng; l<=ng; l++) w += gauss(l, h, sigma)*lorentz(j-l, h, gamma);
+    ker[(j+npad)%npad].r = w;
+  }
+
+  fft = new FFT(npad);
+  fft->execute(ker, 1, -1);
+  kernel = memory->create(kernel, npad, "Broaden:kernel");
+  for (int i=0; i<npad; i++) kernel[i] = ker[i].r/double(npad);
+  memory->destroy(ker);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Deconstructor
+ * ---------------------------------------------------------------------------- */
+Broaden::~Broaden()
+{
+  delete fft;
+  memory->destroy(kernel);
+  delete memory;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to broaden m channels of data in place, data[n][m]; all
+ * channels are transformed together, two real ones packed in each complex
+ * number, since the spectrum of the symmetric kernel is real. The channels
+ * are done in blocks, to keep the work array within about 64 MB.
+ * ---------------------------------------------------------------------------- */
+void Broaden::execute(double *data, const int m)
+{
+  int mc = (m+1)/2;
+  int mb = MAX(1, MIN(mc, 4194304/npad));
+
+  doublecomplex *work;
+  work = memory->create(work, npad*mb, "Broaden:work");
+  for (int c0=0; c0<mc; c0+=mb){
+    int nc = MIN(mb, mc-c0);
+    for (int i=0; i<npad*nc; i++) work[i].r = work[i].i = 0.;
+    for (int i=0; i<n; i++)
+    for (int c=0; c<nc; c++){
+      int ch = 2*(c0+c);
+      work[i*nc+c].r = data[i*m+ch];
+      if (ch+1 < m) work[i*nc+c].i = data[i*m+ch+1];
+    }
+
+    fft->execute(work, nc, -1);
+    for (int k=0; k<npad; k++)
+    for (int c=0; c<nc; c++){
+      work[k*nc+c].r *= kernel[k];
+      work[k*nc+c].i *= kernel[k];
+    }
+    fft->execute(work, nc, 1);
+
+    for (int i=0; i<n; i++)
+    for (int c=0; c<nc; c++){
+      int ch = 2*(c0+c);
+      data[i*m+ch] = work[i*nc+c].r;
+      if (ch+1 < m) data[i*m+ch+1] = work[i*nc+c].i;
+    }
+  }
+  memory->destroy(work);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the weight of the Gaussian of standard deviation s
+ * over the bin [(j-1/2)h, (j+1/2)h].
+ * ---------------------------------------------------------------------------- */
+double Broaden::gauss(const int j, const double h, const double s)
+{
+  if (s <= 0.) return j == 0 ? 1. : 0.;
+  double fac = h/(sqrt(2.)*s);
+
+return 0.5*(erf((double(j)+0.5)*fac) - erf((double(j)-0.5)*fac));
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the weight of the Lorentzian of half width g over the
+ * bin [(j-1/2)h, (j+1/2)h].
+ * ---------------------------------------------------------------------------- */
+double Broaden::lorentz(const int j, const double h, const double g)
+{
+  if (g <= 0.) return j == 0 ? 1. : 0.;
+  const double pi = 4.*atan(1.);
+
+return (atan((double(j)+0.5)*h/g) - atan((double(j)-0.5)*h/g))/pi;
+}
@@ -0,0 +1,26 @@
+#ifndef BROADEN_H
+#define BROADEN_H
+
+#include "memory.h"
+#include "fft.h"
+
+class Broaden {
+public:
+  Broaden(const int, const double, const int, const double, const double);
+  ~Broaden();
+
+  void execute(double *, const int);
+
+  int n, npad;              // # of points of the data, and of the zero-padded FFT
+  int nker;                 // the kernel is truncated at +/- nker points
+
+private:
+  Memory *memory;
+  FFT *fft;
+  double *kernel;           // Fourier transform of the kernel over npad points, divided by npad
+
+  double gauss(const int, const double, const double);
+  double lorentz(const int, const double, const double);
+};
+
+#endif
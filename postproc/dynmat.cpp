@@ -2,6 +2,7 @@
 #include "math.h"
 
 #define MAXLINE 256
+#define MAX(a,b) ((a)>(b)?(a):(b))
 
 // to intialize the class
 DynMat::DynMat(int narg, char **arg)
@@ -10,10 +11,26 @@ DynMat::DynMat(int narg, char **arg)
   memory = NULL;
   M_inv_sqrt = NULL;
   interpolate = NULL;
+  qcache = NULL;
   DM_q = DM_all = NULL;
   binfile = funit = dmfile = NULL;
 
   flag_reset_gamma = flag_skip = 0;
+  flag_cache = ncache = flag_lean = 0;
+  nthreads[0] = nthreads[1] = nbuffer = 0;
+  qcache_mb = 64.;
+  flag_qlast = 0;
+  qorder = 0;
+  bkind = 0;
+  bwidth[0] = bwidth[1] = 0.;
+  droptol = 0.;
+  int numa = 0, hugepage = 0;
+
+  me = 0; nprocs = 1;
+#ifdef UseMPI
+  MPI_Comm_rank(MPI_COMM_WORLD, &me);
+  MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+#endif
 
   // analyze the command line options
   int iarg = 1;
@@ -24,6 +41,55 @@ DynMat::DynMat(int narg, char **arg)
     } else if (strcmp(arg[iarg], "-r") == 0){
       flag_reset_gamma = 1;
 
+    } else if (strcmp(arg[iarg], "-t") == 0){
+      if (iarg+2 >= narg) help();
+      nthreads[0] = atoi(arg[++iarg]);
+      nthreads[1] = atoi(arg[++iarg]);
+      // the # of buffers is optional, taken only if the next argument is an integer
+      if (iarg+1 < narg){
+        char *end;
+        long nb = strtol(arg[iarg+1], &end, 10);
+        if (end != arg[iarg+1] && *end == '\0'){
+          nbuffer = int(nb);
+          iarg++;
+        }
+      }
+
+    } else if (strcmp(arg[iarg], "-c") == 0){
+      if (iarg+1 >= narg) help();
+      ncache = atoi(arg[++iarg]);
+      flag_cache = 1;
+
+    } else if (strcmp(arg[iarg], "-l") == 0){
+      flag_lean = 1;
+
+    } else if (strcmp(arg[iarg], "-q") == 0){
+      if (iarg+1 >= narg) help();
+      qcache_mb = atof(arg[++iarg]);
+
+    } else if (strcmp(arg[iarg], "-o") == 0){
+      if (iarg+1 >= narg) help();
+      qorder = atoi(arg[++iarg]);
+
+    } else if (strcmp(arg[iarg], "-b") == 0){
+      if (iarg+2 >= narg) help();
+      bkind = atoi(arg[++iarg]);
+      bwidth[0] = atof(arg[++iarg]);
+      if (bkind == 3){
+        if (iarg+1 >= narg) help();
+        bwidth[1] = atof(arg[++iarg]);
+      }
+      if (bkind < 1 || bkind > 4) help();
+
+    } else if (strcmp(arg[iarg], "-d") == 0){
+      if (iarg+1 >= narg) help();
+      droptol = atof(arg[++iarg]);
+
+    } else if (strcmp(arg[iarg], "-m") == 0){
+      if (iarg+2 >= narg) help();
+      numa     = atoi(arg[++iarg]);
+      hugepage = atoi(arg[++iarg]);
+
     } else if (strcmp(arg[iarg], "-h") == 0){
       help();
 
@@ -36,6 +102,17 @@ DynMat::DynMat(int narg, char **arg)
 
     iarg++;
   }
+  // the big arrays are to be read mostly by the interpolation threads
+  Memory::set_placement(numa, hugepage, nthreads[0]);
+
+#ifdef UseMPI
+  // only rank 0 reads and preprocesses the dynamical matrices; others get them from rank 0
+  if (me != 0){
+    bcast_data();
+    qcache = new QCache(fftdim, qcache_mb);
+    return;
+  }
+#endif
 
   // get the binary file name from user input if not found in command line
   char str[MAXLINE];
@@ -87,7 +164,7 @@ DynMat::DynMat(int narg, char **arg)
 
   funit = new char[4];
   strcpy(funit, "THz");
-  if (boltz == 1.){eml2f = 1.; delete funit; funit=new char[22]; strcpy(funit,"sqrt(epsilon/(m.sigma^2))");}
+  if (boltz == 1.){eml2f = 1.; delete []funit; funit=new char[26]; strcpy(funit,"sqrt(epsilon/(m.sigma^2))");}
   else if (boltz == 0.0019872067) eml2f = 3.256576161;
   else if (boltz == 8.617343e-5)  eml2f = 15.63312493;
   else if (boltz == 1.3806504e-23) eml2f = 1.;
@@ -100,7 +177,7 @@ DynMat::DynMat(int narg, char **arg)
 
   // now to allocate memory for DM
   memory = new Memory;
-  DM_all = memory->create(DM_all, npt, fftdim2, "DynMat:DM_all");
+  DM_all = memory->create_big(DM_all, npt, fftdim2, "DynMat:DM_all");
   DM_q   = memory->create(DM_q, fftdim,fftdim,"DynMat:DM_q");
 
   // read all dynamical matrix info into DM_all
@@ -136,6 +213,9 @@ DynMat::DynMat(int narg, char **arg)
 
   // initialize interpolation
   interpolate = new Interpolate(nx,ny,nz,fftdim2,DM_all);
+  if (flag_latinfo) interpolate->set_lattice(nucell, sysdim, basevec, basis);
+  if (flag_cache) interpolate->set_cache(ncache);
+  interpolate->set_lean(flag_lean);
   if (flag_reset_gamma) interpolate->reset_gamma();
 
   if ( flag_mass_read ){ // M_inv_sqrt info read, the data stored are force constant matrix instead of dynamical matrix.
@@ -158,10 +238,73 @@ DynMat::DynMat(int narg, char **arg)
 
   // ask for the interpolation method
   interpolate->set_method();
+  qcache = new QCache(fftdim, qcache_mb);
+
+#ifdef UseMPI
+  bcast_data();
+#endif
 
   return;
 }
 
+#ifdef UseMPI
+/* ----------------------------------------------------------------------------
+ * Private method to broadcast the preprocessed dynamical matrices, the lattice
+ * info and the interpolation method from rank 0 to all other ranks.
+ * ---------------------------------------------------------------------------- */
+void DynMat::bcast_data()
+{
+  int ibuf[9];
+  double dbuf[3];
+  if (me == 0){
+    ibuf[0] = sysdim; ibuf[1] = nx; ibuf[2] = ny; ibuf[3] = nz; ibuf[4] = nucell;
+    ibuf[5] = flag_latinfo; ibuf[6] = flag_skip; ibuf[7] = flag_reset_gamma;
+    ibuf[8] = strlen(funit)+1;
+    dbuf[0] = boltz; dbuf[1] = eml2f; dbuf[2] = Tmeasure;
+  }
+  MPI_Bcast(ibuf, 9, MPI_INT,    0, MPI_COMM_WORLD);
+  MPI_Bcast(dbuf, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+  if (me != 0){
+    sysdim = ibuf[0]; nx = ibuf[1]; ny = ibuf[2]; nz = ibuf[3]; nucell = ibuf[4];
+    flag_latinfo = ibuf[5]; flag_skip = ibuf[6]; flag_reset_gamma = ibuf[7];
+    boltz = dbuf[0]; eml2f = dbuf[1]; Tmeasure = dbuf[2];
+    funit = new char[ibuf[8]];
+
+    fftdim = sysdim*nucell; fftdim2 = fftdim*fftdim;
+    npt = nx*ny*nz;
+
+    memory = new Memory;
+    DM_all = memory->create_big(DM_all, npt, fftdim2, "DynMat:DM_all");
+    DM_q   = memory->create(DM_q, fftdim,fftdim,"DynMat:DM_q");
+    basis = memory->create(basis,nucell,sysdim,"DynMat:basis");
+    attyp = memory->create(attyp,nucell, "DynMat:attyp");
+  }
+  MPI_Bcast(funit, ibuf[8], MPI_CHAR, 0, MPI_COMM_WORLD);
+  MPI_Bcast(basevec,  9, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  MPI_Bcast(ibasevec, 9, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  MPI_Bcast(basis[0], fftdim, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  MPI_Bcast(attyp, nucell, MPI_INT, 0, MPI_COMM_WORLD);
+
+  // one q at a time, so that the count never overflows for big cells
+  for (int idq=0; idq<npt; idq++) MPI_Bcast(DM_all[idq], 2*fftdim2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+  // the gamma point has been reset, if needed, on rank 0 already
+  int im = 0;
+  if (me == 0) im = interpolate->which;
+  else {
+    interpolate = new Interpolate(nx,ny,nz,fftdim2,DM_all);
+    if (flag_latinfo) interpolate->set_lattice(nucell, sysdim, basevec, basis);
+    if (flag_cache) interpolate->set_cache(ncache);
+    interpolate->set_lean(flag_lean);
+  }
+  MPI_Bcast(&im, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (me != 0) interpolate->set_method(im);
+
+return;
+}
+#endif
+
 // to destroy the class
 DynMat::~DynMat()
 {
@@ -170,6 +313,18 @@ DynMat::~DynMat()
  if (dmfile) delete []dmfile;
  if (binfile) delete []binfile;
  if (interpolate) delete interpolate;
+ if (qcache){
+   // report how the cache of q-points did, summed over all ranks
+   bigint count[5], sum[5];
+   count[0] = qcache->nhit[0]; count[1] = qcache->nmiss[0];
+   count[2] = qcache->nhit[1]; count[3] = qcache->nmiss[1]; count[4] = qcache->npart;
+   for (int i=0; i<5; i++) sum[i] = count[i];
+#ifdef UseMPI
+   MPI_Reduce(count, sum, 5, MPI_INT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+#endif
+   if (me == 0) qcache->print(sum);
+   delete qcache;
+ }
 
  memory->destroy(DM_q);
  memory->destroy(attyp);
@@ -220,13 +375,20 @@ return;
  * method to write DM_q to file, dispersion-like
  * ---------------------------------------------------------------------------- */
 void DynMat::writeDMq(double *q, const double qr, FILE *fp)
+{
+  writeDMq(q, qr, fp, DM_q[0]);
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * method to write the DM stored in DMq to file, dispersion-like
+ * ---------------------------------------------------------------------------- */
+void DynMat::writeDMq(double *q, const double qr, FILE *fp, doublecomplex *DMq)
 {
 
   fprintf(fp, "%lg %lg %lg %lg ", q[0], q[1], q[2], qr);
 
-  for (int i=0; i<fftdim; i++){
-    for (int j=0; j<fftdim; j++) fprintf(fp,"%lg %lg\t", DM_q[i][j].r, DM_q[i][j].i);
-  }
+  for (int i=0; i<fftdim2; i++) fprintf(fp,"%lg %lg\t", DMq[i].r, DMq[i].i);
   fprintf(fp,"\n");
 return;
 }
@@ -237,6 +399,26 @@ return;
  * cLapack subroutine zheevd is employed.
  * ---------------------------------------------------------------------------- */
 int DynMat::geteigen(double *egv, int flag)
+{
+  if (flag_qlast == 0) return geteigen(egv, flag, DM_q[0]);
+
+  // DM_q is that of qlast, whose results might be known already
+  flag_qlast = 0;
+  double wt = 1.;
+  if (cache_lookup(qlast, flag, egv, DM_q[0], &wt) == 2 && wt > 0.) return 0;
+
+  int info = geteigen(egv, flag, DM_q[0]);
+  cache_store(qlast, -1, NULL, egv, flag ? DM_q[0] : NULL);
+
+return info;
+}
+
+/* ----------------------------------------------------------------------------
+ * method to evaluate the eigenvalues of the DM stored in DMq; the eigenvectors
+ * overwrite DMq if flag is set. Nothing but DMq and egv is touched, so that
+ * it can be called by several threads at the same time.
+ * ---------------------------------------------------------------------------- */
+int DynMat::geteigen(double *egv, int flag, doublecomplex *DMq)
 {
   char jobz, uplo;
   integer n, lda, lwork, lrwork, *iwork, liwork, info;
@@ -257,7 +439,7 @@ int DynMat::geteigen(double *egv, int flag)
   rwork = memory->create(rwork, lrwork, "geteigen:rwork");
   iwork = memory->create(iwork, liwork, "geteigen:iwork");
 
-  zheevd_(&jobz, &uplo, &n, DM_q[0], &lda, w, work, &lwork, rwork, &lrwork, iwork, &liwork, &info);
+  zheevd_(&jobz, &uplo, &n, DMq, &lda, w, work, &lwork, rwork, &lrwork, iwork, &liwork, &info);
  
   // to get w instead of w^2; and convert w into v (THz hopefully)
   for (int i=0; i<n; i++){
@@ -279,7 +461,8 @@ return info;
  * ---------------------------------------------------------------------------- */
 void DynMat::getDMq(double *q)
 {
-  interpolate->execute(q, DM_q[0]);
+  double wt = 1.;
+  getDMq(q, &wt);
 return;
 }
 
@@ -288,9 +471,199 @@ return;
  * ---------------------------------------------------------------------------- */
 void DynMat::getDMq(double *q, double *wt)
 {
+  for (int i=0; i<3; i++) qlast[i] = q[i];
+  flag_qlast = 1;
+  if (cache_lookup(q, -1, NULL, DM_q[0], wt)) return;
+
   interpolate->execute(q, DM_q[0]);
 
-  if (flag_skip && interpolate->UseGamma ) wt[0] = 0.;
+  int skip = flag_skip && interpolate->UseGamma;
+  if (skip) wt[0] = 0.;
+  cache_store(q, skip, DM_q[0], NULL, NULL);
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * method to look for q in the cache of q-points: want = -1 for the DM into
+ * mat, 0 for the eigenvalues into egv, 1 for the eigenvalues and eigenvectors
+ * (into mat). Returns 2 if all wanted are got, 1 if only the DM is got into
+ * mat, 0 if q is unknown; wt is zeroed if q is known to be skipped. Thread safe.
+ * ---------------------------------------------------------------------------- */
+int DynMat::cache_lookup(const double *q, const int want, double *egv, doublecomplex *mat, double *wt)
+{
+  int skip = 0;
+  int found = qcache->lookup(q, interpolate->which, want, egv, mat, &skip);
+  if (found && skip) wt[0] = 0.;
+
+return found;
+}
+
+/* ----------------------------------------------------------------------------
+ * method to keep what is known of q in the cache: its skip flag (if not
+ * negative), and its DM, eigenvalues and eigenvectors (if not NULL). Thread safe.
+ * ---------------------------------------------------------------------------- */
+void DynMat::cache_store(const double *q, const int skip, const doublecomplex *dm, const double *egv,
+                         const doublecomplex *evec)
+{
+  qcache->store(q, interpolate->which, skip, dm, egv, evec);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * method to get the Dynamical Matrix at q into DMq; thread safe
+ * ---------------------------------------------------------------------------- */
+void DynMat::getDMq(double *q, double *wt, doublecomplex *DMq)
+{
+  int gamma = interpolate->evaluate(q, DMq);
+
+  if (flag_skip && gamma) wt[0] = 0.;
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * method to get the Dynamical Matrices at n q-points at once into DMq, one
+ * after another; wt[i] is zeroed if q[i] is to be skipped. If dDq is not NULL,
+ * the derivatives of the DMs with respect to the fractional components of q
+ * go there, [n][3][fftdim2]. Thread safe.
+ * ---------------------------------------------------------------------------- */
+void DynMat::getDMq(const double (*q)[3], const int n, double *wt, doublecomplex *DMq, doublecomplex *dDq)
+{
+  int *gamma = new int[n];
+  interpolate->execute_batch(q, n, DMq, gamma, dDq);
+
+  if (flag_skip) for (int i=0; i<n; i++) if (gamma[i]) wt[i] = 0.;
+  delete []gamma;
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * method to get the group velocities of all branches at q, by Hellmann-Feynman:
+ * dw^2/dq = e^H dD/dq e, from the eigenvalues egv and eigenvectors evec (as
+ * by geteigen) and the derivatives dDq of the DM (as by getDMq). Within a set
+ * of degenerate branches, the velocities are the eigenvalues of the sub-block
+ * projected onto the direction of q, so that they are continuous along q.
+ * The velocities go to vel, [fftdim][3], in Cartesian coordinates and in
+ * units of the frequency times the length (e.g. THz x Angstrom, 100 m/s);
+ * in fractional coordinates if the lattice info is unknown. Thread safe.
+ * ---------------------------------------------------------------------------- */
+void DynMat::getvelocity(const double *q, const double *egv, const doublecomplex *evec,
+                         const doublecomplex *dDq, double *vel)
+{
+  const double tpi = 8.*atan(1.);
+  integer n = fftdim;
+  doublecomplex *T, *W[3], *U, *work;
+  double *dw2, *w, *rwork;
+  T = memory->create(T, fftdim2, "getvelocity:T");
+  for (int a=0; a<3; a++) W[a] = memory->create(W[a], fftdim2, "getvelocity:W");
+  U     = memory->create(U, fftdim2, "getvelocity:U");
+  work  = memory->create(work, 2*fftdim, "getvelocity:work");
+  dw2   = memory->create(dw2, 3*fftdim, "getvelocity:dw2");
+  w     = memory->create(w, fftdim, "getvelocity:w");
+  rwork = memory->create(rwork, 3*fftdim, "getvelocity:rwork");
+
+  // the lattice vectors map d/dq onto d/dk; w = 2pi nu for the THz units
+  double A[9], u[3], fac;
+  for (int i=0; i<9; i++) A[i] = flag_latinfo ? basevec[i] : double(i%4 == 0);
+  fac = strcmp(funit, "THz") == 0 ? 1. : 1./tpi;
+
+  // the direction of q in Cartesian, to lift the degeneracy; x at gamma
+  double qn = 0.;
+  for (int a=0; a<3; a++){
+    u[a] = 0.;
+    for (int d=0; d<3; d++) u[a] += q[d]*(flag_latinfo ? ibasevec[d*3+a] : double(d == a));
+    qn += u[a]*u[a];
+  }
+  if (qn < 1.e-20){ u[0] = 1.; u[1] = u[2] = 0.; }
+  else for (int a=0; a<3; a++) u[a] /= sqrt(qn);
+
+  // branches closer than tol are degenerate, and those below tol have no
+  // velocity; the scale of the frequencies is also guessed from dD, as they
+  // might all vanish at gamma
+  double fmax = 0.;
+  for (int i=0; i<fftdim; i++) fmax = MAX(fmax, fabs(egv[i]));
+  for (int k=0; k<3*fftdim2; k++) fmax = MAX(fmax, eml2f*sqrt(fabs(dDq[k].r)+fabs(dDq[k].i)));
+  const double tol = 1.e-5*fmax;
+
+  // W_a = E^H dD/dk_a E, only the blocks of degenerate branches are needed
+  char transn = 'N';
+  doublecomplex one, zero;
+  one.r = 1.; one.i = zero.r = zero.i = 0.;
+  for (int a=0; a<3; a++) for (int k=0; k<fftdim2; k++) W[a][k].r = W[a][k].i = 0.;
+  for (int d=0; d<3; d++){
+    zgemm_(&transn, &transn, &n, &n, &n, &one, (doublecomplex *)&dDq[d*fftdim2], &n,
+           (doublecomplex *)evec, &n, &zero, T, &n);
+    for (int i=0; i<fftdim; ){
+      int j1 = i+1;
+      while (j1 < fftdim && fabs(egv[j1]-egv[i]) <= tol) j1++;
+      for (int ii=i; ii<j1; ii++)
+      for (int jj=i; jj<j1; jj++){
+        double wr = 0., wi = 0.;
+        const doublecomplex *ei = &evec[ii*fftdim], *tj = &T[jj*fftdim];
+        for (int k=0; k<fftdim; k++){
+          wr += ei[k].r*tj[k].r + ei[k].i*tj[k].i;
+          wi += ei[k].r*tj[k].i - ei[k].i*tj[k].r;
+        }
+        for (int a=0; a<3; a++){
+          W[a][ii*fftdim+jj].r += A[d*3+a]*wr;
+          W[a][ii*fftdim+jj].i += A[d*3+a]*wi;
+        }
+      }
+      i = j1;
+    }
+  }
+
+  for (int i=0; i<fftdim; ){
+    int j1 = i+1;
+    while (j1 < fftdim && fabs(egv[j1]-egv[i]) <= tol) j1++;
+    int m = j1 - i;
+
+    if (m == 1){
+      for (int a=0; a<3; a++) dw2[a] = W[a][i*fftdim+i].r;
+    } else {
+      // diagonalize the block along u, then take the diagonal of each W_a;
+      // zheev sees the block transposed, so its eigenvectors are conjugated
+      char jobz = 'V', uplo = 'U';
+      integer nm = m, lwork = 2*m, info;
+      for (int ii=0; ii<m; ii++)
+      for (int jj=0; jj<m; jj++){
+        U[ii*m+jj].r = U[ii*m+jj].i = 0.;
+        for (int a=0; a<3; a++){
+          U[ii*m+jj].r += u[a]*W[a][(i+ii)*fftdim+i+jj].r;
+          U[ii*m+jj].i += u[a]*W[a][(i+ii)*fftdim+i+jj].i;
+        }
+      }
+      zheev_(&jobz, &uplo, &nm, U, &nm, w, work, &lwork, rwork, &info);
+      for (int l=0; l<m; l++)
+      for (int a=0; a<3; a++){
+        double s = 0.;
+        for (int ii=0; ii<m; ii++)
+        for (int jj=0; jj<m; jj++){
+          const doublecomplex x = W[a][(i+ii)*fftdim+i+jj], ui = U[l*m+ii], uj = U[l*m+jj];
+          double pr = ui.r*x.r - ui.i*x.i, pi = ui.r*x.i + ui.i*x.r;
+          s += uj.r*pr + uj.i*pi;
+        }
+        dw2[l*3+a] = s;
+      }
+    }
+
+    // dw/dk = dw^2/dk / (2w), in the units of the frequencies
+    for (int l=0; l<m; l++){
+      double f = fabs(egv[i+l]);
+      for (int a=0; a<3; a++)
+        vel[(i+l)*3+a] = f > tol ? fac*eml2f*eml2f*dw2[l*3+a]/(2.*f) : 0.;
+    }
+    i = j1;
+  }
+
+  memory->destroy(T);
+  for (int a=0; a<3; a++) memory->destroy(W[a]);
+  memory->destroy(U);
+  memory->destroy(work);
+  memory->destroy(dw2);
+  memory->destroy(w);
+  memory->destroy(rwork);
+
 return;
 }
 
@@ -549,12 +922,186 @@ void DynMat::GaussJordan(int n, double *Mat)
 return;
 }
 
+/* ----------------------------------------------------------------------------
+ * Public method to tell the interpolation that the coming q-points lie on the
+ * uniform mesh m, ordered slowest along axis; m = NULL when it is no longer so.
+ * ---------------------------------------------------------------------------- */
+void DynMat::set_qmesh(const int *m, const int axis)
+{
+  interpolate->set_mesh(m, axis);
+
+return;
+}
+
 /* ----------------------------------------------------------------------------
  * Public method to reset the interpolation method
  * ---------------------------------------------------------------------------- */
 void DynMat::reset_interp_method()
 {
-  interpolate->set_method();
+  if (me == 0) interpolate->set_method();
+#ifdef UseMPI
+  int im = interpolate->which;
+  MPI_Bcast(&im, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (me != 0) interpolate->set_method(im);
+#endif
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to tell the interpolation method in use.
+ * ---------------------------------------------------------------------------- */
+int DynMat::interp_method()
+{
+  return interpolate->which;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to estimate the error of the local interpolations from the
+ * mesh itself: each mesh point is reconstructed from its neighbors along each
+ * axis, as if it were left out, linearly from the two nearest and cubically
+ * from the four nearest ones, and the largest change of the frequencies is
+ * taken. As the reconstruction is made on a mesh twice as coarse, the errors
+ * are scaled down by 2^2 and 2^4 to predict those of the trilinear and the
+ * (tricubic or B-spline) interpolations. The predicted errors are reported by
+ * region of q; optionally, the cells with any vertex of error above a given
+ * tolerance are then done by Fourier interpolation. All ranks share the work.
+ * ---------------------------------------------------------------------------- */
+void DynMat::estimate_error()
+{
+  int n[3], lo = 0, hi = npt;
+  n[0] = nx; n[1] = ny; n[2] = nz;
+#ifdef UseMPI
+  lo = int(bigint(npt)*me/nprocs);
+  hi = int(bigint(npt)*(me+1)/nprocs);
+#endif
+
+  double **err, *egv, *f0;
+  doublecomplex *Dr;
+  err = memory->create(err, 2, npt, "estimate_error:err");
+  egv = memory->create(egv, fftdim, "estimate_error:egv");
+  f0  = memory->create(f0,  fftdim, "estimate_error:f0");
+  Dr  = memory->create(Dr,  fftdim2, "estimate_error:Dr");
+  for (int i=0; i<npt; i++) err[0][i] = err[1][i] = 0.;
+
+  for (int ip=lo; ip<hi; ip++){
+    int idx[3];
+    idx[0] = ip/(ny*nz); idx[1] = (ip/nz)%ny; idx[2] = ip%nz;
+    for (int k=0; k<fftdim2; k++) Dr[k] = DM_all[ip][k];
+    geteigen(f0, 0, Dr);
+
+    for (int d=0; d<3; d++){
+      if (n[d] < 2) continue;
+      int nb[4];
+      for (int j=0; j<4; j++){
+        int jdx[3] = {idx[0], idx[1], idx[2]};
+        jdx[d] = (idx[d] + (j < 2 ? j-2 : j-1) + 2*n[d])%n[d];
+        nb[j] = (jdx[0]*ny+jdx[1])*nz+jdx[2];
+      }
+
+      // m = 0, linear; m = 1, cubic, which needs 5 distinct points on the axis
+      for (int m=0; m<2; m++){
+        double c[4] = {0., 0.5, 0.5, 0.};
+        if (m == 1 && n[d] >= 5){
+          c[0] = c[3] = -1./6.;
+          c[1] = c[2] = 4./6.;
+        }
+        for (int k=0; k<fftdim2; k++){
+          Dr[k].r = Dr[k].i = 0.;
+          for (int j=0; j<4; j++){
+            Dr[k].r += c[j]*DM_all[nb[j]][k].r;
+            Dr[k].i += c[j]*DM_all[nb[j]][k].i;
+          }
+        }
+        geteigen(egv, 0, Dr);
+        double emax = 0.;
+        for (int i=0; i<fftdim; i++) emax = MAX(emax, fabs(egv[i]-f0[i]));
+        err[m][ip] = MAX(err[m][ip], emax/(m ? 16. : 4.));
+      }
+    }
+  }
+#ifdef UseMPI
+  MPI_Allreduce(MPI_IN_PLACE, err[0], 2*npt, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+#endif
+
+  // report by region, according to the largest component of q in [-1/2, 1/2)
+  double tol = 0.;
+  if (me == 0){
+    const char *region[4] = {"[0, 1/8)", "[1/8, 1/4)", "[1/4, 3/8)", "[3/8, 1/2]"};
+    int nreg[4];
+    double rms[2][4], emax[2][4];
+    for (int r=0; r<4; r++){
+      nreg[r] = 0;
+      rms[0][r] = rms[1][r] = emax[0][r] = emax[1][r] = 0.;
+    }
+    for (int ip=0; ip<npt; ip++){
+      int idx[3];
+      idx[0] = ip/(ny*nz); idx[1] = (ip/nz)%ny; idx[2] = ip%nz;
+      double qmax = 0.;
+      for (int d=0; d<3; d++){
+        double qd = double(idx[d])/double(n[d]);
+        if (qd >= 0.5) qd -= 1.;
+        qmax = MAX(qmax, fabs(qd));
+      }
+      int r = int(qmax*8.); if (r > 3) r = 3;
+      nreg[r]++;
+      for (int m=0; m<2; m++){
+        rms[m][r] += err[m][ip]*err[m][ip];
+        emax[m][r] = MAX(emax[m][r], err[m][ip]);
+      }
+    }
+
+    printf("\n"); for (int i=0; i<60; i++) printf("=");
+    printf("\nEstimated errors of the frequencies (%s) by local interpolations,\n", funit);
+    printf("by the largest component of q (in unit of the reciprocal vectors):\n");
+    printf("  |q|max        #points  trilinear: rms / max    cubic: rms / max\n");
+    for (int r=0; r<4; r++){
+      if (nreg[r] < 1) continue;
+      printf("  %-12s %8d    %10.3e %10.3e   %10.3e %10.3e\n", region[r], nreg[r],
+        sqrt(rms[0][r]/nreg[r]), emax[0][r], sqrt(rms[1][r]/nreg[r]), emax[1][r]);
+    }
+    for (int i=0; i<60; i++) printf("=");
+    printf("\n");
+
+    if (interpolate->which == 3) printf("The Fourier interpolation is in use already.\n");
+    else {
+      char str[MAXLINE];
+      printf("Please input the tolerance of the error above which a cell is done by\n");
+      printf("Fourier interpolation instead, 0 for none [0]: ");
+      if (fgets(str,MAXLINE,stdin) && strtok(str," \t\n\r\f")) tol = atof(str);
+    }
+  }
+#ifdef UseMPI
+  MPI_Bcast(&tol, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+#endif
+
+  // flag the cells with any vertex above tol, by the error of the method in use
+  if (tol > 0. && interpolate->which != 3){
+    int m = interpolate->which == 2 ? 0 : 1, nhard = 0, *flags;
+    flags = memory->create(flags, npt, "estimate_error:flags");
+    for (int ip=0; ip<npt; ip++){
+      int idx[3];
+      idx[0] = ip/(ny*nz); idx[1] = (ip/nz)%ny; idx[2] = ip%nz;
+      double emax = 0.;
+      for (int v=0; v<8; v++){
+        int jdx[3];
+        for (int d=0; d<3; d++) jdx[d] = (idx[d] + ((v>>d)&1))%n[d];
+        emax = MAX(emax, err[m][(jdx[0]*ny+jdx[1])*nz+jdx[2]]);
+      }
+      flags[ip] = emax > tol;
+      nhard += flags[ip];
+    }
+    interpolate->set_hard(flags);
+    qcache->clear();
+    if (me == 0) printf("%d of %d cells (%.1f%%) will be done by Fourier interpolation.\n",
+      nhard, npt, double(nhard)/double(npt)*100.);
+    memory->destroy(flags);
+  }
+
+  memory->destroy(err);
+  memory->destroy(egv);
+  memory->destroy(f0);
+  memory->destroy(Dr);
 
 return;
 }
@@ -578,6 +1125,52 @@ void DynMat::help()
   printf("              will also inform the code to skip all q-points that is in the vicinity\n");
   printf("              of the gamma point when evaluating phonon DOS and/or phonon dispersion.\n\n");
   printf("              By default, this is not set; and not expected for uncharged systems.\n\n");
+  printf("  -t ni ne [nb] To evaluate the q-points by a pipeline, with ni threads to interpolate\n");
+  printf("              the dynamical matrices, ne threads to solve the eigen problems, and the\n");
+  printf("              main thread to reduce/write the results, using nb buffers for the DMs\n");
+  printf("              (default 2*(ni+ne) batches of up to 16 q-points). By default, the\n");
+  printf("              q-points are done batch by batch by the main thread.\n\n");
+  printf("  -c n        To keep the tricubic coefficients of at most n cells of the mesh in\n");
+  printf("              an LRU cache, so that q-points in the same cell reuse them; n = 0 turns\n");
+  printf("              the cache off, n < 0 computes the coefficients of all cells up front,\n");
+  printf("              which takes 64 times the memory of the dynamical matrices. By default,\n");
+  printf("              as many cells as fit in 64 MB are cached.\n\n");
+  printf("  -l          To use the memory-lean tricubic interpolation: the derivatives on the\n");
+  printf("              mesh are not stored, which takes 7 times the memory of the dynamical\n");
+  printf("              matrices, but are got from the neighborhood of each cell when it is\n");
+  printf("              first met; best used together with the cache of -c.\n\n");
+  printf("  -m nm hp    To set the placement of the big arrays (the dynamical matrices on the\n");
+  printf("              FFT mesh and the derivatives for tricubic interpolation) on NUMA nodes:\n");
+  printf("              nm = 1, interleaved over all nodes; nm = 2, first touched by the threads\n");
+  printf("              of the interpolation stage; and to back them by 2 MB huge pages: hp = 1,\n");
+  printf("              transparent huge pages; hp = 2, explicit ones, if reserved by the system.\n");
+  printf("              If nm > 0, the threads of -t are also bound to the cpus. By default,\n");
+  printf("              nm = hp = 0, i.e., nothing special is done.\n\n");
+  printf("  -q mb       To set the memory budget, in MB, of the cache that keeps the DMs and\n");
+  printf("              eigen results of the recently used q-points, so that a q-point met again\n");
+  printf("              (e.g., the same q-mesh for DOS and thermal properties) is not computed\n");
+  printf("              again; the hits and misses are reported at exit. mb = 0 turns it off;\n");
+  printf("              by default, mb = 64.\n\n");
+  printf("  -o n        To evaluate the q-points of a mesh along a space-filling curve over the\n");
+  printf("              cells of the mesh read, so that successive q-points share the data of\n");
+  printf("              nearby cells: n = 1, Morton (Z-order) curve; n = 2, Hilbert curve. The\n");
+  printf("              outputs per q-point are still written in the order of the mesh; by\n");
+  printf("              default, n = 0, i.e., in the order of the mesh. Not used with the\n");
+  printf("              Fourier interpolation, whose DMs on a mesh are got slab by slab.\n\n");
+  printf("  -b n w [w2] To set the kernel to smooth the DOS histograms with: n = 1, Gaussian\n");
+  printf("              of standard deviation w; n = 2, Lorentzian of half width w; n = 3,\n");
+  printf("              Voigt, i.e., the Gaussian of w convolved with the Lorentzian of w2; the\n");
+  printf("              widths are in the unit of the frequencies. It is used when smoothing is\n");
+  printf("              asked for the DOS, and then also for the local DOS from eigenvectors.\n");
+  printf("              By default, a Gaussian of 2*sqrt(2) intervals is used for the DOS only.\n");
+  printf("              n = 4 takes adaptive Gaussians instead of the histograms of the DOS and\n");
+  printf("              the local DOS: each mode gets a width of w times the change of its\n");
+  printf("              frequency across a cell of the q-mesh, from its group velocity.\n\n");
+  printf("  -d tol      To set the tolerance of the sparse Hessian at gamma, used by the RSGF\n");
+  printf("              and KPM methods: the 3 x 3 blocks between two atoms whose elements are\n");
+  printf("              all below tol times the largest element are dropped; the sparsity and\n");
+  printf("              the error are reported. By default, tol = 0, which keeps all nonzero\n");
+  printf("              blocks as the dense matrix did; e.g. 1e-6 suits big cells.\n\n");
   printf("  -h          To print out this help info.\n\n");
   printf("  file        To define the filename that carries the binary dynamical matrice generated\n");
   printf("              by fix-phonon. If not provided, the code will ask for it.\n");
@@ -6,6 +6,10 @@
 #include "string.h"
 #include "memory.h"
 #include "interpolate.h"
+#include "qcache.h"
+#ifdef UseMPI
+#include "mpi.h"
+#endif
 
 extern "C"{
 #include "f2c.h"
@@ -22,18 +26,35 @@ public:
 
   int nx, ny, nz, nucell;
   int sysdim, fftdim;
+  int me, nprocs;       // rank info; rank 0 talks to the user and reads the file
   double eml2f;
   char *funit;
 
   void getDMq(double *);
   void getDMq(double *, double *);
+  void getDMq(double *, double *, doublecomplex *);
+  void getDMq(const double (*)[3], const int, double *, doublecomplex *, doublecomplex *dDq = NULL);
   void writeDMq(double *);
   void writeDMq(double *, const double, FILE *fp);
+  void writeDMq(double *, const double, FILE *fp, doublecomplex *);
   int geteigen(double *, int);
+  int geteigen(double *, int, doublecomplex *);
+  void getvelocity(const double *, const double *, const doublecomplex *, const doublecomplex *, double *);
   void reset_interp_method();
+  void estimate_error();
+  int interp_method();
+  void set_qmesh(const int *, const int);
+  int cache_lookup(const double *, const int, double *, doublecomplex *, double *);
+  void cache_store(const double *, const int, const doublecomplex *, const double *, const doublecomplex *);
 
   doublecomplex **DM_q;
 
+  int nthreads[2], nbuffer; // threads of the interpolation/eigen stages, # of buffers
+  int qorder;               // order of the q-points of a mesh: 0, natural; 1, Morton; 2, Hilbert
+  int bkind;                // broadening of the histogram DOSs: 1, Gaussian; 2, Lorentzian; 3, Voigt; 4, adaptive
+  double bwidth[2];         // its widths, in the unit of frequency
+  double droptol;           // blocks of the sparse Hessian below it, relative to the largest element, are dropped
+
   int flag_latinfo;
   double Tmeasure, basevec[9], ibasevec[9];
   double **basis;
@@ -42,7 +63,13 @@ public:
 private:
 
   int flag_skip, flag_reset_gamma;
+  int flag_cache, ncache;   // # of cells to cache the tricubic coefficients, if set
+  int flag_lean;            // memory-lean tricubic or not
   Interpolate *interpolate;
+  QCache *qcache;           // DMs and eigen results of the recently used q-points
+  double qcache_mb;         // memory budget of qcache, in MB
+  int flag_qlast;           // 1 if DM_q holds the DM at qlast as got by getDMq
+  double qlast[3];
   
   Memory *memory;
   int npt, fftdim2;
@@ -61,5 +88,8 @@ private:
   void GaussJordan(int, double *);
 
   void help();
+#ifdef UseMPI
+  void bcast_data();
+#endif
 };
 #endif
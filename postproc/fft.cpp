@@ -0,0 +1,118 @@
+#include "fft.h"
+#include "math.h"
+
+/* ----------------------------------------------------------------------------
+ * Class FFT does the discrete Fourier transform of length n by the mixed-radix
+ * Cooley-Tukey algorithm; any n is accepted, though large prime factors are
+ * done at O(p^2) cost. Each of the n "points" is a block of m contiguous
+ * complex numbers that are transformed together, so that the inner loops run
+ * over the blocks (e.g. all elements of a dynamical matrix) and that a
+ * multi-dimensional array can be transformed one axis at a time in place.
+ * ---------------------------------------------------------------------------- */
+FFT::FFT(const int len)
+{
+  n = len;
+  nfac = 0;
+  int rest = n;
+  for (int p=2; rest > 1 && nfac < 31; p++){
+    if (p*p > rest) p = rest;
+    while (rest%p == 0 && nfac < 31){
+      fac[nfac++] = p;
+      rest /= p;
+    }
+  }
+  if (rest > 1) fac[nfac++] = rest;
+
+  const double tpi = 8.*atan(1.);
+  wr = new double[n];
+  wi = new double[n];
+  for (int k=0; k<n; k++){
+    wr[k] =  cos(tpi*double(k)/double(n));
+    wi[k] = -sin(tpi*double(k)/double(n));
+  }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Deconstructor
+ * ---------------------------------------------------------------------------- */
+FFT::~FFT()
+{
+  delete []wr;
+  delete []wi;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to transform data, n blocks of m, in place:
+ *   out[k] = sum_j data[j] exp(sign 2pi i j k/n),
+ * without normalization; sign = -1 is the forward transform. Thread safe.
+ * ---------------------------------------------------------------------------- */
+void FFT::execute(doublecomplex *data, const int m, const int sign)
+{
+  if (n < 2 || m < 1) return;
+
+  int pmax = 0;
+  for (int i=0; i<nfac; i++) if (fac[i] > pmax) pmax = fac[i];
+  doublecomplex *work = new doublecomplex[(long)n*m];
+  doublecomplex *tmp  = new doublecomplex[(long)pmax*m];
+  memcpy(work, data, sizeof(doublecomplex)*n*m);
+
+  recurse(work, data, n, 1, m, 0, sign, tmp);
+
+  delete []work;
+  delete []tmp;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to transform len blocks of in, taken every s blocks, into
+ * len contiguous blocks of out; the sub-transforms of the first factor are
+ * done first, and then combined by butterflies of that factor.
+ * ---------------------------------------------------------------------------- */
+void FFT::recurse(const doublecomplex *in, doublecomplex *out, const int len, const int s,
+                  const int m, const int ifac, const int sign, doublecomplex *tmp)
+{
+  if (len == 1){
+    memcpy(out, in, sizeof(doublecomplex)*m);
+    return;
+  }
+
+  const int p = fac[ifac], len2 = len/p, tw = n/len, tp = n/p;
+  for (int r=0; r<p; r++) recurse(in+(long)r*s*m, out+(long)r*len2*m, len2, s*p, m, ifac+1, sign, tmp);
+
+  for (int k=0; k<len2; k++){
+    // twiddle the k-th point of each sub-transform
+    for (int r=0; r<p; r++){
+      const doublecomplex *x = out + (long)(r*len2+k)*m;
+      doublecomplex *t = tmp + (long)r*m;
+      int it = r*k*tw;
+      double c = wr[it], sn = sign < 0 ? wi[it] : -wi[it];
+      for (int i=0; i<m; i++){
+        t[i].r = x[i].r*c - x[i].i*sn;
+        t[i].i = x[i].r*sn + x[i].i*c;
+      }
+    }
+
+    // a DFT of length p over the twiddled points
+    for (int q=0; q<p; q++){
+      doublecomplex *y = out + (long)(k+q*len2)*m;
+      for (int i=0; i<m; i++) y[i] = tmp[i];
+      for (int r=1; r<p; r++){
+        int it = ((r*q)%p)*tp;
+        double c = wr[it], sn = sign < 0 ? wi[it] : -wi[it];
+        const doublecomplex *t = tmp + (long)r*m;
+        for (int i=0; i<m; i++){
+          y[i].r += t[i].r*c - t[i].i*sn;
+          y[i].i += t[i].r*sn + t[i].i*c;
+        }
+      }
+    }
+  }
+
+return;
+}
+/* ---------------------------------------------------------------------------- */
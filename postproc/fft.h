@@ -0,0 +1,28 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+extern "C"{
+#include "f2c.h"
+}
+
+class FFT {
+public:
+  FFT(const int);
+  ~FFT();
+
+  void execute(doublecomplex *, const int, const int);
+
+  int n;
+
+private:
+  int nfac, fac[32];    // prime factors of n, smallest first
+  double *wr, *wi;      // exp(-2pi i k/n), k = 0, n-1
+
+  void recurse(const doublecomplex *, doublecomplex *, const int, const int, const int,
+               const int, const int, doublecomplex *);
+};
+
+#endif
@@ -18,9 +18,9 @@
  *   max     (input, value)  maximum value for the angular frequency
  *   ndos    (input, value)  total number of points in LDOS
  *   eps     (input, value)  epson that govens the width of delta-function
- *   Hessian (input, pointer of pointer) mass-weighted force constant matrix, of
- *                           dimension [natom*sysdim][natm*sysdim]; it is actually
- *                           the dynamical matrix at gamma point
+ *   Hessian (input, pointer) mass-weighted force constant matrix, of dimension
+ *                           [natom*sysdim][natm*sysdim], as sparse blocks; it is
+ *                           actually the dynamical matrix at gamma point
  *   itm     (input, value)  index of the atom to evaluate local phonon DOS, from 0
  *   lpdos   (output, array) double array of size (ndos, sdim)
  *******************************************************************************
@@ -37,13 +37,14 @@
  * Constructor is used as the main driver
  *----------------------------------------------------------------------------*/
 Green::Green(const int ntm, const int sdim, const int niter, const double min, const double max,
-             const int ndos, const double eps, double **Hessian, const int itm, double **lpdos)
+             const int ndos, const double eps, Sparse *Hessian, const int itm, double **lpdos)
 {
   const double tpi = 8.*atan(1.);
   natom = ntm; sysdim = sdim; nit = niter; epson = eps;
   wmin = min*tpi; wmax = max*tpi; nw = ndos + (ndos+1)%2;
   H = Hessian; iatom = itm;
   ldos = lpdos;
+  alpha = beta = NULL;
 
   memory = new Memory;
   if (natom < 1 || iatom < 0 || iatom >= natom){
@@ -87,48 +88,55 @@ return;
 }
       
 /*------------------------------------------------------------------------------
- * Private method to diagonalize a matrix by the Lanczos algorithm
+ * Private method to diagonalize a matrix by the Lanczos algorithm; the chains
+ * of all directions are run together, as a block of vectors [ndim][sysdim],
+ * so that each pass over the Hessian serves all of them.
  *----------------------------------------------------------------------------*/
 void Green::Lanczos()
 {
   double *vp, *v, *w, *ptr;
+  const int m = sysdim;
 
-  vp = new double [ndim];
-  v  = new double [ndim];
-  w  = new double [ndim];
+  vp = new double [ndim*m];
+  v  = new double [ndim*m];
+  w  = new double [ndim*m];
   
   int ipos = iatom*sysdim;
 
-  // Loop over dimension
+  for (int i=0; i<ndim*m; i++){vp[i] = v[i] = 0.;}
   for (int idim=0; idim<sysdim; idim++){
     beta[idim][0] = 0.;
-    for (int i=0; i<ndim; i++){vp[i] = v[i] = 0.;}
-    v[ipos+idim] = 1.;
+    v[(ipos+idim)*m+idim] = 1.;
+  }
+
+  // Loop on fraction levels
+  for (int i=0; i<nit; i++){
+    H->multiply(v, w, m);
 
-    // Loop on fraction levels
-    for (int i=0; i<nit; i++){
+    // Loop over dimension
+    for (int idim=0; idim<sysdim; idim++){
       double sum_a = 0.;
       for (int j=0; j<ndim; j++){
-        double sumHv = 0.;
-        for (int k=0; k<ndim; k++) sumHv += H[j][k]*v[k];
-        w[j] = sumHv - beta[idim][i]*vp[j];
-        sum_a += w[j]*v[j];
+        w[j*m+idim] -= beta[idim][i]*vp[j*m+idim];
+        sum_a += w[j*m+idim]*v[j*m+idim];
       }
       alpha[idim][i] = sum_a;
 
-      for (int k=0; k<ndim; k++) w[k] -= alpha[idim][i]*v[k];
+      for (int k=0; k<ndim; k++) w[k*m+idim] -= alpha[idim][i]*v[k*m+idim];
 
       double gamma = 0.;
-      for (int k=0; k<ndim; k++) gamma += w[k]*v[k];
-      for (int k=0; k<ndim; k++) w[k] -= gamma*v[k];
+      for (int k=0; k<ndim; k++) gamma += w[k*m+idim]*v[k*m+idim];
+      for (int k=0; k<ndim; k++) w[k*m+idim] -= gamma*v[k*m+idim];
 
       double sum_b = 0.;
-      for (int k=0; k<ndim; k++) sum_b += w[k]*w[k];
+      for (int k=0; k<ndim; k++) sum_b += w[k*m+idim]*w[k*m+idim];
       beta[idim][i+1] = sqrt(sum_b);
+    }
 
-      ptr = vp; vp = v; v = ptr;
+    ptr = vp; vp = v; v = ptr;
+    for (int idim=0; idim<sysdim; idim++){
       double tmp = 1./beta[idim][i+1];    
-      for (int k=0; k<ndim; k++) v[k] = w[k]*tmp;
+      for (int k=0; k<ndim; k++) v[k*m+idim] = w[k*m+idim]*tmp;
     }
   }
 
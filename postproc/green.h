@@ -2,11 +2,12 @@
 #define GREEN_H
 
 #include "memory.h"
+#include "sparse.h"
 
 class Green{
 public:
   Green(const int, const int, const int, const double, const double,
-        const int, const double, double **, const int, double **);
+        const int, const double, Sparse *, const int, double **);
   ~Green();
 
 private:
@@ -19,7 +20,8 @@ private:
 
   int natom, iatom, sysdim, nit, nw, ndim;
   double dw, wmin, wmax, epson;
-  double **alpha, **beta, **H; 
+  double **alpha, **beta;
+  Sparse *H;
   Memory *memory;
 };
 #endif
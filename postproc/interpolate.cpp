@@ -1,5 +1,8 @@
 #include "interpolate.h"
 #include "math.h"
+#include <map>
+#include <vector>
+#include <algorithm>
 
 #define MAXLINE 256
 #define MIN(a,b) ((a)>(b)?(b):(a))
@@ -23,6 +26,38 @@ Interpolate::Interpolate(int nx, int ny, int nz, int ndm, doublecomplex **DM)
   Dfdx = Dfdy = Dfdz = D2fdxdy = D2fdxdz = D2fdydz = D3fdxdydz = NULL;
   flag_reset_gamma = flag_allocated_dfs = 0;
 
+  // without lattice info, all atoms are taken at the origin of a cubic cell
+  nucell = 1;
+  sysdim = int(sqrt(double(ndim))+0.5);
+  for (int i=0; i<9; i++) latvec[i] = 0.;
+  latvec[0] = latvec[4] = latvec[8] = 1.;
+  basis = memory->create(basis, nucell, 3, "Interpolate:basis");
+  basis[0][0] = basis[0][1] = basis[0][2] = 0.;
+  nR = 0;
+  Rvec = NULL;
+  Phi  = NULL;
+  Spl  = NULL;
+  Mesh[0] = Mesh[1] = Mesh[2] = axis = nslab = 0;
+  fft[0] = fft[1] = fft[2] = NULL;
+  hard = NULL;
+
+  // by default, the coefficients of as many cells as fit in 64 MB are cached
+  ncoeff = 128*ndim;
+  ncache = MAX(8, 8388608/ncoeff);
+  coeff  = NULL;
+  lean   = 0;
+
+  // the 64 x 64 matrix of libtricubic that maps the values and derivatives
+  // at the vertices onto the coefficients, column by column
+  Amat = memory->create(Amat, 64, 64, "Interpolate:Amat");
+  double x[64], a[64];
+  for (int j=0; j<64; j++){
+    for (int i=0; i<64; i++) x[i] = 0.;
+    x[j] = 1.;
+    tricubic_get_coeff(a, &x[0], &x[8], &x[16], &x[24], &x[32], &x[40], &x[48], &x[56]);
+    for (int i=0; i<64; i++) Amat[i][j] = a[i];
+  }
+
 return;
 }
 
@@ -31,79 +66,262 @@ return;
  * ---------------------------------------------------------------------------- */
 void Interpolate::tricubic_init()
 {
-  // prepare necessary data for tricubic
-  if (flag_allocated_dfs == 0){
-    Dfdx = memory->create(Dfdx, Npt, ndim, "Interpolate_Interpolate:Dfdx");
-    Dfdy = memory->create(Dfdy, Npt, ndim, "Interpolate_Interpolate:Dfdy");
-    Dfdz = memory->create(Dfdz, Npt, ndim, "Interpolate_Interpolate:Dfdz");
-    D2fdxdy = memory->create(D2fdxdy, Npt, ndim, "Interpolate_Interpolate:D2fdxdy");
-    D2fdxdz = memory->create(D2fdxdz, Npt, ndim, "Interpolate_Interpolate:D2fdxdz");
-    D2fdydz = memory->create(D2fdydz, Npt, ndim, "Interpolate_Interpolate:D2fdydz");
-    D3fdxdydz = memory->create(D3fdxdydz, Npt, ndim, "Interpolate_Interpolate:D2fdxdydz");
+  clear_cache();
+
+  // in the memory-lean mode, the derivatives are got per cell when needed
+  if (lean){
+    memory->destroy(Dfdx);
+    memory->destroy(Dfdy);
+    memory->destroy(Dfdz);
+    memory->destroy(D2fdxdy);
+    memory->destroy(D2fdxdz);
+    memory->destroy(D2fdydz);
+    memory->destroy(D3fdxdydz);
+    Dfdx = Dfdy = Dfdz = D2fdxdy = D2fdxdz = D2fdydz = D3fdxdydz = NULL;
+    flag_allocated_dfs = 0;
+
+  } else {
+    // prepare necessary data for tricubic
+    if (flag_allocated_dfs == 0){
+      Dfdx = memory->create_big(Dfdx, Npt, ndim, "Interpolate_Interpolate:Dfdx");
+      Dfdy = memory->create_big(Dfdy, Npt, ndim, "Interpolate_Interpolate:Dfdy");
+      Dfdz = memory->create_big(Dfdz, Npt, ndim, "Interpolate_Interpolate:Dfdz");
+      D2fdxdy = memory->create_big(D2fdxdy, Npt, ndim, "Interpolate_Interpolate:D2fdxdy");
+      D2fdxdz = memory->create_big(D2fdxdz, Npt, ndim, "Interpolate_Interpolate:D2fdxdz");
+      D2fdydz = memory->create_big(D2fdydz, Npt, ndim, "Interpolate_Interpolate:D2fdydz");
+      D3fdxdydz = memory->create_big(D3fdxdydz, Npt, ndim, "Interpolate_Interpolate:D2fdxdydz");
+
+      flag_allocated_dfs = 1;
+    }
+
+    // get the derivatives
+    int n=0;
+    const double half = 0.5, one4 = 0.25, one8 = 0.125;
+    for (int ii=0; ii<Nx; ii++)
+    for (int jj=0; jj<Ny; jj++)
+    for (int kk=0; kk<Nz; kk++){
+
+      int ip = (ii+1)%Nx, jp = (jj+1)%Ny, kp = (kk+1)%Nz;
+      int im = (ii-1+Nx)%Nx, jm = (jj-1+Ny)%Ny, km = (kk-1+Nz)%Nz;
 
-    flag_allocated_dfs = 1;
+      int p100 = (ip*Ny+jj)*Nz+kk;
+      int p010 = (ii*Ny+jp)*Nz+kk;
+      int p001 = (ii*Ny+jj)*Nz+kp;
+      int p110 = (ip*Ny+jp)*Nz+kk;
+      int p101 = (ip*Ny+jj)*Nz+kp;
+      int p011 = (ii*Ny+jp)*Nz+kp;
+      int pm00 = (im*Ny+jj)*Nz+kk;
+      int p0m0 = (ii*Ny+jm)*Nz+kk;
+      int p00m = (ii*Ny+jj)*Nz+km;
+      int pmm0 = (im*Ny+jm)*Nz+kk;
+      int pm0m = (im*Ny+jj)*Nz+km;
+      int p0mm = (ii*Ny+jm)*Nz+km;
+      int p1m0 = (ip*Ny+jm)*Nz+kk;
+      int p10m = (ip*Ny+jj)*Nz+km;
+      int p01m = (ii*Ny+jp)*Nz+km;
+      int pm10 = (im*Ny+jp)*Nz+kk;
+      int pm01 = (im*Ny+jj)*Nz+kp;
+      int p0m1 = (ii*Ny+jm)*Nz+kp;
+      int p111 = (ip*Ny+jp)*Nz+kp;
+      int pm11 = (im*Ny+jp)*Nz+kp;
+      int p1m1 = (ip*Ny+jm)*Nz+kp;
+      int p11m = (ip*Ny+jp)*Nz+km;
+      int pm1m = (im*Ny+jp)*Nz+km;
+      int p1mm = (ip*Ny+jm)*Nz+km;
+      int pmm1 = (im*Ny+jm)*Nz+kp;
+      int pmmm = (im*Ny+jm)*Nz+km;
+
+      for (int idim=0; idim<ndim; idim++){
+        Dfdx[n][idim].r = (data[p100][idim].r - data[pm00][idim].r) * half;
+        Dfdx[n][idim].i = (data[p100][idim].i - data[pm00][idim].i) * half;
+        Dfdy[n][idim].r = (data[p010][idim].r - data[p0m0][idim].r) * half;
+        Dfdy[n][idim].i = (data[p010][idim].i - data[p0m0][idim].i) * half;
+        Dfdz[n][idim].r = (data[p001][idim].r - data[p00m][idim].r) * half;
+        Dfdz[n][idim].i = (data[p001][idim].i - data[p00m][idim].i) * half;
+        D2fdxdy[n][idim].r = (data[p110][idim].r - data[p1m0][idim].r - data[pm10][idim].r + data[pmm0][idim].r) * one4;
+        D2fdxdy[n][idim].i = (data[p110][idim].i - data[p1m0][idim].i - data[pm10][idim].i + data[pmm0][idim].i) * one4;
+        D2fdxdz[n][idim].r = (data[p101][idim].r - data[p10m][idim].r - data[pm01][idim].r + data[pm0m][idim].r) * one4;
+        D2fdxdz[n][idim].i = (data[p101][idim].i - data[p10m][idim].i - data[pm01][idim].i + data[pm0m][idim].i) * one4;
+        D2fdydz[n][idim].r = (data[p011][idim].r - data[p01m][idim].r - data[p0m1][idim].r + data[p0mm][idim].r) * one4;
+        D2fdydz[n][idim].i = (data[p011][idim].i - data[p01m][idim].i - data[p0m1][idim].i + data[p0mm][idim].i) * one4;
+        D3fdxdydz[n][idim].r = (data[p111][idim].r-data[pm11][idim].r - data[p1m1][idim].r - data[p11m][idim].r +
+                                data[p1mm][idim].r+data[pm1m][idim].r + data[pmm1][idim].r - data[pmmm][idim].r) * one8;
+        D3fdxdydz[n][idim].i = (data[p111][idim].i-data[pm11][idim].i - data[p1m1][idim].i - data[p11m][idim].i +
+                                data[p1mm][idim].i+data[pm1m][idim].i + data[pmm1][idim].i - data[pmmm][idim].i) * one8;
+      }
+      n++;
+    }
   }
 
-  // get the derivatives
-  int n=0;
-  const double half = 0.5, one4 = 0.25, one8 = 0.125;
-  for (int ii=0; ii<Nx; ii++)
-  for (int jj=0; jj<Ny; jj++)
-  for (int kk=0; kk<Nz; kk++){
+  // the coefficients of all cells are computed once, if asked
+  if (ncache < 0){
+    coeff = memory->create_big(coeff, Npt, ncoeff, "Interpolate:coeff");
+    for (int ii=0; ii<Nx; ii++)
+    for (int jj=0; jj<Ny; jj++)
+    for (int kk=0; kk<Nz; kk++) cell_coeff(ii, jj, kk, coeff[(ii*Ny+jj)*Nz+kk]);
+  }
 
-    int ip = (ii+1)%Nx, jp = (jj+1)%Ny, kp = (kk+1)%Nz;
-    int im = (ii-1+Nx)%Nx, jm = (jj-1+Ny)%Ny, km = (kk-1+Nz)%Nz;
-
-    int p100 = (ip*Ny+jj)*Nz+kk;
-    int p010 = (ii*Ny+jp)*Nz+kk;
-    int p001 = (ii*Ny+jj)*Nz+kp;
-    int p110 = (ip*Ny+jp)*Nz+kk;
-    int p101 = (ip*Ny+jj)*Nz+kp;
-    int p011 = (ii*Ny+jp)*Nz+kp;
-    int pm00 = (im*Ny+jj)*Nz+kk;
-    int p0m0 = (ii*Ny+jm)*Nz+kk;
-    int p00m = (ii*Ny+jj)*Nz+km;
-    int pmm0 = (im*Ny+jm)*Nz+kk;
-    int pm0m = (im*Ny+jj)*Nz+km;
-    int p0mm = (ii*Ny+jm)*Nz+km;
-    int p1m0 = (ip*Ny+jm)*Nz+kk;
-    int p10m = (ip*Ny+jj)*Nz+km;
-    int p01m = (ii*Ny+jp)*Nz+km;
-    int pm10 = (im*Ny+jp)*Nz+kk;
-    int pm01 = (im*Ny+jj)*Nz+kp;
-    int p0m1 = (ii*Ny+jm)*Nz+kp;
-    int p111 = (ip*Ny+jp)*Nz+kp;
-    int pm11 = (im*Ny+jp)*Nz+kp;
-    int p1m1 = (ip*Ny+jm)*Nz+kp;
-    int p11m = (ip*Ny+jp)*Nz+km;
-    int pm1m = (im*Ny+jp)*Nz+km;
-    int p1mm = (ip*Ny+jm)*Nz+km;
-    int pmm1 = (im*Ny+jm)*Nz+kp;
-    int pmmm = (im*Ny+jm)*Nz+km;
+return;
+}
 
-    for (int idim=0; idim<ndim; idim++){
-      Dfdx[n][idim].r = (data[p100][idim].r - data[pm00][idim].r) * half;
-      Dfdx[n][idim].i = (data[p100][idim].i - data[pm00][idim].i) * half;
-      Dfdy[n][idim].r = (data[p010][idim].r - data[p0m0][idim].r) * half;
-      Dfdy[n][idim].i = (data[p010][idim].i - data[p0m0][idim].i) * half;
-      Dfdz[n][idim].r = (data[p001][idim].r - data[p00m][idim].r) * half;
-      Dfdz[n][idim].i = (data[p001][idim].i - data[p00m][idim].i) * half;
-      D2fdxdy[n][idim].r = (data[p110][idim].r - data[p1m0][idim].r - data[pm10][idim].r + data[pmm0][idim].r) * one4;
-      D2fdxdy[n][idim].i = (data[p110][idim].i - data[p1m0][idim].i - data[pm10][idim].i + data[pmm0][idim].i) * one4;
-      D2fdxdz[n][idim].r = (data[p101][idim].r - data[p10m][idim].r - data[pm01][idim].r + data[pm0m][idim].r) * one4;
-      D2fdxdz[n][idim].i = (data[p101][idim].i - data[p10m][idim].i - data[pm01][idim].i + data[pm0m][idim].i) * one4;
-      D2fdydz[n][idim].r = (data[p011][idim].r - data[p01m][idim].r - data[p0m1][idim].r + data[p0mm][idim].r) * one4;
-      D2fdydz[n][idim].i = (data[p011][idim].i - data[p01m][idim].i - data[p0m1][idim].i + data[p0mm][idim].i) * one4;
-      D3fdxdydz[n][idim].r = (data[p111][idim].r-data[pm11][idim].r - data[p1m1][idim].r - data[p11m][idim].r +
-                              data[p1mm][idim].r+data[pm1m][idim].r + data[pmm1][idim].r - data[pmmm][idim].r) * one8;
-      D3fdxdydz[n][idim].i = (data[p111][idim].i-data[pm11][idim].i - data[p1m1][idim].i - data[p11m][idim].i +
-                              data[p1mm][idim].i+data[pm1m][idim].i + data[pmm1][idim].i - data[pmmm][idim].i) * one8;
+/* ----------------------------------------------------------------------------
+ * Public method to set the # of cells whose tricubic coefficients are kept;
+ * n = 0, none; n < 0, the coefficients of all cells are computed up front.
+ * Takes effect at the next tricubic_init.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::set_cache(const int n)
+{
+  ncache = n;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to switch on/off the memory-lean tricubic mode, in which the
+ * derivatives on the mesh are not stored but got for the vertices of a cell
+ * when its coefficients are needed. Takes effect at the next tricubic_init.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::set_lean(const int flag)
+{
+  lean = flag;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to drop all cached/precomputed tricubic coefficients.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::clear_cache()
+{
+  cache.clear();
+  lru.clear();
+  memory->destroy(coeff);
+  coeff = NULL;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the tricubic coefficients of the cell whose first
+ * vertex is (ix,iy,iz), for all elements at once: the values and derivatives
+ * at the 8 vertices of the real and imaginary parts of all elements are laid
+ * out as a 64 x (2*ndim) panel X, in the order expected by libtricubic, so
+ * that the coefficients come from one product a = A * X, stored as
+ * a[k*2*ndim + 2*idim + (0 for real, 1 for imaginary)].
+ * ---------------------------------------------------------------------------- */
+void Interpolate::cell_coeff(const int ix, const int iy, const int iz, double *a)
+{
+  int vidx[8];
+  int ixp = (ix+1)%Nx, iyp = (iy+1)%Ny, izp = (iz+1)%Nz;
+  vidx[0] = (ix*Ny+iy)*Nz+iz;
+  vidx[1] = (ixp*Ny+iy)*Nz+iz;
+  vidx[2] = (ix*Ny+iyp)*Nz+iz;
+  vidx[3] = (ixp*Ny+iyp)*Nz+iz;
+  vidx[4] = (ix*Ny+iy)*Nz+izp;
+  vidx[5] = (ixp*Ny+iy)*Nz+izp;
+  vidx[6] = (ix*Ny+iyp)*Nz+izp;
+  vidx[7] = (ixp*Ny+iyp)*Nz+izp;
+
+  doublecomplex **src[8];
+  src[0] = data; src[1] = Dfdx; src[2] = Dfdy; src[3] = Dfdz;
+  src[4] = D2fdxdy; src[5] = D2fdxdz; src[6] = D2fdydz; src[7] = D3fdxdydz;
+
+  // a doublecomplex row is just 2*ndim doubles, real and imaginary interleaved
+  int m2 = 2*ndim;
+  double *X;
+  X = memory->create(X, 64*m2, "cell_coeff:X");
+  if (lean) lean_panel(ix, iy, iz, X);
+  else
+  for (int iv=0; iv<8; iv++)
+  for (int i=0; i<8; i++) memcpy(&X[(iv*8+i)*m2], src[iv][vidx[i]], sizeof(double)*m2);
+
+  // a^T = X^T * A^T in column major
+  char trans = 'N';
+  integer m = m2, n = 64, k = 64;
+  double one = 1., zero = 0.;
+  dgemm_(&trans, &trans, &m, &n, &k, &one, X, &m, Amat[0], &k, &zero, a, &m);
+
+  memory->destroy(X);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to fill the 64 x (2*ndim) panel of the cell whose first
+ * vertex is (ix,iy,iz) directly from the 4x4x4 neighborhood of the mesh,
+ * by the same finite differences as in tricubic_init.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::lean_panel(const int ix, const int iy, const int iz, double *X)
+{
+  // rows of data of the neighborhood, offsets -1..2 along each direction
+  double *d[4][4][4];
+  for (int a=0; a<4; a++)
+  for (int b=0; b<4; b++)
+  for (int c=0; c<4; c++){
+    int ii = (ix+a-1+Nx)%Nx, jj = (iy+b-1+Ny)%Ny, kk = (iz+c-1+Nz)%Nz;
+    d[a][b][c] = &data[(ii*Ny+jj)*Nz+kk][0].r;
+  }
+
+  int m2 = 2*ndim;
+  const double half = 0.5, one4 = 0.25, one8 = 0.125;
+  for (int iv=0; iv<8; iv++){
+    int a = 1 + (iv&1), b = 1 + ((iv>>1)&1), c = 1 + ((iv>>2)&1);
+    int ap = a+1, am = a-1, bp = b+1, bm = b-1, cp = c+1, cm = c-1;
+    double *f   = &X[(0*8+iv)*m2], *fx  = &X[(1*8+iv)*m2], *fy  = &X[(2*8+iv)*m2];
+    double *fz  = &X[(3*8+iv)*m2], *fxy = &X[(4*8+iv)*m2], *fxz = &X[(5*8+iv)*m2];
+    double *fyz = &X[(6*8+iv)*m2], *fxyz = &X[(7*8+iv)*m2];
+
+    for (int i=0; i<m2; i++){
+      f[i]   = d[a][b][c][i];
+      fx[i]  = (d[ap][b][c][i] - d[am][b][c][i]) * half;
+      fy[i]  = (d[a][bp][c][i] - d[a][bm][c][i]) * half;
+      fz[i]  = (d[a][b][cp][i] - d[a][b][cm][i]) * half;
+      fxy[i] = (d[ap][bp][c][i] - d[ap][bm][c][i] - d[am][bp][c][i] + d[am][bm][c][i]) * one4;
+      fxz[i] = (d[ap][b][cp][i] - d[ap][b][cm][i] - d[am][b][cp][i] + d[am][b][cm][i]) * one4;
+      fyz[i] = (d[a][bp][cp][i] - d[a][bp][cm][i] - d[a][bm][cp][i] + d[a][bm][cm][i]) * one4;
+      fxyz[i] = (d[ap][bp][cp][i]-d[am][bp][cp][i] - d[ap][bm][cp][i] - d[ap][bp][cm][i] +
+                 d[ap][bm][cm][i]+d[am][bp][cm][i] + d[am][bm][cp][i] - d[am][bm][cm][i]) * one8;
     }
-    n++;
   }
+
 return;
 }
 
+/* ----------------------------------------------------------------------------
+ * Private method to get the tricubic coefficients of a cell from the LRU
+ * cache, computing and inserting them on a miss; thread safe. The returned
+ * pointer keeps the coefficients alive even if the cell is evicted meanwhile.
+ * ---------------------------------------------------------------------------- */
+Interpolate::CoeffPtr Interpolate::cached_coeff(const int ix, const int iy, const int iz)
+{
+  int icell = (ix*Ny+iy)*Nz+iz;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    CoeffMap::iterator it = cache.find(icell);
+    if (it != cache.end()){
+      lru.splice(lru.begin(), lru, it->second.second);
+      return it->second.first;
+    }
+  }
+
+  // computed out of the lock; two threads might do the same cell, which is harmless
+  CoeffPtr a(new std::vector<double>(ncoeff));
+  cell_coeff(ix, iy, iz, &(*a)[0]);
+
+  std::lock_guard<std::mutex> lock(mtx);
+  CoeffMap::iterator it = cache.find(icell);
+  if (it != cache.end()) return it->second.first;
+
+  lru.push_front(icell);
+  cache[icell] = std::make_pair(a, lru.begin());
+  if (int(lru.size()) > ncache){
+    cache.erase(lru.back());
+    lru.pop_back();
+  }
+
+return a;
+}
+
 /* ----------------------------------------------------------------------------
  * Deconstructor used to free memory
  * ---------------------------------------------------------------------------- */
@@ -117,13 +335,23 @@ Interpolate::~Interpolate()
   memory->destroy(D2fdxdz);
   memory->destroy(D2fdydz);
   memory->destroy(D3fdxdydz);
+  memory->destroy(coeff);
+  memory->destroy(Amat);
+  memory->destroy(basis);
+  memory->destroy(Rvec);
+  memory->destroy(Phi);
+  memory->destroy(Spl);
+  memory->destroy(hard);
+  set_mesh(NULL, 0);
   delete memory;
 }
 
 /* ----------------------------------------------------------------------------
- * Tricubic interpolation, by calling the tricubic library
+ * Private method to locate q on the mesh: the first vertex of the cell where
+ * q resides goes to cell, and the fractional position within it to frac;
+ * returns 1 if the gamma point is one of the vertices, 0 otherwise.
  * ---------------------------------------------------------------------------- */
-void Interpolate::tricubic(double *qin, doublecomplex *DMq)
+int Interpolate::locate(const double *qin, int *cell, double *frac)
 {
   // qin should be in unit of 2*pi/L
   double q[3];
@@ -133,58 +361,110 @@ void Interpolate::tricubic(double *qin, doublecomplex *DMq)
     while (q[i] >= 1.) q[i] -= 1.;
   }
   
-  int ix = int(q[0]*double(Nx));
-  int iy = int(q[1]*double(Ny));
-  int iz = int(q[2]*double(Nz));
-  double x = q[0]*double(Nx)-double(ix);
-  double y = q[1]*double(Ny)-double(iy);
-  double z = q[2]*double(Nz)-double(iz);
-  int ixp = (ix+1)%Nx, iyp = (iy+1)%Ny, izp = (iz+1)%Nz;
-  vidx[0] = (ix*Ny+iy)*Nz+iz;
-  vidx[1] = (ixp*Ny+iy)*Nz+iz;
-  vidx[2] = (ix*Ny+iyp)*Nz+iz;
-  vidx[3] = (ixp*Ny+iyp)*Nz+iz;
-  vidx[4] = (ix*Ny+iy)*Nz+izp;
-  vidx[5] = (ixp*Ny+iy)*Nz+izp;
-  vidx[6] = (ix*Ny+iyp)*Nz+izp;
-  vidx[7] = (ixp*Ny+iyp)*Nz+izp;
-  for (int i=0; i<8; i++) if (vidx[i] == 0) UseGamma = 1;
+  cell[0] = int(q[0]*double(Nx));
+  cell[1] = int(q[1]*double(Ny));
+  cell[2] = int(q[2]*double(Nz));
+  frac[0] = q[0]*double(Nx)-double(cell[0]);
+  frac[1] = q[1]*double(Ny)-double(cell[1]);
+  frac[2] = q[2]*double(Nz)-double(cell[2]);
+  int ixp = (cell[0]+1)%Nx, iyp = (cell[1]+1)%Ny, izp = (cell[2]+1)%Nz;
 
-  for (int idim=0; idim<ndim; idim++){
-    for (int i=0; i<8; i++){
-      f[i] = data[vidx[i]][idim].r;
-      dfdx[i] = Dfdx[vidx[i]][idim].r;
-      dfdy[i] = Dfdy[vidx[i]][idim].r;
-      dfdz[i] = Dfdz[vidx[i]][idim].r;
-      d2fdxdy[i] = D2fdxdy[vidx[i]][idim].r;
-      d2fdxdz[i] = D2fdxdz[vidx[i]][idim].r;
-      d2fdydz[i] = D2fdydz[vidx[i]][idim].r;
-      d3fdxdydz[i] = D3fdxdydz[vidx[i]][idim].r;
-    }
-    tricubic_get_coeff(&a[0],&f[0],&dfdx[0],&dfdy[0],&dfdz[0],&d2fdxdy[0],&d2fdxdz[0],&d2fdydz[0],&d3fdxdydz[0]); 
-    DMq[idim].r = tricubic_eval(&a[0],x,y,z);
-    
-    for (int i=0; i<8; i++){
-      f[i] = data[vidx[i]][idim].i;
-      dfdx[i] = Dfdx[vidx[i]][idim].i;
-      dfdy[i] = Dfdy[vidx[i]][idim].i;
-      dfdz[i] = Dfdz[vidx[i]][idim].i;
-      d2fdxdy[i] = D2fdxdy[vidx[i]][idim].i;
-      d2fdxdz[i] = D2fdxdz[vidx[i]][idim].i;
-      d2fdydz[i] = D2fdydz[vidx[i]][idim].i;
-      d3fdxdydz[i] = D3fdxdydz[vidx[i]][idim].i;
+return (cell[0] == 0 || ixp == 0) && (cell[1] == 0 || iyp == 0) && (cell[2] == 0 || izp == 0);
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the tricubic coefficients of a cell: precomputed,
+ * cached (kept alive by keep), or computed right now into local, which
+ * should be freed by the caller.
+ * ---------------------------------------------------------------------------- */
+double *Interpolate::get_coeff(const int *cell, CoeffPtr &keep, double *&local)
+{
+  local = NULL;
+  if (ncache < 0 && coeff) return coeff[(cell[0]*Ny+cell[1])*Nz+cell[2]];
+  if (ncache > 0){
+    keep = cached_coeff(cell[0], cell[1], cell[2]);
+    return &(*keep)[0];
+  }
+  local = memory->create(local, ncoeff, "tricubic:local");
+  cell_coeff(cell[0], cell[1], cell[2], local);
+
+return local;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to evaluate the tricubic polynomials of all elements, with
+ * coefficients a, at the fractional position frac within the cell; and their
+ * derivatives with respect to q, [3][ndim], if dDq is not NULL.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::polynomial(const double *a, const double *frac, doublecomplex *DMq, doublecomplex *dDq)
+{
+  // the 64 monomials x^i y^j z^k, ordered as the coefficients, i+4j+16k
+  double mono[64], px[4], py[4], pz[4];
+  px[0] = py[0] = pz[0] = 1.;
+  for (int i=1; i<4; i++){
+    px[i] = px[i-1]*frac[0];
+    py[i] = py[i-1]*frac[1];
+    pz[i] = pz[i-1]*frac[2];
+  }
+  for (int k=0; k<4; k++)
+  for (int j=0; j<4; j++)
+  for (int i=0; i<4; i++) mono[i+4*j+16*k] = px[i]*py[j]*pz[k];
+
+  // the polynomial for all elements together; the inner loop runs over
+  // the contiguous elements, so that it is vectorized by the compiler
+  int m2 = 2*ndim;
+  double *out = &DMq[0].r;
+  for (int i=0; i<m2; i++) out[i] = 0.;
+  for (int k=0; k<64; k++){
+    const double c = mono[k], *ak = &a[k*m2];
+    for (int i=0; i<m2; i++) out[i] += c*ak[i];
+  }
+  if (dDq == NULL) return;
+
+  // its derivatives with respect to q, from the same coefficients
+  double *dx = &dDq[0].r, *dy = &dDq[ndim].r, *dz = &dDq[2*ndim].r;
+  for (int i=0; i<m2; i++) dx[i] = dy[i] = dz[i] = 0.;
+  for (int k=0; k<4; k++)
+  for (int j=0; j<4; j++)
+  for (int i=0; i<4; i++){
+    const double *ak = &a[(i+4*j+16*k)*m2];
+    const double cx = i ? double(i*Nx)*px[i-1]*py[j]*pz[k] : 0.;
+    const double cy = j ? double(j*Ny)*px[i]*py[j-1]*pz[k] : 0.;
+    const double cz = k ? double(k*Nz)*px[i]*py[j]*pz[k-1] : 0.;
+    for (int m=0; m<m2; m++){
+      dx[m] += cx*ak[m];
+      dy[m] += cy*ak[m];
+      dz[m] += cz*ak[m];
     }
-    tricubic_get_coeff(&a[0],&f[0],&dfdx[0],&dfdy[0],&dfdz[0],&d2fdxdy[0],&d2fdxdz[0],&d2fdydz[0],&d3fdxdydz[0]); 
-    DMq[idim].i = tricubic_eval(&a[0],x,y,z);
   }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Tricubic interpolation, with the coefficients of libtricubic; returns 1 if the
+ * gamma point is one of the vertices, 0 otherwise.
+ * ---------------------------------------------------------------------------- */
+int Interpolate::tricubic(const double *qin, doublecomplex *DMq)
+{
+  int cell[3];
+  double frac[3], *local;
+  CoeffPtr keep;
+
+  int gamma = locate(qin, cell, frac);
+  polynomial(get_coeff(cell, keep, local), frac, DMq);
+  memory->destroy(local);
+
+return gamma;
 }
 
 /* ----------------------------------------------------------------------------
  * method to interpolate the DM at an arbitrary q point;
  * the input q should be a vector in unit of (2pi/a 2pi/b 2pi/c).
- * All q components will be rescaled into [0 1).
+ * All q components will be rescaled into [0 1). Returns 1 if the gamma point
+ * is one of the vertices, 0 otherwise.
  * ---------------------------------------------------------------------------- */
-void Interpolate::trilinear(double *qin, doublecomplex *DMq)
+int Interpolate::trilinear(const double *qin, doublecomplex *DMq)
 {
   // rescale q[i] into [0 1)
   double q[3];
@@ -212,7 +492,7 @@ void Interpolate::trilinear(double *qin, doublecomplex *DMq)
   z = q[2] - double(iz);
 
 //--------------------------------------
-  int vindex[8];
+  int vindex[8], gamma = 0;
   vindex[0] = ((ix*Ny)+iy)*Nz + iz;
   vindex[1] = ((ixp*Ny)+iy)*Nz + iz;
   vindex[2] = ((ix*Ny)+iyp)*Nz + iz;
@@ -221,7 +501,7 @@ void Interpolate::trilinear(double *qin, doublecomplex *DMq)
   vindex[5] = ((ix*Ny)+iyp)*Nz + izp;
   vindex[6] = ((ixp*Ny)+iyp)*Nz + iz;
   vindex[7] = ((ixp*Ny)+iyp)*Nz + izp;
-  for (int i=0; i<8; i++) if (vindex[i] == 0) UseGamma = 1;
+  for (int i=0; i<8; i++) if (vindex[i] == 0) gamma = 1;
 
   double fac[8];
   fac[0] = (1.-x)*(1.-y)*(1.-z);
@@ -243,7 +523,7 @@ void Interpolate::trilinear(double *qin, doublecomplex *DMq)
     }
   }
 
-return;
+return gamma;
 }
 
 /* ----------------------------------------------------------------------------
@@ -251,11 +531,197 @@ return;
  * ---------------------------------------------------------------------------- */
 void Interpolate::execute(double *qin, doublecomplex *DMq)
 {
-  UseGamma = 0;
-  if (which) // 1: tricubic
-    tricubic(qin, DMq);
-  else       // otherwise: trilinear
-    trilinear(qin, DMq);
+  UseGamma = evaluate(qin, DMq);
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * To invoke the interpolation without touching any member, so that it can be
+ * called by several threads at the same time; returns 1 if the gamma point is
+ * used in the interpolation, 0 otherwise.
+ * ---------------------------------------------------------------------------- */
+int Interpolate::evaluate(double *qin, doublecomplex *DMq)
+{
+  if (hard && which != 3 && is_hard(qin)){
+    fourier(1, (const double (*)[3]) qin, DMq);
+    return near_gamma(qin);
+  }
+
+  if (which == 4) // 4: cubic B-spline
+    return bspline(qin, DMq);
+  else if (which == 3){ // 3: Fourier
+    fourier(1, (const double (*)[3]) qin, DMq);
+    return near_gamma(qin);
+  } else if (which == 2) // 2: trilinear
+    return trilinear(qin, DMq);
+  else             // otherwise: tricubic
+    return tricubic(qin, DMq);
+}
+
+/* ----------------------------------------------------------------------------
+ * To interpolate the DMs at n q-points at once, stored one after another in
+ * out; the gamma flags as returned by evaluate go to gamma if not NULL, and
+ * the derivatives with respect to q to dout if not NULL, [n][3][ndim]. The
+ * q-points in the hard cells, if any, are done by one Fourier sum, the rest
+ * by local_batch. Thread safe.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::execute_batch(const double (*q)[3], int n, doublecomplex *out, int *gamma, doublecomplex *dout)
+{
+  if (n < 1) return;
+  if (hard == NULL || which == 3){
+    local_batch(q, n, out, gamma, dout);
+    return;
+  }
+
+  int nh = 0, ne = 0, *ih = new int[n], *ie = new int[n];
+  for (int i=0; i<n; i++){
+    if (is_hard(q[i])) ih[nh++] = i;
+    else ie[ne++] = i;
+  }
+  if (nh == 0) local_batch(q, n, out, gamma, dout);
+  else {
+    int m = dout ? 4 : 1, *ge = new int[n];
+    double (*qs)[3] = new double[n][3];
+    doublecomplex *buf;
+    buf = memory->create(buf, bigint(n)*m*ndim, "execute_batch:buf");
+
+    for (int i=0; i<nh; i++)
+    for (int idim=0; idim<3; idim++) qs[i][idim] = q[ih[i]][idim];
+    fourier(nh, qs, buf, dout ? &buf[bigint(nh)*ndim] : NULL);
+    for (int i=0; i<nh; i++){
+      memcpy(&out[bigint(ih[i])*ndim], &buf[bigint(i)*ndim], sizeof(doublecomplex)*ndim);
+      if (dout) memcpy(&dout[bigint(3*ih[i])*ndim], &buf[bigint(nh+3*i)*ndim], sizeof(doublecomplex)*3*ndim);
+      if (gamma) gamma[ih[i]] = near_gamma(q[ih[i]]);
+    }
+
+    for (int i=0; i<ne; i++)
+    for (int idim=0; idim<3; idim++) qs[i][idim] = q[ie[i]][idim];
+    local_batch(qs, ne, buf, ge, dout ? &buf[bigint(ne)*ndim] : NULL);
+    for (int i=0; i<ne; i++){
+      memcpy(&out[bigint(ie[i])*ndim], &buf[bigint(i)*ndim], sizeof(doublecomplex)*ndim);
+      if (dout) memcpy(&dout[bigint(3*ie[i])*ndim], &buf[bigint(ne+3*i)*ndim], sizeof(doublecomplex)*3*ndim);
+      if (gamma) gamma[ie[i]] = ge[i];
+    }
+    memory->destroy(buf);
+    delete []qs;
+    delete []ge;
+  }
+  delete []ih;
+  delete []ie;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to interpolate the DMs at n q-points at once by the chosen
+ * method, as for execute_batch. For tricubic, the q-points are grouped by
+ * the cell where they reside, so that the coefficients of each cell are
+ * fetched once and used for all its q-points; Fourier does all q-points by
+ * one matrix product. The derivatives are obtained analytically in the same
+ * pass, except for trilinear whose piecewise linear DMs are differentiated
+ * by central differences. Thread safe.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::local_batch(const double (*q)[3], int n, doublecomplex *out, int *gamma, doublecomplex *dout)
+{
+  if (n < 1) return;
+  if (which == 3 && dout){
+    if (gamma) for (int i=0; i<n; i++) gamma[i] = near_gamma(q[i]);
+    fourier(n, q, out, dout);
+    return;
+
+  } else if (which == 3){
+    if (gamma) for (int i=0; i<n; i++) gamma[i] = near_gamma(q[i]);
+
+    // q-points on the dense mesh are copied from their slabs, others summed up
+    int nrest = 0, *rest = new int[n];
+    int nin = Mesh[axis] > 0 ? Mesh[0]*Mesh[1]*Mesh[2]/Mesh[axis] : 1, is = -1;
+    SlabPtr slab;
+    for (int i=0; i<n; i++){
+      int ig = on_mesh(q[i]);
+      if (ig < 0){
+        rest[nrest++] = i;
+        continue;
+      }
+      if (ig/nin != is){
+        is = ig/nin;
+        slab = get_slab(is);
+      }
+      memcpy(&out[bigint(i)*ndim], &(*slab)[bigint(ig%nin)*ndim], sizeof(doublecomplex)*ndim);
+    }
+
+    if (nrest == n) fourier(n, q, out);
+    else if (nrest > 0){
+      double (*qr)[3] = new double[nrest][3];
+      doublecomplex *DMr;
+      DMr = memory->create(DMr, nrest*ndim, "execute_batch:DMr");
+      for (int i=0; i<nrest; i++)
+      for (int idim=0; idim<3; idim++) qr[i][idim] = q[rest[i]][idim];
+      fourier(nrest, qr, DMr);
+      for (int i=0; i<nrest; i++) memcpy(&out[bigint(rest[i])*ndim], &DMr[bigint(i)*ndim], sizeof(doublecomplex)*ndim);
+      memory->destroy(DMr);
+      delete []qr;
+    }
+    delete []rest;
+    return;
+
+  } else if (which == 4){
+    for (int i=0; i<n; i++){
+      int g = bspline(q[i], &out[bigint(i)*ndim], dout ? &dout[bigint(3*i)*ndim] : NULL);
+      if (gamma) gamma[i] = g;
+    }
+    return;
+
+  } else if (which == 2){
+    doublecomplex *Dp = NULL;
+    if (dout) Dp = memory->create(Dp, ndim, "execute_batch:Dp");
+    for (int i=0; i<n; i++){
+      int g = trilinear(q[i], &out[bigint(i)*ndim]);
+      if (gamma) gamma[i] = g;
+      if (dout == NULL) continue;
+
+      const int N[3] = {Nx, Ny, Nz};
+      for (int d=0; d<3; d++){
+        double qp[3] = {q[i][0], q[i][1], q[i][2]};
+        double h = 1.e-4/double(N[d]);
+        doublecomplex *dD = &dout[bigint(3*i+d)*ndim];
+        qp[d] = q[i][d] + h;
+        trilinear(qp, dD);
+        qp[d] = q[i][d] - h;
+        trilinear(qp, Dp);
+        for (int idim=0; idim<ndim; idim++){
+          dD[idim].r = (dD[idim].r - Dp[idim].r)/(2.*h);
+          dD[idim].i = (dD[idim].i - Dp[idim].i)/(2.*h);
+        }
+      }
+    }
+    memory->destroy(Dp);
+    return;
+  }
+
+  int *cells = new int[3*n], *key = new int[n], *order = new int[n];
+  double *frac = new double[3*n];
+  for (int i=0; i<n; i++){
+    int g = locate(q[i], &cells[3*i], &frac[3*i]);
+    if (gamma) gamma[i] = g;
+    key[i] = (cells[3*i]*Ny+cells[3*i+1])*Nz+cells[3*i+2];
+    order[i] = i;
+  }
+  std::stable_sort(order, order+n, [key](const int a, const int b){ return key[a] < key[b]; });
+
+  for (int i=0; i<n; ){
+    int first = order[i];
+    double *local;
+    CoeffPtr keep;
+    double *a = get_coeff(&cells[3*first], keep, local);
+    for ( ; i<n && key[order[i]] == key[first]; i++)
+      polynomial(a, &frac[3*order[i]], &out[bigint(order[i])*ndim], dout ? &dout[bigint(3*order[i])*ndim] : NULL);
+    memory->destroy(local);
+  }
+  delete []cells;
+  delete []key;
+  delete []order;
+  delete []frac;
+
 return;
 }
 
@@ -268,21 +734,506 @@ void Interpolate::set_method()
   int im = 1;
   printf("\n");for(int i=0; i<60; i++) printf("=");
   printf("\nWhich interpolation method would you like to use?\n");
-  printf("  1. Tricubic;\n  2. Trilinear;\n");
+  printf("  1. Tricubic;\n  2. Trilinear;\n  3. Fourier, from the real-space force constants;\n");
+  printf("  4. Periodic cubic B-spline;\n");
   printf("Your choice [1]: ");
   fgets(str,MAXLINE,stdin);
   char *ptr = strtok(str," \t\n\r\f");
   if (ptr) im = atoi(ptr);
 
-  which =2-im%2;
+  which = im;
+  if (which < 1 || which > 4) which = 1;
   printf("Your chose: %d\n", which);
   for(int i=0; i<60; i++) printf("="); printf("\n\n");
 
-  if (which) tricubic_init();
+  set_method(which);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method, to set the interpolation method without asking; used by the
+ * MPI ranks other than 0 to follow the choice made on rank 0.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::set_method(const int im)
+{
+  which = im;
+  set_hard(NULL);
+  if (which == 1) tricubic_init();
+  else if (which == 3) fourier_init();
+  else if (which == 4) bspline_init();
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method, to pass the unit cell vectors (in rows) and the fractional
+ * coordinates of the basis atoms, needed by the Fourier interpolation to find
+ * the shortest image of each pair.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::set_lattice(const int nu, const int sdim, double *lat, double **bas)
+{
+  nucell = nu;
+  sysdim = sdim;
+  for (int i=0; i<9; i++) latvec[i] = lat[i];
+
+  memory->destroy(basis);
+  basis = memory->create(basis, nucell, 3, "Interpolate:basis");
+  for (int i=0; i<nucell; i++)
+  for (int idim=0; idim<3; idim++) basis[i][idim] = idim < sysdim ? bas[i][idim] : 0.;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to mark the cells, given by the index of their lower vertex
+ * on the mesh, where the Fourier interpolation is used instead of the chosen
+ * one; flags = NULL, or all zero, to use the chosen one everywhere. Not to
+ * be called while interpolating.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::set_hard(const int *flags)
+{
+  memory->destroy(hard);
+  hard = NULL;
+
+  int nh = 0;
+  if (flags) for (int i=0; i<Npt; i++) nh += flags[i] != 0;
+  if (nh < 1) return;
+
+  if (Phi == NULL) fourier_init();
+  hard = memory->create(hard, Npt, "Interpolate:hard");
+  for (int i=0; i<Npt; i++) hard[i] = flags[i] != 0;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to tell if q resides in a hard cell.
+ * ---------------------------------------------------------------------------- */
+int Interpolate::is_hard(const double *q)
+{
+  int cell[3];
+  double frac[3];
+  locate(q, cell, frac);
+
+return hard[(cell[0]*Ny+cell[1])*Nz+cell[2]];
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the real-space force constants for Fourier
+ * interpolation. With the convention of fix-phonon,
+ *   D_ij(q) = sum_R Phi_ij(R) exp(-2pi i q.R),
+ * where R runs over the nx x ny x nz cells and atom i sits at R + b_i from
+ * atom j; so Phi is obtained by an inverse DFT of the DM on the mesh. Each
+ * Phi_ij(R) is then shared equally among the images R + L (L a lattice
+ * vector of the supercell) for which |R + L + b_i - b_j| is the smallest,
+ * which keeps D(q) exact on the mesh and makes it smooth in between.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::fourier_init()
+{
+  doublecomplex **fc;
+  fc = memory->create(fc, Npt, ndim, "fourier_init:fc");
+  for (int ip=0; ip<Npt; ip++)
+  for (int idim=0; idim<ndim; idim++) fc[ip][idim] = data[ip][idim];
+
+  // inverse FFT
+  fft3d(fc, 1);
+  for (int ip=0; ip<Npt; ip++)
+  for (int idim=0; idim<ndim; idim++){
+    fc[ip][idim].r /= double(Npt);
+    fc[ip][idim].i /= double(Npt);
+  }
+
+  // assign each block of Phi to its shortest images, weighted equally
+  int fftdim = nucell*sysdim;
+  std::map<long long, int> ridx;
+  std::vector<int> rv;
+  std::vector<doublecomplex> phi;
+  doublecomplex zero;
+  zero.r = zero.i = 0.;
+
+  for (int iu=0; iu<nucell; iu++)
+  for (int ju=0; ju<nucell; ju++){
+    double db[3];
+    for (int idim=0; idim<3; idim++) db[idim] = basis[iu][idim] - basis[ju][idim];
+
+    for (int ii=0; ii<Nx; ii++)
+    for (int jj=0; jj<Ny; jj++)
+    for (int kk=0; kk<Nz; kk++){
+      int ip = (ii*Ny+jj)*Nz+kk;
+      // the image closest to the origin, and its neighbors
+      int n0[3], img[27][3], nimg = 0;
+      n0[0] = ii - (2*ii >= Nx ? Nx : 0);
+      n0[1] = jj - (2*jj >= Ny ? Ny : 0);
+      n0[2] = kk - (2*kk >= Nz ? Nz : 0);
+
+      double d2[27], d2min = 1.e300;
+      for (int sx=-1; sx<=1; sx++)
+      for (int sy=-1; sy<=1; sy++)
+      for (int sz=-1; sz<=1; sz++){
+        img[nimg][0] = n0[0] + sx*Nx;
+        img[nimg][1] = n0[1] + sy*Ny;
+        img[nimg][2] = n0[2] + sz*Nz;
+
+        double x[3];
+        for (int idim=0; idim<3; idim++){
+          x[idim] = 0.;
+          for (int jdim=0; jdim<3; jdim++) x[idim] += (double(img[nimg][jdim]) + db[jdim])*latvec[jdim*3+idim];
+        }
+        d2[nimg] = x[0]*x[0] + x[1]*x[1] + x[2]*x[2];
+        d2min = MIN(d2min, d2[nimg]);
+        nimg++;
+      }
+
+      const double tol = 1.e-6*d2min + 1.e-10;
+      int nmin = 0;
+      for (int i=0; i<27; i++) if (d2[i] <= d2min + tol) nmin++;
+      double w = 1./double(nmin);
+
+      for (int i=0; i<27; i++){
+        if (d2[i] > d2min + tol) continue;
+
+        long long key = ((long long)(img[i][0]+Nx*2)*(Ny*4) + img[i][1]+Ny*2)*(Nz*4) + img[i][2]+Nz*2;
+        int ir;
+        std::map<long long, int>::iterator it = ridx.find(key);
+        if (it == ridx.end()){
+          ir = rv.size()/3;
+          ridx[key] = ir;
+          for (int idim=0; idim<3; idim++) rv.push_back(img[i][idim]);
+          phi.resize(phi.size()+ndim, zero);
+        } else ir = it->second;
+
+        for (int idim=0; idim<sysdim; idim++)
+        for (int jdim=0; jdim<sysdim; jdim++){
+          int k = (iu*sysdim+idim)*fftdim + ju*sysdim+jdim;
+          phi[bigint(ir)*ndim+k].r += fc[ip][k].r * w;
+          phi[bigint(ir)*ndim+k].i += fc[ip][k].i * w;
+        }
+      }
+    }
+  }
+  memory->destroy(fc);
+
+  nR = rv.size()/3;
+  memory->destroy(Rvec);
+  memory->destroy(Phi);
+  Rvec = memory->create(Rvec, nR, 3, "Interpolate:Rvec");
+  Phi  = memory->create_big(Phi, nR, ndim, "Interpolate:Phi");
+  for (int ir=0; ir<nR; ir++){
+    for (int idim=0; idim<3; idim++) Rvec[ir][idim] = rv[ir*3+idim];
+    for (int idim=0; idim<ndim; idim++) Phi[ir][idim] = phi[bigint(ir)*ndim+idim];
+  }
+  printf("Force constants of %d lattice vectors are used for Fourier interpolation.\n", nR);
+  slabs.clear();
+  slru.clear();
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to FFT a field on the mesh, [Npt][ndim], in place, one
+ * direction at a time; without normalization.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::fft3d(doublecomplex **f, const int sign)
+{
+  int len[3];
+  len[0] = Nx; len[1] = Ny; len[2] = Nz;
+  for (int idir=0, nout=1; idir<3; nout *= len[idir++]){
+    if (len[idir] < 2) continue;
+    FFT *t = new FFT(len[idir]);
+    int nin = Npt/(nout*len[idir]);
+    for (int io=0; io<nout; io++) t->execute(f[io*len[idir]*nin], nin*ndim, sign);
+    delete t;
+  }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the coefficients of the periodic cubic B-spline that
+ * goes through the DMs on the mesh. As the spline takes 1/6, 2/3, 1/6 of its
+ * neighboring coefficients on the mesh, the coefficients are the DMs divided
+ * in Fourier space by prod_d (2 + cos(2pi k_d/N_d))/3, which never vanishes.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::bspline_init()
+{
+  memory->destroy(Spl);
+  Spl = memory->create_big(Spl, Npt, ndim, "Interpolate:Spl");
+  for (int ip=0; ip<Npt; ip++)
+  for (int idim=0; idim<ndim; idim++) Spl[ip][idim] = data[ip][idim];
+
+  fft3d(Spl, -1);
+
+  const double tpi = 8.*atan(1.);
+  for (int ii=0; ii<Nx; ii++)
+  for (int jj=0; jj<Ny; jj++)
+  for (int kk=0; kk<Nz; kk++){
+    double s = (2.+cos(tpi*ii/Nx))*(2.+cos(tpi*jj/Ny))*(2.+cos(tpi*kk/Nz))/27.*double(Npt);
+    doublecomplex *c = Spl[(ii*Ny+jj)*Nz+kk];
+    for (int idim=0; idim<ndim; idim++){
+      c[idim].r /= s;
+      c[idim].i /= s;
+    }
+  }
+
+  fft3d(Spl, 1);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to evaluate the DM at q by the periodic cubic B-spline: the
+ * separable weights of the 4 x 4 x 4 coefficients around q are applied to all
+ * elements at once; the derivatives with respect to q, [3][ndim], go to dDq
+ * if not NULL. Thread safe.
+ * ---------------------------------------------------------------------------- */
+int Interpolate::bspline(const double *qin, doublecomplex *DMq, doublecomplex *dDq)
+{
+  int n[3], idx[3][4];
+  double w[3][4], dw[3][4];
+  n[0] = Nx; n[1] = Ny; n[2] = Nz;
+  for (int i=0; i<3; i++){
+    double x = qin[i]*double(n[i]);
+    double fl = floor(x), t = x - fl;
+    int i0 = int(fl)%n[i] + n[i];
+    for (int j=0; j<4; j++) idx[i][j] = (i0+j-1)%n[i];
+
+    double t2 = t*t, t3 = t2*t, one6 = 1./6.;
+    w[i][0] = (1.-t)*(1.-t)*(1.-t)*one6;
+    w[i][1] = (3.*t3 - 6.*t2 + 4.)*one6;
+    w[i][2] = (-3.*t3 + 3.*t2 + 3.*t + 1.)*one6;
+    w[i][3] = t3*one6;
+    dw[i][0] = -0.5*(1.-t)*(1.-t)*n[i];
+    dw[i][1] = (1.5*t2 - 2.*t)*n[i];
+    dw[i][2] = (-1.5*t2 + t + 0.5)*n[i];
+    dw[i][3] = 0.5*t2*n[i];
+  }
+
+  for (int idim=0; idim<ndim; idim++) DMq[idim].r = DMq[idim].i = 0.;
+  for (int a=0; a<4; a++)
+  for (int b=0; b<4; b++){
+    const double wab = w[0][a]*w[1][b];
+    const int iab = (idx[0][a]*Ny+idx[1][b])*Nz;
+    for (int c=0; c<4; c++){
+      const double wt = wab*w[2][c];
+      const doublecomplex *s = Spl[iab+idx[2][c]];
+      for (int idim=0; idim<ndim; idim++){
+        DMq[idim].r += wt*s[idim].r;
+        DMq[idim].i += wt*s[idim].i;
+      }
+    }
+  }
+  if (dDq == NULL) return near_gamma(qin);
+
+  // the derivatives, by the derivatives of the weights
+  for (int idim=0; idim<3*ndim; idim++) dDq[idim].r = dDq[idim].i = 0.;
+  for (int a=0; a<4; a++)
+  for (int b=0; b<4; b++)
+  for (int c=0; c<4; c++){
+    double wd[3];
+    wd[0] = dw[0][a]*w[1][b]*w[2][c];
+    wd[1] = w[0][a]*dw[1][b]*w[2][c];
+    wd[2] = w[0][a]*w[1][b]*dw[2][c];
+    const doublecomplex *s = Spl[(idx[0][a]*Ny+idx[1][b])*Nz+idx[2][c]];
+    for (int d=0; d<3; d++){
+      doublecomplex *out = &dDq[d*ndim];
+      for (int idim=0; idim<ndim; idim++){
+        out[idim].r += wd[d]*s[idim].r;
+        out[idim].i += wd[d]*s[idim].i;
+      }
+    }
+  }
+
+return near_gamma(qin);
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to evaluate the DM at n q-points by Fourier interpolation,
+ * the results are stored one after another in DMq. All elements of all
+ * q-points are done by one matrix product: DM[iq] = sum_R Phi(R) * phase(R,iq),
+ * thread safe. If dDq is not NULL, the derivatives with respect to the three
+ * components of q go there, [n][3][ndim], by a second product with the
+ * phases multiplied by -2pi i R.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::fourier(const int n, const double (*q)[3], doublecomplex *DMq, doublecomplex *dDq)
+{
+  const double tpi = 8.*atan(1.);
+  int ncol = dDq ? 3*n : n;
+  doublecomplex *phase;
+  phase = memory->create(phase, nR*ncol, "fourier:phase");
+  for (int iq=0; iq<n; iq++)
+  for (int ir=0; ir<nR; ir++){
+    double arg = -tpi*(q[iq][0]*Rvec[ir][0] + q[iq][1]*Rvec[ir][1] + q[iq][2]*Rvec[ir][2]);
+    phase[iq*nR+ir].r = cos(arg);
+    phase[iq*nR+ir].i = sin(arg);
+  }
+
+  char trans = 'N';
+  integer m = ndim, nq = n, k = nR;
+  doublecomplex one, zero;
+  one.r = 1.; one.i = zero.r = zero.i = 0.;
+  zgemm_(&trans, &trans, &m, &nq, &k, &one, Phi[0], &m, phase, &k, &zero, DMq, &m);
+
+  if (dDq){
+    for (int iq=n-1; iq>=0; iq--)
+    for (int ir=0; ir<nR; ir++){
+      doublecomplex p = phase[iq*nR+ir];
+      for (int d=0; d<3; d++){
+        double f = tpi*Rvec[ir][d];
+        phase[(3*iq+d)*nR+ir].r =  f*p.i;
+        phase[(3*iq+d)*nR+ir].i = -f*p.r;
+      }
+    }
+    nq = 3*n;
+    zgemm_(&trans, &trans, &m, &nq, &k, &one, Phi[0], &m, phase, &k, &zero, dDq, &m);
+  }
+
+  memory->destroy(phase);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to tell the Fourier interpolation that the coming q-points
+ * lie on the uniform mesh m[0] x m[1] x m[2], mostly ordered by their index
+ * along axis; the DMs on the mesh will then be got by FFT, one slab normal to
+ * axis at a time, instead of point by point: the force constants are padded
+ * with zeros to the mesh size, folded into the slab after the sum along axis,
+ * and transformed in the other two directions. m = NULL to forget the mesh.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::set_mesh(const int *m, const int ax)
+{
+  slabs.clear();
+  slru.clear();
+  for (int i=0; i<3; i++){
+    delete fft[i];
+    fft[i] = NULL;
+    Mesh[i] = m ? m[i] : 0;
+  }
+  axis = ax;
+  if (m == NULL || Mesh[0] < 1 || Mesh[1] < 1 || Mesh[2] < 1){
+    Mesh[0] = Mesh[1] = Mesh[2] = 0;
+    return;
+  }
+  for (int i=0; i<3; i++) if (i != axis) fft[i] = new FFT(Mesh[i]);
+
+  // as many slabs as fit in 64 MB, but at least a few for the threads
+  bigint size = bigint(Mesh[0])*Mesh[1]*Mesh[2]/Mesh[axis]*ndim*sizeof(doublecomplex);
+  nslab = MAX(4, int(67108864/size));
 
 return;
 }
 
+/* ----------------------------------------------------------------------------
+ * Private method to get the index of q on the dense mesh, -1 if not on it;
+ * the index runs slowest along axis, then along the other two in order.
+ * ---------------------------------------------------------------------------- */
+int Interpolate::on_mesh(const double *qin)
+{
+  if (Mesh[0] < 1) return -1;
+
+  int idx[3];
+  for (int i=0; i<3; i++){
+    double x = qin[i]*double(Mesh[i]);
+    double r = floor(x+0.5);
+    if (fabs(x-r) > 1.e-6) return -1;
+    idx[i] = int(r)%Mesh[i];
+    if (idx[i] < 0) idx[i] += Mesh[i];
+  }
+  int b = axis == 0 ? 1 : 0, c = axis == 2 ? 1 : 2;
+
+return (idx[axis]*Mesh[b] + idx[b])*Mesh[c] + idx[c];
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the DMs of slab is of the dense mesh; a slab is
+ * computed only once by the first thread that asks for it, the others wait
+ * for it. Thread safe.
+ * ---------------------------------------------------------------------------- */
+Interpolate::SlabPtr Interpolate::get_slab(const int is)
+{
+  std::promise<SlabPtr> job;
+  std::shared_future<SlabPtr> slab;
+  int mine = 0;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    SlabMap::iterator it = slabs.find(is);
+    if (it != slabs.end()){
+      slru.splice(slru.begin(), slru, it->second.second);
+      slab = it->second.first;
+    } else {
+      slab = job.get_future().share();
+      slru.push_front(is);
+      slabs[is] = std::make_pair(slab, slru.begin());
+      while ((int) slru.size() > nslab){
+        slabs.erase(slru.back());
+        slru.pop_back();
+      }
+      mine = 1;
+    }
+  }
+  if (!mine) return slab.get();
+
+  SlabPtr p(new std::vector<doublecomplex>(bigint(Mesh[0])*Mesh[1]*Mesh[2]/Mesh[axis]*ndim));
+  fill_slab(is, p->data());
+  job.set_value(p);
+
+return p;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to compute the DMs of slab is of the dense mesh into DMs,
+ * [Mesh[b]][Mesh[c]][ndim], with b < c the two axes within the slab.
+ * ---------------------------------------------------------------------------- */
+void Interpolate::fill_slab(const int is, doublecomplex *DMs)
+{
+  const double tpi = 8.*atan(1.);
+  int b = axis == 0 ? 1 : 0, c = axis == 2 ? 1 : 2;
+  int Mb = Mesh[b], Mc = Mesh[c];
+
+  for (bigint i=0; i<bigint(Mb)*Mc*ndim; i++) DMs[i].r = DMs[i].i = 0.;
+
+  // the sum along axis; the rest are folded onto the slab, i.e. zero-padded
+  for (int ir=0; ir<nR; ir++){
+    double arg = -tpi*double(is)*double(Rvec[ir][axis])/double(Mesh[axis]);
+    double cs = cos(arg), sn = sin(arg);
+    int jb = Rvec[ir][b]%Mb, jc = Rvec[ir][c]%Mc;
+    if (jb < 0) jb += Mb;
+    if (jc < 0) jc += Mc;
+
+    doublecomplex *out = &DMs[bigint(jb*Mc+jc)*ndim];
+    const doublecomplex *in = Phi[ir];
+    for (int idim=0; idim<ndim; idim++){
+      out[idim].r += in[idim].r*cs - in[idim].i*sn;
+      out[idim].i += in[idim].r*sn + in[idim].i*cs;
+    }
+  }
+
+  for (int jb=0; jb<Mb; jb++) fft[c]->execute(&DMs[bigint(jb)*Mc*ndim], ndim, -1);
+  fft[b]->execute(DMs, Mc*ndim, -1);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to check if the gamma point is a vertex of the mesh cell
+ * where q resides; so that -s behaves the same for all methods.
+ * ---------------------------------------------------------------------------- */
+int Interpolate::near_gamma(const double *qin)
+{
+  int n[3];
+  n[0] = Nx; n[1] = Ny; n[2] = Nz;
+  for (int i=0; i<3; i++){
+    double q = qin[i];
+    while (q < 0.)  q += 1.;
+    while (q >= 1.) q -= 1.;
+    int iq = int(q*double(n[i]))%n[i];
+    if (iq != 0 && iq != n[i]-1) return 0;
+  }
+
+return 1;
+}
+
 /* ----------------------------------------------------------------------------
  * Public method, to reset gamma point data; in this case, the gamma point data
  * will be meaningless. should only be called once.
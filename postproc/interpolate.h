@@ -5,9 +5,17 @@
 #include "stdlib.h"
 #include "string.h"
 #include "memory.h"
+#include "fft.h"
 #include <tricubic.h>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <unordered_map>
 extern "C"{
 #include "f2c.h"
+#include "blaswrap.h"
 #include "clapack.h"
 }
 
@@ -19,25 +27,84 @@ public:
   ~Interpolate();
 
   void set_method();
+  void set_method(const int);
+  void set_lattice(const int, const int, double *, double **);
+  void set_cache(const int);
+  void set_lean(const int);
+  void set_mesh(const int *, const int);
+  void set_hard(const int *);
   void execute(double *, doublecomplex *);
+  int evaluate(double *, doublecomplex *);
+  void execute_batch(const double (*)[3], int, doublecomplex *, int *gamma = NULL, doublecomplex *dout = NULL);
   void reset_gamma();
 
   int UseGamma;
+  int which;
 
 private:
   void tricubic_init();
-  void tricubic(double *, doublecomplex *);
-  void trilinear(double *, doublecomplex *);
+  int tricubic(const double *, doublecomplex *);
+  int trilinear(const double *, doublecomplex *);
+  int near_gamma(const double *);
   Memory *memory;
 
-  int which;
   int Nx, Ny, Nz, Npt, ndim;
   int flag_reset_gamma, flag_allocated_dfs;
 
   doublecomplex **data;
   doublecomplex **Dfdx, **Dfdy, **Dfdz, **D2fdxdy, **D2fdxdz, **D2fdydz, **D3fdxdydz;
-  double a[64], f[8], dfdx[8], dfdy[8], dfdz[8], d2fdxdy[8], d2fdxdz[8], d2fdydz[8], d3fdxdydz[8];
-  int vidx[8];
+
+  // cache of the tricubic coefficients of the mesh cells, keyed by the cell index
+  typedef std::shared_ptr<std::vector<double> > CoeffPtr;
+  typedef std::unordered_map<int, std::pair<CoeffPtr, std::list<int>::iterator> > CoeffMap;
+  int ncache;                   // max # of cells cached; 0, no cache; < 0, all precomputed
+  int ncoeff;                   // # of coefficients per cell, 64 x 2 x ndim
+  double **coeff;               // coefficients of all cells if precomputed, [Npt][ncoeff]
+  double **Amat;                // matrix that maps vertex data onto coefficients, [64][64]
+  int lean;                     // 1, derivatives got per cell instead of stored on the mesh
+  std::list<int> lru;           // cached cells, the most recently used first
+  CoeffMap cache;
+  std::mutex mtx;
+  void cell_coeff(const int, const int, const int, double *);
+  void lean_panel(const int, const int, const int, double *);
+  CoeffPtr cached_coeff(const int, const int, const int);
+  int locate(const double *, int *, double *);
+  double *get_coeff(const int *, CoeffPtr &, double *&);
+  void polynomial(const double *, const double *, doublecomplex *, doublecomplex *dD = NULL);
+  void clear_cache();
+
+  // cells where the local interpolation is judged not accurate enough, whose
+  // q-points are done by the Fourier interpolation instead
+  int *hard;                    // 1 if the cell is hard, [Npt]; NULL, none
+  int is_hard(const double *);
+  void local_batch(const double (*)[3], int, doublecomplex *, int *, doublecomplex *);
+
+  // Fourier interpolation from the real-space force constants
+  int nucell, sysdim, nR;
+  double latvec[9], **basis;    // unit cell vectors and fractional basis, [nucell][3]
+  int **Rvec;                   // lattice vectors where the force constants reside, [nR][3]
+  doublecomplex **Phi;          // force constants with Wigner-Seitz weights, [nR][ndim]
+  void fourier_init();
+  void fourier(const int, const double (*)[3], doublecomplex *, doublecomplex *dD = NULL);
+  void fft3d(doublecomplex **, const int);
+
+  // periodic cubic B-spline, from its coefficients on the mesh
+  doublecomplex **Spl;          // spline coefficients, [Npt][ndim]
+  void bspline_init();
+  int bspline(const double *, doublecomplex *, doublecomplex *dD = NULL);
+
+  // DMs on a dense uniform mesh by FFT of the zero-padded force constants,
+  // one slab normal to axis at a time; the slabs in use are kept in an LRU
+  typedef std::shared_ptr<std::vector<doublecomplex> > SlabPtr;
+  typedef std::unordered_map<int, std::pair<std::shared_future<SlabPtr>, std::list<int>::iterator> > SlabMap;
+  int Mesh[3], axis;            // the dense mesh, 0 if not set; axis normal to the slabs
+  int nslab;                    // max # of slabs kept
+  FFT *fft[3];
+  std::list<int> slru;
+  SlabMap slabs;
+  int on_mesh(const double *);
+  SlabPtr get_slab(const int);
+  void fill_slab(const int, doublecomplex *);
 };
 
 #endif
@@ -0,0 +1,276 @@
+#include "kpm.h"
+#include "math.h"
+#include <thread>
+#include <vector>
+
+extern "C"{
+#include "f2c.h"
+#include "clapack.h"
+}
+
+#define MIN(a,b) ((a)>(b)?(b):(a))
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+/* ----------------------------------------------------------------------------
+ * Class KPM gets the density of eigenvalues of a real symmetric matrix H of
+ * size n by the kernel polynomial method (Weisse et al., RMP 78, 275): the
+ * spectrum is mapped onto [-1,1], the Chebyshev moments mu_k = Tr T_k(H)/n
+ * are estimated by the mean of r^T T_k(H) r over nr random vectors r of +/-1,
+ * and the series is damped by the Jackson kernel. Only products of the sparse
+ * H with blocks of vectors are needed, so the cost per moment goes with the
+ * # of its blocks, against n^3 for the eigenvalues. The random vectors are
+ * shared among nth threads, each doing its own block of them.
+ * ---------------------------------------------------------------------------- */
+KPM::KPM(Sparse *Hessian, const int nrand, const int nthreads)
+{
+  memory = new Memory();
+  H = Hessian; n = H->n;
+  nr = MAX(1, nrand);
+  nth = MAX(1, nthreads);
+  nch = 0; cptr = crow = NULL;
+
+  emin = -1.; emax = 1.;
+  a = 1.; b = 0.;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Deconstructor
+ * ---------------------------------------------------------------------------- */
+KPM::~KPM()
+{
+  H = NULL;
+  delete memory;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to estimate the bounds of the spectrum by nit steps of Lanczos
+ * from a random vector: the extreme eigenvalues of the tridiagonal matrix,
+ * widened by the residuals of their Ritz vectors. The map onto [-1,1] then
+ * keeps a margin of 1% at both ends, as the Chebyshev series diverge outside.
+ * ---------------------------------------------------------------------------- */
+void KPM::bounds(const int nitmax)
+{
+  int nit = MAX(1, MIN(n, nitmax));
+  double *v, *vp, *w, *alpha, *beta;
+  v  = memory->create(v,  n, "KPM:v");
+  vp = memory->create(vp, n, "KPM:vp");
+  w  = memory->create(w,  n, "KPM:w");
+  alpha = memory->create(alpha, nit+1, "KPM:alpha");
+  beta  = memory->create(beta,  nit+1, "KPM:beta");
+
+  a = 1.; b = 0.;
+  random(nr, nr+1, v);
+  double rnorm = 1./sqrt(double(n));
+  for (int i=0; i<n; i++){v[i] *= rnorm; vp[i] = 0.;}
+
+  int m = 0;
+  beta[0] = 0.;
+  for (int it=0; it<nit; it++){
+    multiply(v, w, 1);
+    double sum_a = 0.;
+    for (int i=0; i<n; i++) sum_a += w[i]*v[i];
+    alpha[it] = sum_a;
+
+    double sum_b = 0.;
+    for (int i=0; i<n; i++){
+      w[i] -= alpha[it]*v[i] + beta[it]*vp[i];
+      sum_b += w[i]*w[i];
+    }
+    beta[it+1] = sqrt(sum_b);
+    m = it+1;
+    if (beta[it+1] <= 1.e-12*(fabs(alpha[it]) + beta[it])) break;
+
+    double *ptr = vp; vp = v; v = ptr;
+    double tmp = 1./beta[it+1];
+    for (int i=0; i<n; i++) v[i] = w[i]*tmp;
+  }
+
+  // eigenvalues of the tridiagonal matrix, in ascending order; the residual
+  // of each Ritz pair is the last component of its eigenvector times beta_m
+  char jobz = 'V';
+  integer nt = m, ldz = m, info;
+  double res = beta[m], *z, *work;
+  z    = memory->create(z,    m*m, "KPM:z");
+  work = memory->create(work, MAX(1,2*m-2), "KPM:work");
+  for (int i=0; i<m-1; i++) beta[i] = beta[i+1];
+  dstev_(&jobz, &nt, alpha, beta, z, &ldz, work, &info);
+
+  emin = alpha[0]   - res*fabs(z[m-1]);
+  emax = alpha[m-1] + res*fabs(z[m*m-1]);
+  memory->destroy(z);
+  memory->destroy(work);
+  b = 0.5*(emax + emin);
+  a = 0.5*(emax - emin)/0.99;
+  if (a <= 0.) a = MAX(1.e-3*fabs(b), 1.e-10);
+
+  memory->destroy(v);
+  memory->destroy(vp);
+  memory->destroy(w);
+  memory->destroy(alpha);
+  memory->destroy(beta);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to get nmom Chebyshev moments of the mapped H, mu[nmom], and
+ * those projected on nc channels of rows, mc[nc][nmom], each normalized by
+ * its # of rows; channel c has rows crow[cptr[c]:cptr[c+1]]. Since the random
+ * components of different rows are independent, the sum of r_i (T_k(H) r)_i
+ * over the rows of a channel estimates its share of the trace.
+ * ---------------------------------------------------------------------------- */
+void KPM::moments(const int nmom, double *mu, const int nc, const int *ptr, const int *row, double **mc)
+{
+  nch = nc; cptr = ptr; crow = row;
+  int nt = MIN(nth, nr);
+
+  // each thread does a block of the random vectors, into its own buffers
+  double **tmu, **tmc;
+  tmu = memory->create(tmu, nt, nmom, "KPM:tmu");
+  tmc = memory->create(tmc, nt, MAX(1,nch*nmom), "KPM:tmc");
+  for (int it=0; it<nt; it++){
+    for (int k=0; k<nmom; k++) tmu[it][k] = 0.;
+    for (int k=0; k<nch*nmom; k++) tmc[it][k] = 0.;
+  }
+  if (nt == 1) recursion(0, nr, nmom, tmu[0], tmc[0]);
+  else {
+    std::vector<std::thread> threads;
+    for (int it=0; it<nt; it++){
+      int lo = nr*it/nt, hi = nr*(it+1)/nt;
+      threads.push_back(std::thread(&KPM::recursion, this, lo, hi, nmom, tmu[it], tmc[it]));
+    }
+    for (int it=0; it<nt; it++) threads[it].join();
+  }
+
+  for (int k=0; k<nmom; k++){
+    mu[k] = 0.;
+    for (int it=0; it<nt; it++) mu[k] += tmu[it][k];
+    mu[k] /= double(nr)*double(n);
+  }
+  for (int c=0; c<nch; c++){
+    double fac = cptr[c+1] > cptr[c] ? 1./(double(nr)*double(cptr[c+1]-cptr[c])) : 0.;
+    for (int k=0; k<nmom; k++){
+      mc[c][k] = 0.;
+      for (int it=0; it<nt; it++) mc[c][k] += tmc[it][c*nmom+k];
+      mc[c][k] *= fac;
+    }
+  }
+  memory->destroy(tmu);
+  memory->destroy(tmc);
+  nch = 0; cptr = crow = NULL;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to get the terms of the Jackson-damped Chebyshev series of the
+ * density at eigenvalue e, k[nmom]: the density is sum_k mu_k k_k, normalized
+ * to mu_0 over e; zero outside the bounds.
+ * ---------------------------------------------------------------------------- */
+void KPM::kernel(const double e, const int nmom, double *k)
+{
+  const double pi = 4.*atan(1.);
+  double x = (e-b)/a;
+  if (x <= -1. || x >= 1.){
+    for (int i=0; i<nmom; i++) k[i] = 0.;
+    return;
+  }
+
+  double fac = 1./(pi*a*sqrt(1.-x*x));
+  double np1 = double(nmom+1), th = pi/np1, cot = cos(th)/sin(th);
+  double t0 = 1., t1 = x;
+  for (int i=0; i<nmom; i++){
+    double t = t0;
+    if (i == 1) t = t1;
+    else if (i > 1){t = 2.*x*t1 - t0; t0 = t1; t1 = t;}
+    double g = ((np1-double(i))*cos(th*i) + sin(th*i)*cot)/np1;
+    k[i] = (i ? 2. : 1.)*g*t*fac;
+  }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get y = (H x - b x)/a for m vectors at once, x and y being
+ * [n][m], so that the innermost loop runs over the vectors.
+ * ---------------------------------------------------------------------------- */
+void KPM::multiply(const double *x, double *y, const int m)
+{
+  const double ra = 1./a;
+  H->multiply(x, y, m);
+  for (int i=0; i<n*m; i++) y[i] = (y[i] - b*x[i])*ra;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to run the Chebyshev recursion a_k+1 = 2 H a_k - a_k-1 from
+ * a_0 = r for the random vectors lo to hi-1 as one block, and to add up
+ * r^T a_k into mu[nmom], and over the rows of each channel into mc[nch*nmom].
+ * ---------------------------------------------------------------------------- */
+void KPM::recursion(const int lo, const int hi, const int nmom, double *mu, double *mc)
+{
+  int m = hi-lo, nm = n*m;
+  double *r, *prev, *cur, *next, *dot;
+  r    = memory->create(r,    nm, "KPM:r");
+  prev = memory->create(prev, nm, "KPM:prev");
+  cur  = memory->create(cur,  nm, "KPM:cur");
+  next = memory->create(next, nm, "KPM:next");
+  dot  = memory->create(dot,  n,  "KPM:dot");
+
+  random(lo, hi, r);
+  for (int i=0; i<nm; i++) cur[i] = r[i];
+  for (int k=0; k<nmom; k++){
+    if (k > 0){
+      multiply(cur, next, m);
+      if (k > 1) for (int i=0; i<nm; i++) next[i] = 2.*next[i] - prev[i];
+      double *ptr = prev; prev = cur; cur = next; next = ptr;
+    }
+
+    double sum = 0.;
+    for (int i=0; i<n; i++){
+      double d = 0.;
+      for (int v=0; v<m; v++) d += r[i*m+v]*cur[i*m+v];
+      dot[i] = d;
+      sum += d;
+    }
+    mu[k] += sum;
+    for (int c=0; c<nch; c++){
+      double s = 0.;
+      for (int j=cptr[c]; j<cptr[c+1]; j++) s += dot[crow[j]];
+      mc[c*nmom+k] += s;
+    }
+  }
+  memory->destroy(r);
+  memory->destroy(prev);
+  memory->destroy(cur);
+  memory->destroy(next);
+  memory->destroy(dot);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the random vectors lo to hi-1 of +/-1, r[n][hi-lo];
+ * vector v is drawn from its own sequence, so the results do not depend on
+ * how the vectors are shared among the threads.
+ * ---------------------------------------------------------------------------- */
+void KPM::random(const int lo, const int hi, double *r)
+{
+  int m = hi-lo;
+  for (int v=lo; v<hi; v++){
+    // splitmix64
+    unsigned long long s = 0x9E3779B97F4A7C15ULL*(unsigned long long)(v+1);
+    for (int i=0; i<n; i++){
+      unsigned long long z = (s += 0x9E3779B97F4A7C15ULL);
+      z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+      z ^= z >> 31;
+      r[i*m+v-lo] = (z >> 63) ? 1. : -1.;
+    }
+  }
+
+return;
+}
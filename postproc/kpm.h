@@ -0,0 +1,31 @@
+#ifndef KPM_H
+#define KPM_H
+
+#include "memory.h"
+#include "sparse.h"
+
+class KPM {
+public:
+  KPM(Sparse *, const int, const int);
+  ~KPM();
+
+  double emin, emax;        // bounds of the spectrum, by Lanczos
+
+  void bounds(const int);
+  void moments(const int, double *, const int, const int *, const int *, double **);
+  void kernel(const double, const int, double *);
+
+private:
+  Memory *memory;
+  int n, nr, nth;           // size of the matrix, # of random vectors, # of threads
+  Sparse *H;                // the real symmetric matrix, [n][n]
+  double a, b;              // the spectrum is mapped onto [-1,1] by (e-b)/a
+  int nch;                  // # of channels to project the moments on, whose rows are
+  const int *cptr, *crow;   // crow[cptr[c]:cptr[c+1]] for channel c
+
+  void multiply(const double *, double *, const int);
+  void recursion(const int, const int, const int, double *, double *);
+  void random(const int, const int, double *);
+};
+
+#endif
@@ -2,11 +2,17 @@
 #include "stdlib.h"
 #include "dynmat.h"
 #include "phonon.h"
+#ifdef UseMPI
+#include "mpi.h"
+#endif
 
 using namespace std;
 
 int main(int argc, char** argv)
 {
+#ifdef UseMPI
+  MPI_Init(&argc, &argv);
+#endif
 
   DynMat *dynmat = new DynMat(argc, argv);
   Phonon *phonon = new Phonon(dynmat);
@@ -14,5 +20,8 @@ int main(int argc, char** argv)
   delete phonon;
   delete dynmat;
 
+#ifdef UseMPI
+  MPI_Finalize();
+#endif
 return 0;
 }
@@ -2,6 +2,27 @@
 #include "stdlib.h"
 #include "string.h"
 #include "memory.h"
+#include <thread>
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define HUGEPAGE  2097152    // size of a huge page, 2 MB
+#define BIGARRAY  HUGEPAGE   // arrays smaller than this are always malloc'ed
+#define MAXNODE   1024
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+int Memory::numa     = 0;
+int Memory::hugepage = 0;
+int Memory::nthreads = 1;
+std::map<void *, bigint> Memory::bigs;
+std::vector<int> Memory::cpus;
 
 /* ----------------------------------------------------------------------
    safe malloc 
@@ -38,9 +59,156 @@ void *Memory::srealloc(void *ptr, bigint nbytes, const char *name)
 void Memory::sfree(void *ptr)
 {
   if (ptr == NULL) return;
+#ifdef __linux__
+  if (!bigs.empty()){
+    std::map<void *, bigint>::iterator it = bigs.find(ptr);
+    if (it != bigs.end()){
+      munmap(ptr, it->second);
+      bigs.erase(it);
+      return;
+    }
+  }
+#endif
   free(ptr);
 }
 
+/* ----------------------------------------------------------------------
+   set the placement of the big arrays, and remember the cpus that the
+   threads can be bound to; to be called once before any thread starts.
+------------------------------------------------------------------------- */
+
+void Memory::set_placement(const int nm, const int hp, const int nt)
+{
+  numa = nm;
+  hugepage = hp;
+  nthreads = nt > 1 ? nt : 1;
+
+  cpus.clear();
+#ifdef __linux__
+  cpu_set_t mask;
+  if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+  for (int i=0; i<CPU_SETSIZE; i++) if (CPU_ISSET(i, &mask)) cpus.push_back(i);
+#endif
+}
+
+/* ----------------------------------------------------------------------
+   bind the calling thread, the it-th of nt, to a cpu; the threads are
+   spread evenly over the available cpus, hence over the sockets, so that
+   a thread of the same index always lands on the same cpu/node.
+------------------------------------------------------------------------- */
+
+void Memory::bind_thread(const int it, const int nt)
+{
+  if (numa == 0 || cpus.empty() || nt < 1) return;
+#ifdef __linux__
+  int ncpu = cpus.size();
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  CPU_SET(cpus[(bigint(it)*ncpu/nt)%ncpu], &mask);
+  pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+#endif
+}
+
+/* ----------------------------------------------------------------------
+   safe allocation of big arrays: page aligned and mapped directly, backed
+   by huge pages and spread over the NUMA nodes as asked; falls back to
+   smalloc if no special placement is asked or the array is small.
+------------------------------------------------------------------------- */
+
+void *Memory::smalloc_big(bigint nbytes, const char *name)
+{
+  if (nbytes == 0) return NULL;
+#ifdef __linux__
+  if ((numa == 0 && hugepage == 0) || nbytes < BIGARRAY) return smalloc(nbytes,name);
+
+  bigint len = (nbytes + HUGEPAGE - 1)/HUGEPAGE * HUGEPAGE;
+  void *ptr = MAP_FAILED;
+  if (hugepage == 2){
+    ptr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    static int warned = 0;
+    if (ptr == MAP_FAILED && warned++ == 0) printf("No explicit huge pages available, transparent ones are used instead.\n");
+  }
+  if (ptr == MAP_FAILED){
+    // map one more huge page to align the array to the huge page boundary
+    char *raw = (char *) mmap(NULL, len+HUGEPAGE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (raw == (char *) MAP_FAILED){
+      printf("Failed to map " BIGINT_FORMAT " bytes for array %s\n", len, name);
+      return smalloc(nbytes,name);
+    }
+    char *head = (char *)((uintptr_t(raw) + HUGEPAGE - 1)/HUGEPAGE * HUGEPAGE);
+    if (head > raw) munmap(raw, head-raw);
+    munmap(head+len, raw+HUGEPAGE-head);
+    ptr = head;
+#ifdef MADV_HUGEPAGE
+    if (hugepage) madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+  }
+
+  if (numa == 1) interleave(ptr, len);
+  else if (numa == 2) first_touch(ptr, len);
+
+  bigs[ptr] = len;
+  return ptr;
+#else
+  return smalloc(nbytes,name);
+#endif
+}
+
+/* ----------------------------------------------------------------------
+   interleave the pages of a not yet touched mapping over all online nodes
+------------------------------------------------------------------------- */
+
+void Memory::interleave(void *ptr, bigint len)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+  unsigned long mask[MAXNODE/(8*sizeof(unsigned long))];
+  for (int i=0; i<int(sizeof(mask)/sizeof(unsigned long)); i++) mask[i] = 0;
+
+  // the online nodes are listed like "0-1,3"
+  int nnode = 0;
+  FILE *fp = fopen("/sys/devices/system/node/online", "r");
+  if (fp){
+    int lo, hi;
+    char sep;
+    while (fscanf(fp, "%d", &lo) == 1){
+      hi = lo;
+      if (fscanf(fp, "%c", &sep) == 1 && sep == '-'){
+        if (fscanf(fp, "%d", &hi) != 1) break;
+        if (fscanf(fp, "%c", &sep) != 1) sep = 0;
+      }
+      for (int i=lo; i<=hi && i<MAXNODE; i++){
+        mask[i/(8*sizeof(unsigned long))] |= 1UL << (i%(8*sizeof(unsigned long)));
+        nnode++;
+      }
+      if (sep != ',') break;
+    }
+    fclose(fp);
+  }
+  if (nnode < 2) return;
+
+  if (syscall(SYS_mbind, ptr, len, MPOL_INTERLEAVE, mask, MAXNODE+1, 0) != 0)
+    printf("Failed to interleave the pages over %d NUMA nodes.\n", nnode);
+#endif
+}
+
+/* ----------------------------------------------------------------------
+   touch the pages of a mapping by nthreads bound threads, each takes one
+   contiguous part, so that the pages are placed on the node of the thread
+------------------------------------------------------------------------- */
+
+void Memory::first_touch(void *ptr, bigint len)
+{
+  bigint npage = len / HUGEPAGE;
+  std::vector<std::thread> workers;
+  for (int it=0; it<nthreads; it++){
+    bigint lo = npage*it/nthreads, hi = npage*(it+1)/nthreads;
+    char *p = (char *) ptr + lo*HUGEPAGE;
+    bigint n = (hi-lo)*HUGEPAGE;
+    workers.push_back(std::thread([=](){ bind_thread(it, nthreads); memset(p, 0, n); }));
+  }
+  for (int it=0; it<nthreads; it++) workers[it].join();
+}
+
 /* ----------------------------------------------------------------------
    erroneous usage of templated create/grow functions
 ------------------------------------------------------------------------- */
@@ -9,6 +9,8 @@
 #include "limits.h"
 #include "stdint.h"
 #include "inttypes.h"
+#include <map>
+#include <vector>
 
 typedef int64_t bigint;
 #define BIGINT_FORMAT "%" PRId64
@@ -23,6 +25,36 @@ class Memory {
   void sfree(void *);
   void fail(const char *);
 
+  // placement of the big arrays: numa = 0, default; 1, interleaved over all
+  // nodes; 2, first touched by nthreads bound threads. hugepage = 0, none;
+  // 1, transparent; 2, explicit (hugetlbfs) 2 MB pages.
+  static int numa, hugepage, nthreads;
+  static void set_placement(const int, const int, const int);
+  static void bind_thread(const int, const int);
+  void *smalloc_big(bigint n, const char *);
+
+/* ----------------------------------------------------------------------
+   create a 2d array whose data is placed as set by set_placement;
+   to be used for the big arrays that are read by many threads.
+   it is freed by destroy as usual, but cannot grow.
+------------------------------------------------------------------------- */
+
+  template <typename TYPE>
+    TYPE **create_big(TYPE **&array, int n1, int n2, const char *name) 
+    {
+      bigint nbytes = sizeof(TYPE) * n1*n2;
+      TYPE *data = (TYPE *) smalloc_big(nbytes,name);
+      nbytes = sizeof(TYPE *) * n1;
+      array = (TYPE **) smalloc(nbytes,name);
+      
+      bigint n = 0;
+      for (int i = 0; i < n1; i++) {
+	array[i] = &data[n];
+	n += n2;
+      }
+      return array;
+    }
+
 /* ----------------------------------------------------------------------
    create a 1d array 
 ------------------------------------------------------------------------- */
@@ -425,6 +457,12 @@ class Memory {
       bytes += sizeof(TYPE ***) * n1;
       return bytes;
     }
+
+ private:
+  static std::map<void *, bigint> bigs;   // mapped big arrays and their lengths
+  static std::vector<int> cpus;           // cpus available at start up
+  void interleave(void *, bigint);
+  void first_touch(void *, bigint);
 };
 
 #endif
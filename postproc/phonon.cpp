@@ -1,7 +1,13 @@
 #include "string.h"
 #include "phonon.h"
 #include "green.h"
+#include "kpm.h"
 #include "timer.h"
+#include "broaden.h"
+#include <list>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
 
 #ifdef UseSPG
 extern "C"{
@@ -31,13 +37,48 @@ Phonon::Phonon(DynMat *dm)
   qpts = NULL;
   wt   = NULL;
   eigs = NULL;
+  qperm = NULL;
+  qmap = NULL;
+  nsym = 0;
+  symrot = NULL;
+  symsrc = NULL;
+  projs = NULL;
+  temps = NULL;
+  tsums = NULL;
+  ntemp = 0;
+  flag_store = 0;
+  nstore = 0;
+  sfreq = swsum = NULL;
+  srange[0] = srange[1] = srange[2] = 0.;
   locals = NULL;
+  flag_all = 0;
+  gptr = gatom = NULL;
+  nq = iqlo = iqhi = 0;
+  qmesh[0] = qmesh[1] = qmesh[2] = qmesh[3] = 0;
+
+  me = dynmat->me;
+  nprocs = dynmat->nprocs;
+  pipe = new Pipeline(dynmat);
+
+  // the derivatives of a DM with respect to q, 3*ndim*ndim, are indexed by int
+  if (dynmat->bkind == 4 && 3*bigint(ndim)*ndim > INT_MAX){
+    if (me == 0) printf("\nWARNING: the cell is too big for the group velocities; adaptive broadening is off.\n");
+    dynmat->bkind = 0;
+  }
 
 #ifdef UseSPG
   attyp = NULL;
   atpos = NULL;
 #endif
 
+#ifdef UseMPI
+  // ranks other than 0 only serve the jobs initiated by rank 0
+  if (me != 0){
+    mpi_worker();
+    return;
+  }
+#endif
+
   // display the menu
   char str[MAXLINE];
   while ( 1 ){
@@ -51,6 +92,14 @@ Phonon::Phonon(DynMat *dm)
     printf("  7. Local phonon DOS from eigenvectors;\n");
     printf("  8. Local phonon DOS by RSGF method;\n");
     printf("  9. Reset the interpolation method;\n");
+    printf(" 10. Group velocities on a q-mesh;\n");
+    printf(" 11. Estimate the interpolation error, Fourier where it is large;\n");
+    printf(" 12. Phonon DOS, local DOS and thermal properties by tetrahedra;\n");
+    printf(" 13. Phonon DOS and thermal properties in one pass, for dense q-meshes;\n");
+    printf(" 14. Projected phonon DOS of groups of atoms;\n");
+    printf(" 15. Phonon DOS and thermal properties by refining the q-mesh until converged;\n");
+    printf(" 16. Phonon DOS by the kernel polynomial method, for large cells at gamma;\n");
+    printf(" 17. Phonon DOS, N(f) or # of modes below f again from the last q-mesh;\n");
     printf("  0. Exit.\n");
     // read user choice
     int job = 0;
@@ -68,9 +117,30 @@ Phonon::Phonon(DynMat *dm)
     else if (job == 6) therm(); 
     else if (job == 7) ldos_egv(); 
     else if (job == 8) ldos_rsgf(); 
-    else if (job == 9) dynmat->reset_interp_method();
+    else if (job == 9){
+#ifdef UseMPI
+      mpi_job(JobResetInterp);
+#endif
+      dynmat->reset_interp_method();
+    }
+    else if (job ==10) pvel();
+    else if (job ==11){
+#ifdef UseMPI
+      mpi_job(JobEstimate);
+#endif
+      dynmat->estimate_error();
+    }
+    else if (job ==12) ptetra();
+    else if (job ==13) pstream();
+    else if (job ==14) pgroups();
+    else if (job ==15) prefine();
+    else if (job ==16) pkpm();
+    else if (job ==17) prebin();
     else break;
   }
+#ifdef UseMPI
+  mpi_job(JobExit);
+#endif
 return;
 }
 
@@ -79,13 +149,25 @@ return;
  * ---------------------------------------------------------------------------- */
 Phonon::~Phonon()
 {
+  delete pipe;
   dynmat = NULL;
 
   memory->destroy(wt);
   memory->destroy(qpts);
   memory->destroy(eigs);
+  memory->destroy(qperm);
+  memory->destroy(qmap);
+  memory->destroy(symrot);
+  memory->destroy(symsrc);
+  memory->destroy(projs);
+  memory->destroy(temps);
+  memory->destroy(tsums);
+  memory->destroy(sfreq);
+  memory->destroy(swsum);
 
   memory->destroy(locals);
+  memory->destroy(gptr);
+  memory->destroy(gatom);
 
   memory->destroy(dos);
   memory->destroy(ldos);
@@ -102,20 +184,19 @@ Phonon::~Phonon()
  * ---------------------------------------------------------------------------- */
 void Phonon::pdos()
 {
+  // with adaptive broadening, the DOS is got during the loop over q
+  if (dynmat->bkind == 4){
+    adaptive_dos();
+    return;
+  }
+
   // get frequencies on a q-mesh
   QMesh();       // generate q-points, hopefully irreducible
   ComputeAll();  // get all eigen values ==> frequencies
 
   // now to get the frequency range
   char str[MAXLINE];
-
-  fmin = fmax = eigs[0][0];
-  for (int iq=0; iq<nq; iq++){
-    for (int j=0; j<ndim; j++){
-      fmin = MIN(fmin, eigs[iq][j]);
-      fmax = MAX(fmax, eigs[iq][j]);
-    }
-  }
+  FreqRange();
 
   // Now to ask for the output frequency range
   printf("\nThe frequency range of all q-points are: [%g %g]\n", fmin, fmax);
@@ -132,30 +213,15 @@ void Phonon::pdos()
   if (count_words(fgets(str,MAXLINE,stdin)) > 0) ndos = atoi(strtok(str," \t\n\r\f"));
   ndos += (ndos+1)%2; ndos = MAX(2,ndos);
 
-  
-  df  = (fmax-fmin)/double(ndos-1);
-  rdf = 1./df;
-  memory->destroy(dos);
-  dos = memory->create(dos, ndos, "pdos:dos");
-  for (int i=0; i<ndos; i++) dos[i] = 0.;
-
   // now to calculate the DOS
-  double offset = fmin-0.5*df;
-  for (int iq=0; iq<nq; iq++){
-    if (wt[iq] > 0.){
-      for (int j=0; j<ndim; j++){
-        int idx = int((eigs[iq][j]-offset)*rdf);
-        if (idx>=0 && idx<ndos) dos[idx] += wt[iq];
-      }
-    }
-  }
+  Histogram();
 
   // smooth dos ?
   printf("Would you like to smooth the phonon dos? (y/n)[n]: ");
   if (count_words(fgets(str,MAXLINE,stdin)) > 0){
     char *flag = strtok(str," \t\n\r\f");
     if (strcmp(flag,"y") == 0 || strcmp(flag,"Y") == 0){
-      smooth(dos, ndos);
+      smooth();
     }
   }
 
@@ -168,6 +234,49 @@ void Phonon::pdos()
 return;
 }
 
+/* ----------------------------------------------------------------------------
+ * Private method to calculate the phonon DOS with adaptive broadening, as set
+ * by -b 4: each mode is spread over the frequency grid by a Gaussian whose
+ * width follows from its group velocity and the spacing of the q-mesh, as it
+ * is evaluated, so the frequency range is asked first.
+ * ---------------------------------------------------------------------------- */
+void Phonon::adaptive_dos()
+{
+  QMesh();
+
+  char str[MAXLINE];
+  fmin = 0.; fmax = 10.;
+  printf("\nPlease input the desired range to get DOS [%g %g]: ", fmin, fmax);
+  if (count_words(fgets(str,MAXLINE,stdin)) >= 2){
+    fmin = atof(strtok(str," \t\n\r\f"));
+    fmax = atof(strtok(NULL," \t\n\r\f"));
+  }
+  if (fmin > fmax){double swap = fmin; fmin = fmax; fmax = swap;}
+  printf("The fequency range for your phonon DOS is [%g %g].\n", fmin, fmax);
+
+  ndos = 201;
+  printf("Please input the number of intervals [%d]: ", ndos);
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0) ndos = atoi(strtok(str," \t\n\r\f"));
+  ndos += (ndos+1)%2; ndos = MAX(2,ndos);
+  df  = (fmax-fmin)/double(ndos-1);
+  rdf = 1./df;
+
+  Timer *time = new Timer();
+  printf("\nNow to compute the phonons and the DOS, each mode broadened by %g times\n", dynmat->bwidth[0]);
+  printf("the change of its frequency across a cell of the q-mesh "); fflush(stdout);
+  nlocal = flag_all = 0;
+  LDOSLoop();
+  printf("Done! ");
+  time->stop(); time->print(); delete time;
+
+  memory->destroy(ldos);
+  ldos = NULL;
+  Normalize();
+  writeDOS();
+
+return;
+}
+
 /* ----------------------------------------------------------------------------
  * Private method to write the phonon DOS to file
  * ---------------------------------------------------------------------------- */
@@ -197,12 +306,34 @@ return;
 }
 
 /* ----------------------------------------------------------------------------
- * Private method to write the local DOS to files.
+ * Private method to write the local DOS to files; that of all atoms goes to
+ * a single binary file instead: int natom, int ndos, int sysdim, double fmin,
+ * double df, then dos[ndos] and ldos[natom][ndos][sysdim].
  * ---------------------------------------------------------------------------- */
 void Phonon::writeLDOS()
 {
   if (ldos == NULL) return;
 
+  if (flag_all){
+    char str[MAXLINE];
+    printf("\nPlease input the filename to write the local DOSs of all atoms [pldos.bin]: ");
+    if (count_words(fgets(str,MAXLINE,stdin)) < 1) strcpy(str, "pldos.bin");
+    char *fname = strtok(str," \t\n\r\f");
+
+    printf("The phonon LDOSs of all %d atoms will be written to file: %s\n\n", nlocal, fname);
+    FILE *fp = fopen(fname, "wb"); fname = NULL;
+    fwrite(&nlocal, sizeof(int),    1, fp);
+    fwrite(&ndos,   sizeof(int),    1, fp);
+    fwrite(&sysdim, sizeof(int),    1, fp);
+    fwrite(&fmin,   sizeof(double), 1, fp);
+    fwrite(&df,     sizeof(double), 1, fp);
+    fwrite(dos,        sizeof(double), ndos, fp);
+    fwrite(ldos[0][0], sizeof(double), bigint(nlocal)*ndos*sysdim, fp);
+    fclose(fp);
+
+    return;
+  }
+
   printf("The phonon LDOSs will be written to file(s) : pldos_?.dat\n\n");
   const double one3 = 1./double(sysdim);
   char str[MAXLINE];
@@ -228,22 +359,23 @@ return;
 
 /* ----------------------------------------------------------------------------
  * Private method to calculate the local phonon DOS via the real space Green's
- * function method
+ * function method, from the sparse Hessian at gamma
  * ---------------------------------------------------------------------------- */
 void Phonon::ldos_rsgf()
 {
   char str[MAXLINE];
   const double tpi = 8.*atan(1.);
-  double **Hessian, scale;
+  double scale;
   scale = dynmat->eml2f*tpi; scale *= scale;
-  Hessian = memory->create(Hessian, ndim, ndim, "phonon_ldos:Hessian");
 
   double q0[3];
   q0[0] = q0[1] = q0[2] = 0.;
 
+  // the Hessian as sparse blocks, in the unit of angular frequency squared
   dynmat->getDMq(q0);
-  for (int i=0; i<ndim; i++)
-  for (int j=0; j<ndim; j++) Hessian[i][j] = dynmat->DM_q[i][j].r*scale;
+  Sparse *Hessian = new Sparse(dynmat->nucell, sysdim, dynmat->DM_q, scale, dynmat->droptol);
+  sprintf(str, "(2pi %s)", dynmat->funit);
+  Hessian->print(str);
 
   if (ndim < 300){
     double *egvs = new double [ndim];
@@ -271,9 +403,10 @@ void Phonon::ldos_rsgf()
       istr = iend = ik;
       iinc = 1;
     } else if (nr == 1) {
-      if (strcmp(str,"q") == 0) break;
+      char *ptr = strtok(str," \t\n\r\f");
+      if (strcmp(ptr,"q") == 0) break;
 
-      ik = atoi(strtok(str," \t\n\r\f"));
+      ik = atoi(ptr);
       if (ik < 0 || ik >= dynmat->nucell) break;
       istr = iend = ik;
       iinc = 1;
@@ -311,7 +444,7 @@ void Phonon::ldos_rsgf()
     if (eps <= 0.) break;
     
     // prepare array for local pdos
-    nlocal = 0;
+    nlocal = flag_all = 0;
     for (ik = istr; ik <= iend; ik += iinc) nlocal++;
     memory->destroy(ldos);
     ldos = memory->create(ldos,nlocal,ndos,dynmat->sysdim,"ldos_rsgf:ldos");
@@ -346,7 +479,136 @@ void Phonon::ldos_rsgf()
     local_therm();
 
   }
-  memory->destroy(Hessian);
+  delete Hessian;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the phonon DOS at gamma, and optionally the projected
+ * DOS of groups of atoms, by the kernel polynomial method, for cells too large
+ * to diagonalize the dynamical matrix, kept as sparse blocks. The eigenvalues
+ * of D, scaled to the unit of frequency squared, are f|f|, so the DOS is
+ * 2|f| rho(f|f|).
+ * ---------------------------------------------------------------------------- */
+void Phonon::pkpm()
+{
+  char str[MAXLINE];
+  int nmom = 256, nr = 16;
+  printf("\nThe DOS at gamma is got from Chebyshev moments of the dynamical matrix,\n");
+  printf("each estimated by the mean over a set of random vectors.\n");
+  printf("Please input the # of moments and of random vectors [%d %d]: ", nmom, nr);
+  if (count_words(fgets(str,MAXLINE,stdin)) >= 2){
+    nmom = atoi(strtok(str," \t\n\r\f"));
+    nr   = atoi(strtok(NULL," \t\n\r\f"));
+  }
+  if (nmom < 2 || nr < 1) return;
+
+  nlocal = flag_all = 0;
+  printf("Would you like to get the projected DOS of groups of atoms as well? (y/n)[n]: ");
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0){
+    char *flag = strtok(str," \t\n\r\f");
+    if (strcmp(flag,"y") == 0 || strcmp(flag,"Y") == 0) AtomGroups();
+  }
+
+  // the dynamical matrix at gamma, in the unit of frequency squared
+  double q0[3] = {0., 0., 0.};
+  dynmat->getDMq(q0);
+  Sparse *Hessian = new Sparse(dynmat->nucell, sysdim, dynmat->DM_q, dynmat->eml2f*dynmat->eml2f, dynmat->droptol);
+  Hessian->print(dynmat->funit);
+
+  int nth = MAX(1, dynmat->nthreads[0] + dynmat->nthreads[1]);
+  KPM *kpm = new KPM(Hessian, nr, nth);
+  printf("\nNow to estimate the bounds of the spectrum by Lanczos ..."); fflush(stdout);
+  kpm->bounds(100);
+  fmin = kpm->emin < 0. ? -sqrt(-kpm->emin) : sqrt(kpm->emin);
+  fmax = kpm->emax < 0. ? -sqrt(-kpm->emax) : sqrt(kpm->emax);
+  printf("Done!\nThe frequencies at gamma are within about [%g %g].\n", fmin, fmax);
+
+  printf("Please input the desired range to get DOS [%g %g]: ", fmin, fmax);
+  if (count_words(fgets(str,MAXLINE,stdin)) >= 2){
+    fmin = atof(strtok(str," \t\n\r\f"));
+    fmax = atof(strtok(NULL," \t\n\r\f"));
+  }
+  if (fmin > fmax){double swap = fmin; fmin = fmax; fmax = swap;}
+  printf("The fequency range for your phonon DOS is [%g %g].\n", fmin, fmax);
+
+  ndos = 201;
+  printf("Please input the number of intervals [%d]: ", ndos);
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0) ndos = atoi(strtok(str," \t\n\r\f"));
+  ndos += (ndos+1)%2; ndos = MAX(2,ndos);
+  if (fmax <= fmin){
+    printf("\nError: the frequency range is empty!\n");
+    delete kpm;
+    delete Hessian;
+    memory->destroy(gptr);
+    memory->destroy(gatom);
+    gptr = gatom = NULL;
+    nlocal = 0;
+    return;
+  }
+  df  = (fmax-fmin)/double(ndos-1);
+  rdf = 1./df;
+
+  // the channels of the groups: the rows of direction d of the atoms of group i
+  int nch = nlocal*sysdim, *cptr, *crow;
+  cptr = memory->create(cptr, nch+1, "pkpm:cptr");
+  crow = memory->create(crow, MAX(1, gptr ? gptr[nlocal]*sysdim : 0), "pkpm:crow");
+  cptr[0] = 0;
+  for (int c=0; c<nch; c++){
+    int ig = c/sysdim, idim = c%sysdim;
+    cptr[c+1] = cptr[c];
+    for (int m=gptr[ig]; m<gptr[ig+1]; m++) crow[cptr[c+1]++] = gatom[m]*sysdim + idim;
+  }
+
+  double *mu, **mc, *ker;
+  mu  = memory->create(mu,  nmom, "pkpm:mu");
+  mc  = memory->create(mc,  MAX(1,nch), nmom, "pkpm:mc");
+  ker = memory->create(ker, nmom, "pkpm:ker");
+
+  Timer *time = new Timer();
+  printf("\nNow to compute %d moments with %d random vectors ...", nmom, nr); fflush(stdout);
+  kpm->moments(nmom, mu, nch, cptr, crow, mc);
+  printf("Done! ");
+  time->stop(); time->print(); delete time;
+
+  // the Jackson-damped series on the frequency grid
+  memory->destroy(dos);
+  memory->destroy(ldos);
+  ldos = NULL;
+  dos = memory->create(dos, ndos, "pkpm:dos");
+  if (nlocal > 0) ldos = memory->create(ldos, nlocal, ndos, sysdim, "pkpm:ldos");
+  double freq = fmin;
+  for (int i=0; i<ndos; i++){
+    kpm->kernel(freq*fabs(freq), nmom, ker);
+    double jac = 2.*fabs(freq);
+    double sum = 0.;
+    for (int k=0; k<nmom; k++) sum += mu[k]*ker[k];
+    dos[i] = sum*jac;
+    for (int c=0; c<nch; c++){
+      sum = 0.;
+      for (int k=0; k<nmom; k++) sum += mc[c][k]*ker[k];
+      ldos[c/sysdim][i][c%sysdim] = sum*jac;
+    }
+    freq += df;
+  }
+  delete kpm;
+  delete Hessian;
+  memory->destroy(mu);
+  memory->destroy(mc);
+  memory->destroy(ker);
+  memory->destroy(cptr);
+  memory->destroy(crow);
+
+  Normalize();
+  writeDOS();
+  if (nlocal > 0){
+    writeGDOS();
+    local_therm();
+  }
+  memory->destroy(gptr);
+  memory->destroy(gatom);
+  gptr = gatom = NULL;
 
 return;
 }
@@ -371,7 +633,6 @@ void Phonon::pdisp()
   int nq = MAX(MAX(dynmat->nx,dynmat->ny),dynmat->nz)/2+1;
   qend[0] = qend[1] = qend[2] = 0.;
 
-  double *egvs = new double [ndim];
   while (1){
     for (int i=0; i<3; i++) qstr[i] = qend[i];
 
@@ -399,14 +660,16 @@ void Phonon::pdisp()
     for (int i=0; i<3; i++) qinc[i] = (qend[i]-qstr[i])/double(nq-1);
     dq = sqrt(qinc[0]*qinc[0]+qinc[1]*qinc[1]+qinc[2]*qinc[2]);
 
+    double *egvs, *wii;
+    egvs = memory->create(egvs, nq*ndim, "pdisp:egvs");
+    wii  = memory->create(wii,  nq,      "pdisp:wii");
+    DispLine(qstr, qinc, nq, egvs, wii);
+
     for (int i=0; i<3; i++) q[i] = qstr[i];
     for (int ii=0; ii<nq; ii++){
-      double wii = 1.;
-      dynmat->getDMq(q, &wii);
-      if (wii > 0.){
-        dynmat->geteigen(egvs, 0);
+      if (wii[ii] > 0.){
         fprintf(fp,"%lg %lg %lg %lg ", q[0], q[1], q[2], qr);
-        for (int i=0; i<ndim; i++) fprintf(fp," %lg", egvs[i]);
+        for (int i=0; i<ndim; i++) fprintf(fp," %lg", egvs[ii*ndim+i]);
       }
       fprintf(fp,"\n");
 
@@ -414,9 +677,10 @@ void Phonon::pdisp()
       qr += dq;
     }
     qr -= dq;
+    memory->destroy(egvs);
+    memory->destroy(wii);
   }
   fclose(fp);
-  delete []egvs;
 
 return;
 }
@@ -513,52 +777,63 @@ void Phonon::DMdisp()
     for (int i=0; i<3; i++) qinc[i] = (qend[i]-qstr[i])/double(nq-1);
     dq = sqrt(qinc[0]*qinc[0]+qinc[1]*qinc[1]+qinc[2]*qinc[2]);
 
+    double **qline;
+    qline = memory->create(qline, nq, 3, "DMdisp:qline");
     for (int i=0; i<3; i++) q[i] = qstr[i];
     for (int ii=0; ii<nq; ii++){
-      dynmat->getDMq(q);
-      dynmat->writeDMq(q, qr, fp);
-      for (int i=0; i<3; i++) q[i] += qinc[i];
+      for (int i=0; i<3; i++){qline[ii][i] = q[i]; q[i] += qinc[i];}
+    }
+
+    pipe->start(nq, qline, NULL, -1);
+    for (int ii=0; ii<nq; ii++){
+      QSlot *slot = pipe->next();
+      dynmat->writeDMq(qline[ii], qr, fp, slot->DMq);
+      pipe->release(slot);
       qr += dq;
     }
+    pipe->stop();
     qr -= dq;
+    memory->destroy(qline);
   }
   fclose(fp);
 return;
 }
 
 /* ----------------------------------------------------------------------------
- * Private method to smooth the dos
+ * Private method to smooth the DOS, and the local DOSs if any, by the kernel
+ * of option -b, or a Gaussian of 2*sqrt(2) intervals by default; all their
+ * channels are broadened by one batched FFT convolution.
  * ---------------------------------------------------------------------------- */
-void Phonon::smooth(double *array, const int npt)
+void Phonon::smooth()
 {
-  if (npt < 4) return;
-
-  int nlag = npt/4;
-
-  double *tmp, *table;
-  tmp   = memory->create(tmp, npt, "smooth:tmp");
-  table = memory->create(table, nlag+1, "smooth:table");
-  
-  double fnorm = -1.;
-  double sigma = 4., fac = 1./(sigma*sigma);
-  for (int jj=0; jj<= nlag; jj++){
-    table[jj] = exp(-double(jj*jj)*fac);
-    fnorm += table[jj];
+  if (dos == NULL || ndos < 4) return;
+
+  int kind = dynmat->bkind;
+  double w1 = dynmat->bwidth[0], w2 = dynmat->bwidth[1];
+  if (kind < 1 || kind > 3){kind = 1; w1 = sqrt(8.)*df;}
+  const char *name[] = {"Gaussian", "Lorentzian", "Voigt"};
+  printf("The DOS is smoothed by a %s of width %g", name[kind-1], w1);
+  if (kind == 3) printf(" and %g", w2);
+  printf(" %s.\n", dynmat->funit);
+
+  // the channels of each frequency together: dos, then the local DOSs
+  int nl = ldos ? nlocal*sysdim : 0, m = 1 + nl;
+  double *tmp;
+  tmp = memory->create(tmp, ndos*m, "smooth:tmp");
+  for (int i=0; i<ndos; i++){
+    tmp[i*m] = dos[i];
+    for (int il=0; il<nl; il++) tmp[i*m+1+il] = ldos[il/sysdim][i][il%sysdim];
   }
-  fnorm = 1./fnorm;
 
-  for (int i=0; i<npt; i++){
-    tmp[i] = 0.;
-    for (int jj=-nlag; jj<= nlag; jj++){
-      int j = (i+jj+npt)%npt; // assume periodical data
+  Broaden *broaden = new Broaden(ndos, df, kind, w1, w2);
+  broaden->execute(tmp, m);
+  delete broaden;
 
-      tmp [i] += array[j]*table[abs(jj)];
-    }
+  for (int i=0; i<ndos; i++){
+    dos[i] = tmp[i*m];
+    for (int il=0; il<nl; il++) ldos[il/sysdim][i][il%sysdim] = tmp[i*m+1+il];
   }
-  for (int i=0; i<npt; i++) array[i] = tmp[i]*fnorm;
-
   memory->destroy(tmp);
-  memory->destroy(table);
 
 return;
 }
@@ -583,34 +858,18 @@ void Phonon::therm()
   fprintf(fp,"#Temp   Uvib    Svib     Fvib    ZPE      Cvib\n");
   fprintf(fp,"# K      eV      Kb       eV      eV       Kb\n");
 
-  // constants          J.s             J/K                J
-  const double h = 6.62606896e-34, Kb = 1.380658e-23, eV = 1.60217733e-19;
+  // constants          J/K                J
+  const double Kb = 1.380658e-23, eV = 1.60217733e-19;
 
   // first temperature
   double T = dynmat->Tmeasure;
   do {
-    // constants under the same temperature; assuming angular frequency in THz
-    double h_o_KbT = h/(Kb*T)*1.e12, KbT_in_eV = Kb*T/eV;
+    // constants under the same temperature
+    double KbT_in_eV = Kb*T/eV;
 
-    double Uvib = 0., Svib = 0., Fvib = 0., Cvib = 0., ZPE = 0.;
-    for (int iq=0; iq<nq; iq++){
-      double Utmp = 0., Stmp = 0., Ftmp = 0., Ztmp = 0., Ctmp = 0.;
-      for (int i=0; i<ndim; i++){
-        if (eigs[iq][i] <= 0.) continue;
-        double x = eigs[iq][i] * h_o_KbT;
-        double expterm = 1./(exp(x)-1.);
-        Stmp += x*expterm - log(1.-exp(-x));
-        Utmp += (0.5+expterm)*x;
-        Ftmp += log(2.*sinh(0.5*x));
-        Ctmp += x*x*exp(x)*expterm*expterm;
-        Ztmp += 0.5*h*eigs[iq][i];
-      }
-      Svib += wt[iq]*Stmp;
-      Uvib += wt[iq]*Utmp;
-      Fvib += wt[iq]*Ftmp;
-      Cvib += wt[iq]*Ctmp;
-      ZPE  += wt[iq]*Ztmp;
-    }
+    double sums[5];
+    ThermSums(T, sums);
+    double Uvib = sums[0], Svib = sums[1], Fvib = sums[2], Cvib = sums[3], ZPE = sums[4];
     Uvib *= KbT_in_eV;
     Fvib *= KbT_in_eV;
     ZPE  /= eV*1.e-12;
@@ -626,6 +885,50 @@ void Phonon::therm()
 return;
 }
 
+/* ----------------------------------------------------------------------------
+ * Private method to sum up the vibrational thermal properties of the local
+ * q-points at temperature T; the unscaled Uvib, Svib, Fvib, Cvib and ZPE are
+ * returned in sums on rank 0.
+ * ---------------------------------------------------------------------------- */
+void Phonon::ThermSums(double T, double *sums)
+{
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobThermSums);
+  MPI_Bcast(&T, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+#endif
+  // constants          J.s             J/K
+  const double h = 6.62606896e-34, Kb = 1.380658e-23;
+  // constants under the same temperature; assuming angular frequency in THz
+  double h_o_KbT = h/(Kb*T)*1.e12;
+
+  for (int i=0; i<5; i++) sums[i] = 0.;
+  for (int iq=iqlo; iq<iqhi; iq++){
+    double *egv = eigs[iq-iqlo];
+    double Utmp = 0., Stmp = 0., Ftmp = 0., Ztmp = 0., Ctmp = 0.;
+    for (int i=0; i<ndim; i++){
+      if (egv[i] <= 0.) continue;
+      double x = egv[i] * h_o_KbT;
+      double expterm = 1./(exp(x)-1.);
+      Stmp += x*expterm - log(1.-exp(-x));
+      Utmp += (0.5+expterm)*x;
+      Ftmp += log(2.*sinh(0.5*x));
+      Ctmp += x*x*exp(x)*expterm*expterm;
+      Ztmp += 0.5*h*egv[i];
+    }
+    sums[0] += wt[iq]*Utmp;
+    sums[1] += wt[iq]*Stmp;
+    sums[2] += wt[iq]*Ftmp;
+    sums[3] += wt[iq]*Ctmp;
+    sums[4] += wt[iq]*Ztmp;
+  }
+#ifdef UseMPI
+  if (me == 0) MPI_Reduce(MPI_IN_PLACE, sums, 5, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  else MPI_Reduce(sums, NULL, 5, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+#endif
+
+return;
+}
+
 /* ----------------------------------------------------------------------------
  * Private method to calculate the local thermal properties
  * ---------------------------------------------------------------------------- */
@@ -742,77 +1045,726 @@ return;
 }
 
 /* ----------------------------------------------------------------------------
- * Private method to generate the q-points from a uniform q-mesh
+ * Private method to calculate the vibrational thermal properties from the
+ * DOS by tetrahedra, got anew on a fine grid over all positive frequencies;
+ * the same sums as ThermSums, integrated over the DOS instead.
  * ---------------------------------------------------------------------------- */
-void Phonon::QMesh()
+void Phonon::tetra_therm()
 {
-  // ask for mesh info
   char str[MAXLINE];
-  int nx = dynmat->nx, ny = dynmat->ny, nz = dynmat->nz;
-  printf("\nThe q-mesh size from the read dynamical matrix is: %d x %d x %d\n", nx, ny, nz);
-  printf("A denser mesh can be interpolated, but NOTE a too dense mesh can cause segmentation fault.\n");
-  printf("Please input your desired q-mesh size [%d %d %d]: ", nx, ny, nz);
-  if (count_words(fgets(str,MAXLINE,stdin)) >= 3){
-    nx = atoi(strtok(str," \t\n\r\f"));
-    ny = atoi(strtok(NULL," \t\n\r\f"));
-    nz = atoi(strtok(NULL," \t\n\r\f"));
-  }
-  if (nx<1||ny<1||nz<1) return;
-  if (dynmat->nx == 1) nx = 1;
-  if (dynmat->ny == 1) ny = 1;
-  if (dynmat->nz == 1) nz = 1;
+  printf("\nWould you like to compute the thermal properties (y/n)[n]: ");
+  if (count_words(fgets(str,MAXLINE,stdin)) < 1) return;
+  char *ptr = strtok(str," \t\n\r\f");
+  if (strcmp(ptr,"y") != 0 && strcmp(ptr, "Y") != 0 && strcmp(ptr, "yes") != 0) return;
 
-#ifdef UseSPG
-  // ask method to generate q-points
-  int method = 2;
-  printf("Please select your method to generate the q-points:\n");
-  printf("  1. uniform;\n  2. Monkhost-Pack mesh;\nYour choice [2]: ");
-  if (count_words(fgets(str,MAXLINE,stdin)) > 0) method = atoi(strtok(str," \t\n\r\f"));
-  method = 2-method%2;
-#endif
- 
-  memory->destroy(wt);
-  memory->destroy(qpts);
+  printf("Please input the filename to output thermal properties [therm.dat]: ");
+  if (count_words(fgets(str,MAXLINE,stdin)) < 1) strcpy(str, "therm.dat");
+  FILE *fp = fopen(strtok(str," \t\n\r\f"), "a");
+  // header line 
+  fprintf(fp,"#Temp   Uvib    Svib     Fvib    ZPE      Cvib\n");
+  fprintf(fp,"# K      eV      Kb       eV      eV       Kb\n");
 
-#ifdef UseSPG
-  if (method == 1){
-#endif
-    nq = nx*ny*nz;
-    double w = 1./double(nq);
-    wt   = memory->create(wt,   nq, "QMesh:wt");
-    qpts = memory->create(qpts, nq, 3, "QMesh:qpts");
+  // the total DOS only, per unit cell
+  FreqRange();
+  fmin = 0.; fmax = MAX(fmax, 1.e-6);
+  ndos = 10001; nlocal = 0;
+  TetraDOS();
 
-    int iq = 0;
-    for (int i=0; i<nx; i++)
-    for (int j=0; j<ny; j++)
-    for (int k=0; k<nz; k++){
-      qpts[iq][0] = double(i)/double(nx);
-      qpts[iq][1] = double(j)/double(ny);
-      qpts[iq][2] = double(k)/double(nz);
-      wt[iq++] = w;
+  // constants          J.s             J/K                J
+  const double h = 6.62606896e-34, Kb = 1.380658e-23, eV = 1.60217733e-19;
+  double T = dynmat->Tmeasure;
+  do {
+    // constants under the same temperature; assuming angular frequency in THz
+    double h_o_KbT = h/(Kb*T)*1.e12, KbT_in_eV = Kb*T/eV;
+
+    double Uvib = 0., Svib = 0., Fvib = 0., Cvib = 0., ZPE = 0.;
+    for (int i=1; i<ndos; i++){
+      double freq = fmin + double(i)*df;
+      double x = freq * h_o_KbT;
+      double expterm = 1./(exp(x)-1.);
+
+      Svib += dos[i]*(x*expterm - log(1.-exp(-x)));
+      Uvib += dos[i]*(0.5+expterm)*x;
+      Fvib += dos[i]*log(2.*sinh(0.5*x));
+      Cvib += dos[i]*x*x*exp(x)*expterm*expterm;
+      ZPE  += dos[i]*0.5*h*freq;
     }
-#ifdef UseSPG
+    Uvib *= KbT_in_eV*df;
+    Svib *= df;
+    Fvib *= KbT_in_eV*df;
+    Cvib *= df;
+    ZPE  /= eV*1.e-12*rdf;
+    // output result under current temperature
+    fprintf(fp,"%lg %lg %lg %lg %lg %lg\n", T, Uvib, Svib, Fvib, ZPE, Cvib);
+
+    printf("Please input the desired temperature (K), enter to exit: ");
+    if (count_words(fgets(str,MAXLINE,stdin)) < 1) break;
+    T = atof(strtok(str," \t\n\r\f"));
+  } while (T > 0.);
+  fclose(fp);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to calculate the group velocities of all branches on a
+ * q-mesh; they are written to a binary file together with the frequencies:
+ *   int nq, int ndim; then for each q: q[3], weight, freq[ndim], v[ndim][3]
+ * all in double, with v in Cartesian coordinates.
+ * ---------------------------------------------------------------------------- */
+void Phonon::pvel()
+{
+  // the derivatives of a DM with respect to q, 3*ndim*ndim, are indexed by int
+  if (3*bigint(ndim)*ndim > INT_MAX){
+    printf("\nThe cell is too big for the group velocities, %d x %d x 3 elements of dD/dq\n", ndim, ndim);
+    printf("per q-point exceed the range of int.\n");
+    return;
   }
-  if ((method == 2) && (atpos == NULL)){
-    atpos = memory->create(atpos, dynmat->nucell,3,"QMesh:atpos");
-    attyp = memory->create(attyp, dynmat->nucell,  "QMesh:attyp");
 
-    for (int i=0; i<dynmat->nucell; i++)
-    for (int idim=0; idim<3; idim++) atpos[i][idim] = 0.;
-    for (int i=0; i<3; i++) latvec[i][i] = 1.;
+  // get the q-points
+  QMesh();
 
-    int flag_lat_info_read = dynmat->flag_latinfo;
+  char str[MAXLINE];
+  printf("\nPlease input the filename to write the group velocities [velocity.bin]: ");
+  if (count_words(fgets(str,MAXLINE,stdin)) < 1) strcpy(str, "velocity.bin");
+  char *fname = strtok(str," \t\n\r\f");
 
-    if ( flag_lat_info_read ){ // get unit cell info from binary file; done by dynmat
-      num_atom = dynmat->nucell;
-      // set default, in case system dimension under study is not 3.
-      for (int i=0; i<dynmat->nucell; i++)
-      for (int idim=0; idim<3; idim++) atpos[i][idim] = 0.;
-      for (int i=0; i<3; i++) latvec[i][i] = 1.;
+  FILE *fp = fopen(fname, "wb");
+  if (fp == NULL){
+    printf("\nError while opening file %s for writing!\n", fname);
+    return;
+  }
+  printf("The frequencies and group velocities will be written to file: %s\n", fname);
 
-      // get atomic type info
-      for (int i=0; i<num_atom; i++) attyp[i] = dynmat->attyp[i];
-      // get unit cell vector info
+  Timer *time = new Timer();
+  printf("\nNow to compute the group velocities "); fflush(stdout);
+  VelocityLoop(fp);
+  fclose(fp);
+  printf("Done!\n");
+  time->stop(); time->print(); delete time;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to calculate the phonon DOS, the local DOS of selected atoms
+ * and the vibrational thermal properties by the linear tetrahedron method,
+ * which interpolates the frequencies linearly within each tetrahedron of the
+ * q-mesh instead of binning them, and thus needs no smoothing and converges
+ * much faster with the mesh; the total DOS can use the irreducible q-points.
+ * ---------------------------------------------------------------------------- */
+void Phonon::ptetra()
+{
+  // get the q-points
+  QMesh();
+  if (qmesh[0]*qmesh[1]*qmesh[2] < 2){
+    printf("\nThe tetrahedron method needs a q-mesh of more than one point.\n");
+    return;
+  }
+
+  // get local position info
+  char str[MAXLINE], *ptr;
+  printf("\nThe # of atoms per cell is: %d, please input the atom IDs to compute\n", dynmat->nucell);
+  printf("local PDOS, IDs begin with 0, enter for none: ");
+  int nmax = count_words(fgets(str,MAXLINE,stdin));
+  nlocal = flag_all = 0;
+  if (nmax > 0){
+    memory->destroy(locals);
+    locals = memory->create(locals, nmax, "ptetra:locals");
+
+    ptr = strtok(str," \t\n\r\f");
+    while (ptr != NULL){
+      int id = atoi(ptr);
+      if (id >= 0 && id < dynmat->nucell) locals[nlocal++] = id;
+
+      ptr = strtok(NULL," \t\n\r\f");
+    }
+  }
+  if (nlocal > 0 && qmesh[3] == 2){
+    printf("The eigenvectors on the irreducible q-points are not symmetrized; please use\n");
+    printf("a uniform q-mesh for the local PDOS, which is skipped now.\n");
+    nlocal = 0;
+  }
+  if (nlocal > 0){
+    printf("Local PDOS for atom(s):");
+    for (int i=0; i<nlocal; i++) printf(" %d", locals[i]);
+    printf("  will be computed.\n");
+  }
+
+  // get frequencies, and projections if needed, on all q-points
+  TetraLoop();
+  FreqRange();
+
+  // Now to ask for the output frequency range
+  printf("\nThe frequency range of all q-points are: [%g %g]\n", fmin, fmax);
+  printf("Please input the desired range to get DOS [%g %g]: ", fmin, fmax);
+  if (count_words(fgets(str,MAXLINE,stdin)) >= 2){
+    fmin = atof(strtok(str," \t\n\r\f"));
+    fmax = atof(strtok(NULL," \t\n\r\f"));
+  }
+  if (fmin > fmax){double swap = fmin; fmin = fmax; fmax = swap;}
+  printf("The fequency range for your phonon DOS is [%g %g].\n", fmin, fmax);
+
+  ndos = 201;
+  printf("Please input the number of intervals [%d]: ", ndos);
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0) ndos = atoi(strtok(str," \t\n\r\f"));
+  ndos += (ndos+1)%2; ndos = MAX(2,ndos);
+
+  Timer *time = new Timer();
+  printf("\nNow to compute the DOSs by tetrahedra ..."); fflush(stdout);
+  TetraDOS();
+  printf("Done! ");
+  time->stop(); time->print(); delete time;
+
+  // normalize and write the DOSes
+  Normalize();
+  writeDOS();
+  writeLDOS();
+
+  // evaluate the local and total vibrational thermal properties optionally
+  if (nlocal > 0) local_therm();
+  tetra_therm();
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to calculate the phonon DOS and the vibrational thermal
+ * properties at a list of temperatures in one pass over the q-points, each
+ * being reduced as soon as it is solved, so that no frequencies of the whole
+ * q-mesh are kept and very dense meshes can be done; the frequency range and
+ * the temperatures are therefore asked first.
+ * ---------------------------------------------------------------------------- */
+void Phonon::pstream()
+{
+  // get the q-points
+  QMesh();
+
+  char str[MAXLINE];
+  fmin = 0.; fmax = 10.;
+  printf("\nPlease input the desired range to get DOS [%g %g]: ", fmin, fmax);
+  if (count_words(fgets(str,MAXLINE,stdin)) >= 2){
+    fmin = atof(strtok(str," \t\n\r\f"));
+    fmax = atof(strtok(NULL," \t\n\r\f"));
+  }
+  if (fmin > fmax){double swap = fmin; fmin = fmax; fmax = swap;}
+  printf("The fequency range for your phonon DOS is [%g %g].\n", fmin, fmax);
+
+  ndos = 201;
+  printf("Please input the number of intervals [%d]: ", ndos);
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0) ndos = atoi(strtok(str," \t\n\r\f"));
+  ndos += (ndos+1)%2; ndos = MAX(2,ndos);
+
+  AskTemps();
+
+  Timer *time = new Timer();
+  printf("\nNow to compute the phonons, the DOS and the thermal sums "); fflush(stdout);
+  double stats[7];
+  StreamLoop(stats);
+  printf("Done! ");
+  time->stop(); time->print(); delete time;
+
+  // moments of the frequencies
+  if (stats[0] > 0.){
+    double mean = stats[1]/stats[0], rms = sqrt(stats[2]/stats[0]);
+    printf("\nThe frequencies are in [%g %g] %s, with mean %g and rms %g; %g%% of the modes\n",
+      stats[3], stats[4], dynmat->funit, mean, rms, 100.*(stats[5]+stats[6])/stats[0]);
+    printf("are out of the DOS range, %g%% below and %g%% above.\n", 100.*stats[5]/stats[0], 100.*stats[6]/stats[0]);
+  }
+
+  // the DOS
+  printf("Would you like to smooth the phonon dos? (y/n)[n]: ");
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0){
+    char *flag = strtok(str," \t\n\r\f");
+    if (strcmp(flag,"y") == 0 || strcmp(flag,"Y") == 0) smooth();
+  }
+  Normalize();
+  writeDOS();
+
+  // the thermal properties
+  writeTSums();
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to ask for the list of temperatures of the thermal sums.
+ * ---------------------------------------------------------------------------- */
+void Phonon::AskTemps()
+{
+  char str[MAXLINE], *ptr;
+  printf("Please input the temperatures (K) for the thermal properties [%g]: ", dynmat->Tmeasure);
+  int nmax = count_words(fgets(str,MAXLINE,stdin));
+  ntemp = 0;
+  memory->destroy(temps);
+  temps = memory->create(temps, MAX(1,nmax), "AskTemps:temps");
+  ptr = strtok(str," \t\n\r\f");
+  while (ptr != NULL && ntemp < nmax){
+    double T = atof(ptr);
+    if (T > 0.) temps[ntemp++] = T;
+    ptr = strtok(NULL," \t\n\r\f");
+  }
+  if (ntemp < 1) temps[ntemp++] = dynmat->Tmeasure;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to write the thermal properties from the thermal sums at
+ * each temperature, tsums[ntemp][5].
+ * ---------------------------------------------------------------------------- */
+void Phonon::writeTSums()
+{
+  char str[MAXLINE];
+  printf("\nPlease input the filename to output thermal properties [therm.dat]:");
+  if (count_words(fgets(str,MAXLINE,stdin)) < 1) strcpy(str, "therm.dat");
+  char *fname = strtok(str," \t\n\r\f");
+  FILE *fp = fopen(fname, "a"); fname = NULL;
+  fprintf(fp,"#Temp   Uvib    Svib     Fvib    ZPE      Cvib\n");
+  fprintf(fp,"# K      eV      Kb       eV      eV       Kb\n");
+
+  // constants          J/K                J
+  const double Kb = 1.380658e-23, eV = 1.60217733e-19;
+  for (int it=0; it<ntemp; it++){
+    double *sums = tsums[it], KbT_in_eV = Kb*temps[it]/eV;
+    fprintf(fp,"%lg %lg %lg %lg %lg %lg\n", temps[it], sums[0]*KbT_in_eV, sums[1],
+      sums[2]*KbT_in_eV, sums[4]/(eV*1.e-12), sums[3]);
+  }
+  fclose(fp);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the phonon DOS and the thermal properties converged
+ * by nested refinement of the q-mesh. Starting from the mesh of the DMs read,
+ * each cell, represented by its lower corner, is split into 2^dim cells of
+ * half the size, whose corners but the first are the new q-points to solve,
+ * so that every point solved before is reused. The DOS and the thermal sums
+ * are updated by taking out the weight of each cell split and adding those
+ * of its children, until the DOS and Fvib, Cvib at the given temperatures
+ * change by less than the tolerances from one level to the next. Optionally,
+ * only the cells whose frequencies change by more than a given amount once
+ * split are split further, the others being kept as they are.
+ * ---------------------------------------------------------------------------- */
+void Phonon::prefine()
+{
+  char str[MAXLINE];
+  int m[3], ax[3], dim = 0;
+  m[0] = dynmat->nx; m[1] = dynmat->ny; m[2] = dynmat->nz;
+  for (int i=0; i<3; i++) if (m[i] > 1) ax[dim++] = i;
+  const int nsub = 1<<dim;
+
+  // the q-points are lists of cells from now on, not a whole mesh
+  memory->destroy(qmap);
+  memory->destroy(qperm);
+  memory->destroy(symrot);
+  memory->destroy(symsrc);
+  qmap = qperm = NULL;
+  symrot = NULL;
+  symsrc = NULL;
+  nsym = nlocal = 0;
+
+  // to solve a list of cells by their corners, on the mesh m
+  auto solve = [&](const std::vector<int> &c){
+    memory->destroy(wt);
+    memory->destroy(qpts);
+    nq = c.size()/3;
+    wt   = memory->create(wt,   MAX(1,nq),    "prefine:wt");
+    qpts = memory->create(qpts, MAX(1,nq), 3, "prefine:qpts");
+    for (int iq=0; iq<nq; iq++){
+      for (int i=0; i<3; i++) qpts[iq][i] = double(c[iq*3+i])/double(m[i]);
+      wt[iq] = 1./double(nq);
+    }
+    qmesh[0] = m[0]; qmesh[1] = m[1]; qmesh[2] = m[2]; qmesh[3] = 0;
+    TetraLoop();
+  };
+
+  // the first level: the mesh of the DMs read
+  std::vector<int> cell;
+  for (int i=0; i<m[0]; i++)
+  for (int j=0; j<m[1]; j++)
+  for (int k=0; k<m[2]; k++){
+    cell.push_back(i); cell.push_back(j); cell.push_back(k);
+  }
+  solve(cell);
+  int ncell = nq;
+  bigint nsolved = nq, nfull = nq;
+  std::vector<double> fc(eigs[0], eigs[0] + bigint(ncell)*ndim);
+  fmin = fmax = fc[0];
+  for (size_t i=0; i<fc.size(); i++){fmin = MIN(fmin, fc[i]); fmax = MAX(fmax, fc[i]);}
+
+  printf("\nThe frequency range of all q-points are: [%g %g]\n", fmin, fmax);
+  printf("Please input the desired range to get DOS [%g %g]: ", fmin, fmax);
+  if (count_words(fgets(str,MAXLINE,stdin)) >= 2){
+    fmin = atof(strtok(str," \t\n\r\f"));
+    fmax = atof(strtok(NULL," \t\n\r\f"));
+  }
+  if (fmin > fmax){double swap = fmin; fmin = fmax; fmax = swap;}
+  printf("The fequency range for your phonon DOS is [%g %g].\n", fmin, fmax);
+
+  ndos = 201;
+  printf("Please input the number of intervals [%d]: ", ndos);
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0) ndos = atoi(strtok(str," \t\n\r\f"));
+  ndos += (ndos+1)%2; ndos = MAX(2,ndos);
+  df  = (fmax-fmin)/double(ndos-1);
+  rdf = 1./df;
+
+  AskTemps();
+
+  double tol[3] = {0.02, 1.e-4, 1.e-3};
+  printf("Please input the tolerances on the change of the DOS (L1 norm), Fvib (eV)\n");
+  printf("and Cvib (kB) from one level to the next [%g %g %g]: ", tol[0], tol[1], tol[2]);
+  if (count_words(fgets(str,MAXLINE,stdin)) >= 3){
+    tol[0] = atof(strtok(str," \t\n\r\f"));
+    tol[1] = atof(strtok(NULL," \t\n\r\f"));
+    tol[2] = atof(strtok(NULL," \t\n\r\f"));
+  }
+
+  double thr = 0.;
+  printf("Please input the change of frequencies above which a cell is split further,\n");
+  printf("0 to split all [%g]: ", thr);
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0) thr = atof(strtok(str," \t\n\r\f"));
+
+  bigint maxq = bigint(nq)*nsub*nsub*nsub;
+  printf("Please input the maximum # of q-points to solve [%lld]: ", (long long)maxq);
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0) maxq = atol(strtok(str," \t\n\r\f"));
+
+  // the DOS and the thermal sums, to which a cell of weight w adds its modes
+  memory->destroy(dos);
+  memory->destroy(ldos);
+  memory->destroy(tsums);
+  ldos = NULL;
+  dos   = memory->create(dos, ndos, "prefine:dos");
+  tsums = memory->create(tsums, ntemp, 5, "prefine:tsums");
+  for (int i=0; i<ndos; i++) dos[i] = 0.;
+  for (int it=0; it<ntemp; it++)
+  for (int i=0; i<5; i++) tsums[it][i] = 0.;
+
+  // constants          J.s             J/K                J
+  const double h = 6.62606896e-34, Kb = 1.380658e-23, eV = 1.60217733e-19;
+  double *h_o_KbT = new double[ntemp];
+  for (int it=0; it<ntemp; it++) h_o_KbT[it] = h/(Kb*temps[it])*1.e12;
+  const double offset = fmin-0.5*df;
+
+  auto add = [&](const double *f, const double w){
+    for (int j=0; j<ndim; j++){
+      int idx = int((f[j]-offset)*rdf);
+      if (idx>=0 && idx<ndos) dos[idx] += w;
+      if (f[j] <= 0.) continue;
+
+      for (int it=0; it<ntemp; it++){
+        double x = f[j] * h_o_KbT[it];
+        double expterm = 1./(exp(x)-1.);
+        double *sums = tsums[it];
+        sums[0] += w*(0.5+expterm)*x;
+        sums[1] += w*(x*expterm - log(1.-exp(-x)));
+        sums[2] += w*log(2.*sinh(0.5*x));
+        sums[3] += w*x*x*exp(x)*expterm*expterm;
+        sums[4] += w*0.5*h*f[j];
+      }
+    }
+  };
+  double w = 1./double(ncell);
+  for (int ic=0; ic<ncell; ic++) add(&fc[bigint(ic)*ndim], w);
+
+  // the values of the previous level
+  std::vector<double> dos0(dos, dos+ndos), F0(ntemp), C0(ntemp);
+  for (int it=0; it<ntemp; it++){
+    F0[it] = tsums[it][2]*Kb*temps[it]/eV;
+    C0[it] = tsums[it][3];
+  }
+
+  printf("\nlevel  q-mesh           new q   all q    cells  DOS change  Fvib change  Cvib change\n");
+  printf("%5d  %4d x%4d x%4d  %7d  %7lld  %7d\n", 0, m[0], m[1], m[2], nq, (long long)nsolved, ncell);
+
+  int level = 0, conv = 0;
+  while (!conv && ncell > 0 && dim > 0){
+    bigint nnew = bigint(ncell)*(nsub-1);
+    if (nsolved + nnew > maxq){
+      printf("\nThe next level would need more than %lld q-points; stopped.\n", (long long)maxq);
+      break;
+    }
+    // the corners of the children are listed by int
+    if (bigint(ncell)*nsub > INT_MAX/3){
+      printf("\nThe next level would have %lld cells, too many to be listed; stopped.\n", (long long)(bigint(ncell)*nsub));
+      break;
+    }
+
+    // the corners of the children but the first, which is that of the cell
+    for (int i=0; i<dim; i++) m[ax[i]] *= 2;
+    std::vector<int> corner;
+    for (int ic=0; ic<ncell; ic++)
+    for (int o=1; o<nsub; o++){
+      int c[3];
+      for (int i=0; i<3; i++) c[i] = 2*cell[ic*3+i];
+      for (int b=0; b<dim; b++) c[ax[b]] += (o>>b)&1;
+      corner.push_back(c[0]); corner.push_back(c[1]); corner.push_back(c[2]);
+    }
+    solve(corner);
+    nsolved += nnew; nfull *= nsub; level++;
+
+    // each cell gives its weight to its children, which are kept for the
+    // next level unless their frequencies hardly differ from the cell's
+    const double wc = w/double(nsub);
+    std::vector<int> kept;
+    std::vector<double> fkept;
+    for (int ic=0; ic<ncell; ic++){
+      const double *f0 = &fc[bigint(ic)*ndim];
+      double err = 0.;
+      add(f0, wc-w);
+      for (int o=1; o<nsub; o++){
+        const double *f = eigs[ic*(nsub-1)+o-1];
+        for (int j=0; j<ndim; j++) err = MAX(err, fabs(f[j]-f0[j]));
+        add(f, wc);
+      }
+      if (thr > 0. && err <= thr) continue;
+
+      for (int o=0; o<nsub; o++){
+        const double *f = o == 0 ? f0 : eigs[ic*(nsub-1)+o-1];
+        int c[3];
+        for (int i=0; i<3; i++) c[i] = 2*cell[ic*3+i];
+        for (int b=0; b<dim; b++) c[ax[b]] += (o>>b)&1;
+        kept.push_back(c[0]); kept.push_back(c[1]); kept.push_back(c[2]);
+        fkept.insert(fkept.end(), f, f+ndim);
+      }
+    }
+    cell.swap(kept);
+    fc.swap(fkept);
+    ncell = cell.size()/3;
+    w = wc;
+
+    // the changes from the previous level
+    double dd = 0., dF = 0., dC = 0.;
+    for (int i=0; i<ndos; i++){
+      dd += fabs(dos[i]-dos0[i]);
+      dos0[i] = dos[i];
+    }
+    dd /= double(ndim);
+    for (int it=0; it<ntemp; it++){
+      double F = tsums[it][2]*Kb*temps[it]/eV, C = tsums[it][3];
+      dF = MAX(dF, fabs(F-F0[it]));
+      dC = MAX(dC, fabs(C-C0[it]));
+      F0[it] = F; C0[it] = C;
+    }
+    printf("%5d  %4d x%4d x%4d  %7lld  %7lld  %7d  %10.3e  %11.3e  %11.3e\n", level, m[0], m[1], m[2],
+      (long long)nnew, (long long)nsolved, ncell, dd, dF, dC);
+    conv = dd < tol[0] && dF < tol[1] && dC < tol[2];
+  }
+  delete []h_o_KbT;
+
+  printf("\n%s at level %d, on a %d x %d x %d q-mesh, by %lld q-points out of %lld.\n",
+    conv ? "Converged" : "Not converged", level, m[0], m[1], m[2], (long long)nsolved, (long long)nfull);
+
+  // the DOS and the thermal properties
+  printf("Would you like to smooth the phonon dos? (y/n)[n]: ");
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0){
+    char *flag = strtok(str," \t\n\r\f");
+    if (strcmp(flag,"y") == 0 || strcmp(flag,"Y") == 0) smooth();
+  }
+  Normalize();
+  writeDOS();
+  writeTSums();
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the DOS of any range and resolution, the integrated
+ * DOS N(f), or the share of the modes below given frequencies, again from the
+ * frequencies kept from the last q-mesh solved, e.g., by menu items 1 or 6:
+ * each takes a binary search per point over the sorted frequencies, and no
+ * q-point is solved again.
+ * ---------------------------------------------------------------------------- */
+void Phonon::prebin()
+{
+  // the frequencies are sorted the first time they are asked for
+  if (flag_store == 1) StoreFreqs();
+  if (flag_store != 2 || srange[2] <= 0.){
+    printf("\nNo frequencies are kept, please get the DOS or the thermal properties on a q-mesh first,\n");
+    printf("and come here before another q-mesh is generated.\n");
+    return;
+  }
+
+  char str[MAXLINE];
+  printf("\nThe frequencies of the last q-mesh are kept, within [%g %g].\n", srange[0], srange[1]);
+  fmin = srange[0]; fmax = srange[1];
+  ndos = 201;
+  while (1){
+    printf("\nPlease choose what to get from them:\n");
+    printf("  1. Phonon DOS of a frequency range and # of points;\n");
+    printf("  2. Integrated DOS N(f), the share of the modes below f;\n");
+    printf("  3. Share of the modes below a few frequencies;\n");
+    printf("  0. Back to the main menu.\n");
+    printf("Your choice [0]: ");
+    int kind = 0;
+    if (count_words(fgets(str,MAXLINE,stdin)) > 0) kind = atoi(strtok(str," \t\n\r\f"));
+    if (kind < 1 || kind > 3) break;
+
+    if (kind == 3){
+      printf("Please input the frequencies: ");
+      int n = count_words(fgets(str,MAXLINE,stdin));
+      if (n < 1) continue;
+      double *edges, *counts;
+      edges  = memory->create(edges,  n, "prebin:edges");
+      counts = memory->create(counts, n, "prebin:counts");
+      edges[0] = atof(strtok(str," \t\n\r\f"));
+      for (int i=1; i<n; i++) edges[i] = atof(strtok(NULL," \t\n\r\f"));
+      CountBelow(n, edges, counts);
+
+      printf("\n  frequency  share of modes below  # per cell\n");
+      for (int i=0; i<n; i++){
+        double frac = counts[i]/srange[2];
+        printf("  %9g  %20g  %10g\n", edges[i], frac, frac*double(ndim));
+      }
+      memory->destroy(edges);
+      memory->destroy(counts);
+      continue;
+    }
+
+    printf("Please input the frequency range [%g %g]: ", fmin, fmax);
+    if (count_words(fgets(str,MAXLINE,stdin)) >= 2){
+      fmin = atof(strtok(str," \t\n\r\f"));
+      fmax = atof(strtok(NULL," \t\n\r\f"));
+    }
+    if (fmin > fmax){double swap = fmin; fmin = fmax; fmax = swap;}
+    printf("Please input the number of points [%d]: ", ndos);
+    if (count_words(fgets(str,MAXLINE,stdin)) > 0) ndos = atoi(strtok(str," \t\n\r\f"));
+    ndos += (ndos+1)%2; ndos = MAX(2,ndos);
+    if (fmax <= fmin) continue;
+    df  = (fmax-fmin)/double(ndos-1);
+    rdf = 1./df;
+
+    // the DOS takes the edges of the bins centered at the points, N(f) the points
+    int n = kind == 1 ? ndos+1 : ndos;
+    double off = kind == 1 ? fmin-0.5*df : fmin;
+    double *edges, *counts;
+    edges  = memory->create(edges,  n, "prebin:edges");
+    counts = memory->create(counts, n, "prebin:counts");
+    for (int i=0; i<n; i++) edges[i] = off + double(i)*df;
+    CountBelow(n, edges, counts);
+
+    if (kind == 1){
+      memory->destroy(dos);
+      memory->destroy(ldos);
+      ldos = NULL;
+      dos = memory->create(dos, ndos, "prebin:dos");
+      for (int i=0; i<ndos; i++) dos[i] = counts[i+1] - counts[i];
+
+      printf("Would you like to smooth the phonon dos? (y/n)[n]: ");
+      if (count_words(fgets(str,MAXLINE,stdin)) > 0){
+        char *flag = strtok(str," \t\n\r\f");
+        if (strcmp(flag,"y") == 0 || strcmp(flag,"Y") == 0) smooth();
+      }
+      Normalize();
+      writeDOS();
+
+    } else {
+      printf("\nPlease input the filename to write N(f) [idos.dat]: ");
+      if (count_words(fgets(str,MAXLINE,stdin)) < 1) strcpy(str, "idos.dat");
+      char *fname = strtok(str," \t\n\r\f");
+      printf("The integrated DOS will be written to file: %s\n", fname);
+
+      FILE *fp = fopen(fname, "w"); fname = NULL;
+      fprintf(fp,"# frequency  N(f): share of modes below  # per cell\n");
+      fprintf(fp,"#%s  number  number\n", dynmat->funit);
+      for (int i=0; i<n; i++){
+        double frac = counts[i]/srange[2];
+        fprintf(fp,"%lg %lg %lg\n", edges[i], frac, frac*double(ndim));
+      }
+      fclose(fp);
+    }
+    memory->destroy(edges);
+    memory->destroy(counts);
+  }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to generate the q-points from a uniform q-mesh
+ * ---------------------------------------------------------------------------- */
+void Phonon::QMesh()
+{
+  // ask for mesh info
+  char str[MAXLINE];
+  int nx = dynmat->nx, ny = dynmat->ny, nz = dynmat->nz;
+  printf("\nThe q-mesh size from the read dynamical matrix is: %d x %d x %d\n", nx, ny, nz);
+  printf("A denser mesh can be interpolated; with the Fourier method, the DMs on it are got by FFT.\n");
+  printf("Please input your desired q-mesh size [%d %d %d]: ", nx, ny, nz);
+  if (count_words(fgets(str,MAXLINE,stdin)) >= 3){
+    nx = atoi(strtok(str," \t\n\r\f"));
+    ny = atoi(strtok(NULL," \t\n\r\f"));
+    nz = atoi(strtok(NULL," \t\n\r\f"));
+  }
+  if (nx<1||ny<1||nz<1) return;
+  if (dynmat->nx == 1) nx = 1;
+  if (dynmat->ny == 1) ny = 1;
+  if (dynmat->nz == 1) nz = 1;
+
+#ifdef UseSPG
+  // ask method to generate q-points
+  int method = 2;
+  printf("Please select your method to generate the q-points:\n");
+  printf("  1. uniform;\n  2. Monkhost-Pack mesh;\nYour choice [2]: ");
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0) method = atoi(strtok(str," \t\n\r\f"));
+  method = 2-method%2;
+#endif
+ 
+  // the weights of the last ComputeAll are gone, so are its unsorted frequencies
+  if (flag_store == 1) flag_store = 0;
+  memory->destroy(wt);
+  memory->destroy(qpts);
+  memory->destroy(qmap);
+  memory->destroy(symrot);
+  memory->destroy(symsrc);
+  qmap = NULL;
+  symrot = NULL;
+  symsrc = NULL;
+  nsym = 0;
+
+#ifdef UseSPG
+  if (method == 1){
+#endif
+    nq = nx*ny*nz;
+    double w = 1./double(nq);
+    wt   = memory->create(wt,   nq, "QMesh:wt");
+    qpts = memory->create(qpts, nq, 3, "QMesh:qpts");
+
+    int iq = 0;
+    for (int i=0; i<nx; i++)
+    for (int j=0; j<ny; j++)
+    for (int k=0; k<nz; k++){
+      qpts[iq][0] = double(i)/double(nx);
+      qpts[iq][1] = double(j)/double(ny);
+      qpts[iq][2] = double(k)/double(nz);
+      wt[iq++] = w;
+    }
+    qmap = memory->create(qmap, nq, "QMesh:qmap");
+    for (int i=0; i<nq; i++) qmap[i] = i;
+    qmesh[3] = 0;
+#ifdef UseSPG
+  }
+  if ((method == 2) && (atpos == NULL)){
+    atpos = memory->create(atpos, dynmat->nucell,3,"QMesh:atpos");
+    attyp = memory->create(attyp, dynmat->nucell,  "QMesh:attyp");
+
+    for (int i=0; i<dynmat->nucell; i++)
+    for (int idim=0; idim<3; idim++) atpos[i][idim] = 0.;
+    for (int i=0; i<3; i++) latvec[i][i] = 1.;
+
+    int flag_lat_info_read = dynmat->flag_latinfo;
+
+    if ( flag_lat_info_read ){ // get unit cell info from binary file; done by dynmat
+      num_atom = dynmat->nucell;
+      // set default, in case system dimension under study is not 3.
+      for (int i=0; i<dynmat->nucell; i++)
+      for (int idim=0; idim<3; idim++) atpos[i][idim] = 0.;
+      for (int i=0; i<3; i++) latvec[i][i] = 1.;
+
+      // get atomic type info
+      for (int i=0; i<num_atom; i++) attyp[i] = dynmat->attyp[i];
+      // get unit cell vector info
       int ndim = 0;
       for (int idim=0; idim<3; idim++)
       for (int jdim=0; jdim<3; jdim++) latvec[jdim][idim] = dynmat->basevec[ndim++];
@@ -820,332 +1772,1767 @@ void Phonon::QMesh()
       for (int i=0; i<num_atom; i++)
       for (int idim=0; idim<sysdim; idim++) atpos[i][idim] = dynmat->basis[i][idim];
 
-      // display the unit cell info read
-      printf("\n");for (int ii=0; ii<60; ii++) printf("="); printf("\n");
-      printf("The basis vectors of the unit cell:\n");
-      for (int idim=0; idim<3; idim++) printf("  A%d = %lg %lg %lg\n", idim+1, latvec[0][idim], latvec[1][idim], latvec[2][idim]);
-      printf("Atom(s) in the unit cell:\n");
-      printf("  No.  type  sx  sy sz\n");
-      for (int i=0; i<num_atom; i++) printf("  %d %d %lg %lg %lg\n", i+1, attyp[i], atpos[i][0], atpos[i][1], atpos[i][2]);
-      printf("\nIs the above info correct? (y/n)[y]: ");
-      fgets(str,MAXLINE,stdin);
-      char *ptr = strtok(str," \t\n\r\f");
-      if ( (ptr) && ( (strcmp(ptr,"y") != 0) && (strcmp(ptr,"Y") != 0)) ) flag_lat_info_read = 0;
+      // display the unit cell info read
+      printf("\n");for (int ii=0; ii<60; ii++) printf("="); printf("\n");
+      printf("The basis vectors of the unit cell:\n");
+      for (int idim=0; idim<3; idim++) printf("  A%d = %lg %lg %lg\n", idim+1, latvec[0][idim], latvec[1][idim], latvec[2][idim]);
+      printf("Atom(s) in the unit cell:\n");
+      printf("  No.  type  sx  sy sz\n");
+      for (int i=0; i<num_atom; i++) printf("  %d %d %lg %lg %lg\n", i+1, attyp[i], atpos[i][0], atpos[i][1], atpos[i][2]);
+      printf("\nIs the above info correct? (y/n)[y]: ");
+      fgets(str,MAXLINE,stdin);
+      char *ptr = strtok(str," \t\n\r\f");
+      if ( (ptr) && ( (strcmp(ptr,"y") != 0) && (strcmp(ptr,"Y") != 0)) ) flag_lat_info_read = 0;
+    }
+
+    if (flag_lat_info_read == 0) { // get unit cell info from file or user input
+      int latsrc = 1;
+      printf("\nPlease select the way to provide the unit cell info:\n");
+      printf("  1. By file;\n  2. Read in.\nYour choice [1]: ");
+      if (count_words(fgets(str,MAXLINE,stdin)) > 0) latsrc = atoi(strtok(str," \t\n\r\f"));
+      latsrc = 2-latsrc%2;
+      /*----------------------------------------------------------------
+       * Ask for lattice info from the user; the format of the file is:
+       * A1_x A1_y A1_z
+       * A2_x A2_y A2_z
+       * A3_x A3_y A3_z
+       * natom
+       * Type_1 sx_1 sy_1 sz_1
+       * ...
+       * Type_n sx_n sy_n sz_n
+       *----------------------------------------------------------------*/
+      if (latsrc == 1){ // to read unit cell info from file; get file name first
+        do printf("Please input the file name containing the unit cell info: ");
+        while (count_words(fgets(str,MAXLINE,stdin)) < 1);
+        char *fname = strtok(str," \t\n\r\f");
+        FILE *fp = fopen(fname,"r"); fname = NULL;
+  
+        if (fp == NULL) latsrc = 2;
+        else {
+          for (int i=0; i<3; i++){ // read unit cell vector info; # of atoms per unit cell
+            if (count_words(fgets(str,MAXLINE,fp)) < 3){
+              latsrc = 2;
+              break;
+            }
+            latvec[0][i] = atof(strtok(str, " \t\n\r\f"));
+            latvec[1][i] = atof(strtok(NULL," \t\n\r\f"));
+            latvec[2][i] = atof(strtok(NULL," \t\n\r\f"));
+          }
+          if (count_words(fgets(str,MAXLINE,fp)) < 1) latsrc = 2;
+          else {
+            num_atom = atoi(strtok(str," \t\n\r\f"));
+            if (num_atom > dynmat->nucell){
+              printf("\nError: # of atoms read from file (%d) is bigger than that given by the dynamical matrix (%d)!\n", num_atom, dynmat->nucell);
+              return;
+            }
+      
+            for (int i=0; i<num_atom; i++){ // read atomic type and fractional positions
+              if (count_words(fgets(str,MAXLINE,fp)) < 4){
+                latsrc = 2;
+                break;
+
+              } else {
+                attyp[i] = atoi(strtok(str," \t\n\r\f"));
+
+                atpos[i][0] = atof(strtok(NULL," \t\n\r\f"));
+                atpos[i][1] = atof(strtok(NULL," \t\n\r\f"));
+                atpos[i][2] = atof(strtok(NULL," \t\n\r\f"));
+              }
+            }
+          }
+        }
+        fclose(fp);
+      }
+      if (latsrc == 2){
+        for (int i=0; i<3; i++){
+          do printf("Please input the vector A%d: ", i+1);
+          while (count_words(fgets(str,MAXLINE,stdin)) < 3);
+          latvec[0][i] = atof(strtok(str," \t\n\r\f"));
+          latvec[1][i] = atof(strtok(NULL," \t\n\r\f"));
+          latvec[2][i] = atof(strtok(NULL," \t\n\r\f"));
+        }
+  
+        do printf("please input the number of atoms per unit cell: ");
+        while (count_words(fgets(str,MAXLINE,stdin)) < 1);
+        num_atom = atoi(strtok(str," \t\n\r\f"));
+        if (num_atom > dynmat->nucell){
+          printf("\nError: # of atoms input (%d) is bigger than that given by the dynamical matrix (%d)!\n", num_atom, dynmat->nucell);
+          return;
+        }
+  
+        for (int i=0; i<num_atom; i++){
+          do printf("Please input the type, and fractional coordinate of atom No.%d: ", i+1);
+          while (count_words(fgets(str,MAXLINE,stdin)) < 4);
+          attyp[i] = atoi(strtok(str," \t\n\r\f"));
+  
+          atpos[i][0] = atof(strtok(NULL," \t\n\r\f"));
+          atpos[i][1] = atof(strtok(NULL," \t\n\r\f"));
+          atpos[i][2] = atof(strtok(NULL," \t\n\r\f"));
+        }
+      }
+    } // end of read from file or input
+  } // end of if (method == 2 && ...
+
+  if (method == 2){
+    int mesh[3], shift[3], is_time_reversal = 1;
+    mesh[0] = nx; mesh[1] = ny; mesh[2] = nz;
+    shift[0] = shift[1] = shift[2] = 0;
+    int num_grid = mesh[0]*mesh[1]*mesh[2];
+    int (*grid_point)[3] = new int[num_grid][3], *map = new int[num_grid];
+    double symprec = 1.e-4, pos[num_atom][3];
+
+    for (int i=0; i<num_atom; i++)
+    for (int j=0; j<3; j++) pos[i][j] = atpos[i][j];
+
+    //spg_show_symmetry(latvec, pos, attyp,  num_atom, symprec);
+
+    nq = spg_get_ir_reciprocal_mesh(grid_point, map, num_grid, mesh, shift,  // use this line and comment out the following one, if spglib v 0.7.1 is used
+    //nq = spg_get_ir_reciprocal_mesh(grid_point, map, mesh, shift,  // replace the previous line with this one, if spglib 1.0.3 is used
+                               is_time_reversal, latvec, pos, attyp, num_atom, symprec);
+
+    wt   = memory->create(wt,   nq, "QMesh:wt");
+    qpts = memory->create(qpts, nq,3,"QMesh:qpts");
+
+    int *iq2idx = new int[num_grid];
+    int numq = 0;
+    for (int i=0; i<num_grid; i++){
+      int iq = map[i];
+      if (iq == i) iq2idx[iq] = numq++;
+    }
+    for (int iq=0; iq<nq; iq++) wt[iq] = 0.;
+    numq = 0;
+    for (int i=0; i<num_grid; i++){
+      int iq = map[i];
+      if (iq == i){
+        qpts[numq][0] = double(grid_point[i][0])/double(mesh[0]);
+        qpts[numq][1] = double(grid_point[i][1])/double(mesh[1]);
+        qpts[numq][2] = double(grid_point[i][2])/double(mesh[2]);
+        numq++;
+      }
+      wt[iq2idx[iq]] += 1.;
+    }
+    // the grid points may be given in (-n/2, n/2]
+    qmap = memory->create(qmap, num_grid, "QMesh:qmap");
+    for (int i=0; i<num_grid; i++){
+      int g[3];
+      for (int j=0; j<3; j++) g[j] = (grid_point[i][j]%mesh[j] + mesh[j])%mesh[j];
+      qmap[(g[0]*mesh[1] + g[1])*mesh[2] + g[2]] = iq2idx[map[i]];
+    }
+    delete []iq2idx;
+    delete []grid_point;
+    delete []map;
+
+    double wsum = 0.;
+    for (int iq=0; iq<nq; iq++) wsum += wt[iq];
+    for (int iq=0; iq<nq; iq++) wt[iq] /= wsum;
+    qmesh[3] = 2; // spglib runs over the grid with x the fastest
+
+    // the operations of the stars, to get the local DOS right
+    Symmetry(pos, symprec);
+  }
+#endif
+  printf("Your new q-mesh size would be: %d x %d x %d => %d points\n", nx,ny,nz,nq);
+  qmesh[0] = nx; qmesh[1] = ny; qmesh[2] = nz;
+
+  // the order in which the q-points are evaluated
+  memory->destroy(qperm);
+  if (dynmat->qorder > 0) SortQ();
+
+return;
+}
+
+#ifdef UseSPG
+/* ----------------------------------------------------------------------------
+ * Private method to get the symmetry operations by spglib, for the irreducible
+ * q-points of QMesh: each stands for its star, over which the projections of
+ * the eigenvectors on the atoms and directions vary. As operation S={R|t}
+ * takes atom a onto b, the eigenvector of S q on b is R e_a(q), so the sum
+ * over the star is the mean over all operations of |R e_a|^2 on b. Kept are
+ * the Cartesian rotations, and the atom a taken onto each b, symsrc[S][b];
+ * nsym = 0 if the structure is not all the atoms of the DM, or not 3D.
+ * ---------------------------------------------------------------------------- */
+void Phonon::Symmetry(double pos[][3], const double symprec)
+{
+  int nucell = dynmat->nucell;
+  if (num_atom != nucell || sysdim != 3) return;
+
+  int nmax = 48*num_atom;
+  int (*rot)[3][3] = new int[nmax][3][3];
+  double (*trans)[3] = new double[nmax][3];
+  int nop = spg_get_symmetry(rot, trans, nmax, latvec, pos, attyp, num_atom, symprec);
+
+  // the inverse of the lattice, whose columns are the lattice vectors
+  double inv[3][3], det = 0.;
+  for (int i=0; i<3; i++) det += latvec[0][i]*(latvec[1][(i+1)%3]*latvec[2][(i+2)%3] - latvec[1][(i+2)%3]*latvec[2][(i+1)%3]);
+  for (int i=0; i<3; i++)
+  for (int j=0; j<3; j++)
+    inv[j][i] = (latvec[(i+1)%3][(j+1)%3]*latvec[(i+2)%3][(j+2)%3] - latvec[(i+1)%3][(j+2)%3]*latvec[(i+2)%3][(j+1)%3])/det;
+
+  symrot = memory->create(symrot, MAX(1,nop), 9, "Symmetry:symrot");
+  symsrc = memory->create(symsrc, MAX(1,nop), nucell, "Symmetry:symsrc");
+  nsym = nop;
+  for (int is=0; is<nop; is++){
+    // R in Cartesian = L R L^-1
+    double lr[3][3];
+    for (int i=0; i<3; i++)
+    for (int j=0; j<3; j++){
+      lr[i][j] = 0.;
+      for (int k=0; k<3; k++) lr[i][j] += latvec[i][k]*double(rot[is][k][j]);
+    }
+    for (int i=0; i<3; i++)
+    for (int j=0; j<3; j++){
+      double r = 0.;
+      for (int k=0; k<3; k++) r += lr[i][k]*inv[k][j];
+      symrot[is][i*3+j] = r;
+    }
+
+    // the image of each atom, which must be an atom of the same type
+    for (int b=0; b<nucell; b++) symsrc[is][b] = -1;
+    for (int a=0; a<nucell; a++){
+      double x[3];
+      for (int i=0; i<3; i++) x[i] = trans[is][i] + rot[is][i][0]*pos[a][0] + rot[is][i][1]*pos[a][1] + rot[is][i][2]*pos[a][2];
+      for (int b=0; b<nucell; b++){
+        if (attyp[b] != attyp[a]) continue;
+        double dmax = 0.;
+        for (int i=0; i<3; i++){
+          double d = x[i] - pos[b][i];
+          dmax = MAX(dmax, fabs(d - floor(d+0.5)));
+        }
+        if (dmax < 1.e-3){ symsrc[is][b] = a; break;}
+      }
+    }
+    for (int b=0; b<nucell; b++) if (symsrc[is][b] < 0) nsym = 0;
+  }
+  delete []rot;
+  delete []trans;
+
+  if (nsym < 1){
+    memory->destroy(symrot);
+    memory->destroy(symsrc);
+    symrot = NULL;
+    symsrc = NULL;
+  }
+
+return;
+}
+#endif
+
+/* ----------------------------------------------------------------------------
+ * Private method to reorder the q-points of QMesh, with their weights, along
+ * a space-filling curve over the cells of the mesh read, so that successive
+ * q-points, and thus the batches of the pipeline and the chunks of the MPI
+ * ranks, share the DMs of nearby cells; the mesh index of each q-point is
+ * kept in qperm, so that outputs per q-point can be written in mesh order.
+ * The memory traffic of both orders is estimated and reported.
+ * ---------------------------------------------------------------------------- */
+void Phonon::SortQ()
+{
+  if (dynmat->interp_method() == 3){
+    printf("The q-points are kept in mesh order for the Fourier interpolation.\n");
+    return;
+  }
+  int n[3], bits = 0;
+  n[0] = dynmat->nx; n[1] = dynmat->ny; n[2] = dynmat->nz;
+  while ((1<<bits) < MAX(n[0], MAX(n[1], n[2]))) bits++;
+  bits = MAX(1, bits);
+
+  // the key of each q-point: its cell on the curve, then its mesh index
+  std::vector<std::pair<bigint, int> > key(nq);
+  for (int iq=0; iq<nq; iq++){
+    int c[3];
+    for (int i=0; i<3; i++){
+      double x = qpts[iq][i] - floor(qpts[iq][i]);
+      c[i] = int(x*double(n[i]))%n[i];
+    }
+    key[iq].first = dynmat->qorder == 2 ? hilbert(c, bits) : morton(c, bits);
+    key[iq].second = iq;
+  }
+  std::sort(key.begin(), key.end());
+
+  qperm = memory->create(qperm, MAX(1,nq), "SortQ:qperm");
+  for (int iq=0; iq<nq; iq++) qperm[iq] = key[iq].second;
+
+  double traffic0 = QTraffic();
+  double **q, *w;
+  q = memory->create(q, MAX(1,nq), 3, "SortQ:q");
+  w = memory->create(w, MAX(1,nq), "SortQ:w");
+  for (int iq=0; iq<nq; iq++){
+    for (int i=0; i<3; i++) q[iq][i] = qpts[qperm[iq]][i];
+    w[iq] = wt[qperm[iq]];
+  }
+  memory->destroy(qpts);
+  memory->destroy(wt);
+  qpts = q; wt = w;
+
+  int *inv = new int[MAX(1,nq)];
+  for (int iq=0; iq<nq; iq++) inv[qperm[iq]] = iq;
+  for (int i=0; i<qmesh[0]*qmesh[1]*qmesh[2]; i++) qmap[i] = inv[qmap[i]];
+  delete []inv;
+  double traffic1 = QTraffic();
+
+  printf("The q-points are evaluated along the %s curve; estimated traffic from the\n",
+    dynmat->qorder == 2 ? "Hilbert" : "Morton");
+  printf("mesh read: %.1f MB in mesh order, %.1f MB along the curve.\n", traffic0, traffic1);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to estimate the memory traffic, in MB, of the current order
+ * of the q-points: the DMs at the 8 vertices of the cell of each q-point are
+ * read through a cache of 16 MB, with the least recently used ones dropped.
+ * ---------------------------------------------------------------------------- */
+double Phonon::QTraffic()
+{
+  int n[3];
+  n[0] = dynmat->nx; n[1] = dynmat->ny; n[2] = dynmat->nz;
+  const double row = 16.*double(ndim)*double(ndim);
+  const int cap = MAX(8, int(16777216./row));
+
+  std::list<int> lru;
+  std::unordered_map<int, std::list<int>::iterator> pos;
+  bigint nmiss = 0;
+  for (int iq=0; iq<nq; iq++){
+    int c[3];
+    for (int i=0; i<3; i++){
+      double x = qpts[iq][i] - floor(qpts[iq][i]);
+      c[i] = int(x*double(n[i]))%n[i];
+    }
+    for (int v=0; v<8; v++){
+      int id = (((c[0]+(v&1))%n[0])*n[1] + (c[1]+((v>>1)&1))%n[1])*n[2] + (c[2]+((v>>2)&1))%n[2];
+      std::unordered_map<int, std::list<int>::iterator>::iterator it = pos.find(id);
+      if (it != pos.end()){
+        lru.splice(lru.begin(), lru, it->second);
+        continue;
+      }
+      nmiss++;
+      lru.push_front(id);
+      pos[id] = lru.begin();
+      if (int(lru.size()) > cap){
+        pos.erase(lru.back());
+        lru.pop_back();
+      }
+    }
+  }
+
+return double(nmiss)*row/1048576.;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the index of a cell c on the Morton (Z-order) curve,
+ * by interleaving the bits of its coordinates.
+ * ---------------------------------------------------------------------------- */
+bigint Phonon::morton(const int *c, const int bits)
+{
+  bigint key = 0;
+  for (int b=bits-1; b>=0; b--)
+  for (int i=0; i<3; i++) key = (key<<1) | ((c[i]>>b)&1);
+
+return key;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the index of a cell c on the Hilbert curve, by the
+ * algorithm of J. Skilling, AIP Conf. Proc. 707, 381 (2004): the coordinates
+ * are transformed in place, whose bits are then interleaved.
+ * ---------------------------------------------------------------------------- */
+bigint Phonon::hilbert(const int *c, const int bits)
+{
+  unsigned int x[3], m = 1u << (bits-1);
+  for (int i=0; i<3; i++) x[i] = c[i];
+
+  // inverse undo
+  for (unsigned int q=m; q>1; q >>= 1){
+    unsigned int p = q-1;
+    for (int i=0; i<3; i++){
+      if (x[i] & q) x[0] ^= p;
+      else {
+        unsigned int t = (x[0]^x[i]) & p;
+        x[0] ^= t; x[i] ^= t;
+      }
+    }
+  }
+  // gray encode
+  for (int i=1; i<3; i++) x[i] ^= x[i-1];
+  unsigned int t = 0;
+  for (unsigned int q=m; q>1; q >>= 1) if (x[2] & q) t ^= q-1;
+  for (int i=0; i<3; i++) x[i] ^= t;
+
+  bigint key = 0;
+  for (int b=bits-1; b>=0; b--)
+  for (int i=0; i<3; i++) key = (key<<1) | ((x[i]>>b)&1);
+
+return key;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to calculate the local phonon DOS and total phonon DOS based
+ * on the eigenvectors
+ * ---------------------------------------------------------------------------- */
+void Phonon::ldos_egv()
+{
+  // get local position info
+  char str[MAXLINE], *ptr;
+  printf("\nThe # of atoms per cell is: %d, please input the atom IDs to compute\n", dynmat->nucell);
+  printf("local PDOS, IDs begin with 0, or \"all\": ");
+  int nmax = count_words(fgets(str,MAXLINE,stdin));
+  if (nmax < 1) return;
+
+  ptr = strtok(str," \t\n\r\f");
+  flag_all = strcmp(ptr, "all") == 0;
+  if (flag_all) nmax = dynmat->nucell;
+
+  memory->destroy(locals);
+  locals = memory->create(locals, nmax, "ldos_egv:locals");
+
+  nlocal = 0;
+  if (flag_all) for (int i=0; i<nmax; i++) locals[nlocal++] = i;
+  while (!flag_all && ptr != NULL){
+    int id = atoi(ptr);
+    if (id >= 0 && id < dynmat->nucell) locals[nlocal++] = id;
+
+    ptr = strtok(NULL," \t\n\r\f");
+  }
+  if (nlocal < 1) return;
+
+  if (flag_all){
+    printf("Local PDOS for all %d atoms will be computed.\n", nlocal);
+  } else {
+    printf("Local PDOS for atom(s):");
+    for (int i=0; i<nlocal; i++) printf(" %d", locals[i]);
+    printf("  will be computed.\n");
+  }
+
+  fmin = 0.; fmax = 10.;
+  printf("Please input the freqency (nv, THz) range to compute PDOS [%g %g]: ", fmin, fmax);
+  if (count_words(fgets(str,MAXLINE,stdin)) >= 2) {
+    fmin = atof(strtok(str," \t\n\r\f"));
+    fmax = atof(strtok(NULL," \t\n\r\f"));
+  }
+  if (fmax < 0. || fmax < fmin) return;
+
+  ndos = 201;
+  printf("Please input your desired # of points in PDOS [%d]: ", ndos);
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0) ndos = atoi(strtok(str," \t\n\r\f"));
+  if (ndos < 2) return;
+  ndos += (ndos+1)%2;
+
+  df = (fmax-fmin)/double(ndos-1);
+  rdf = 1./df;
+
+  // get the q-points
+  QMesh();
+
+  Timer *time = new Timer();
+
+  printf("\nNow to compute the phonons and DOSs "); fflush(stdout);
+  LDOSLoop();
+  printf("Done!\n");
+
+  // smooth them if a kernel is set by -b
+  if (dynmat->bkind > 0 && dynmat->bkind < 4) smooth();
+
+  // normalize the measure DOS and LDOS
+  printf("Now to normalize the DOSs ..."); fflush(stdout);
+  Normalize();
+  printf("Done! ");
+  time->stop(); time->print(); delete time;
+
+  // to write the DOSes
+  writeDOS();
+  writeLDOS();
+
+  // evaluate the local vibrational thermal properties optionally
+  local_therm();
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to calculate the projected phonon DOS of groups of atoms: of
+ * each atom type, of lists of atoms read from a file, or of each layer along
+ * a lattice vector. The squared eigenvector components are summed over each
+ * group within the loop over q, so the cost of the bins goes with the # of
+ * groups instead of atoms.
+ * ---------------------------------------------------------------------------- */
+void Phonon::pgroups()
+{
+  AtomGroups();
+  if (nlocal < 1) return;
+
+  char str[MAXLINE];
+  fmin = 0.; fmax = 10.;
+  printf("Please input the freqency (nv, THz) range to compute PDOS [%g %g]: ", fmin, fmax);
+  if (count_words(fgets(str,MAXLINE,stdin)) >= 2) {
+    fmin = atof(strtok(str," \t\n\r\f"));
+    fmax = atof(strtok(NULL," \t\n\r\f"));
+  }
+  ndos = 201;
+  printf("Please input your desired # of points in PDOS [%d]: ", ndos);
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0) ndos = atoi(strtok(str," \t\n\r\f"));
+
+  if (fmax >= 0. && fmax >= fmin && ndos >= 2){
+    ndos += (ndos+1)%2;
+    df = (fmax-fmin)/double(ndos-1);
+    rdf = 1./df;
+
+    // get the q-points
+    QMesh();
+
+    Timer *time = new Timer();
+    printf("\nNow to compute the phonons and DOSs "); fflush(stdout);
+    flag_all = 0;
+    LDOSLoop();
+    printf("Done!\n");
+
+    if (dynmat->bkind > 0 && dynmat->bkind < 4) smooth();
+
+    printf("Now to normalize the DOSs ..."); fflush(stdout);
+    Normalize();
+    printf("Done! ");
+    time->stop(); time->print(); delete time;
+
+    writeDOS();
+    writeGDOS();
+
+    // the thermal properties per atom of each group, optionally
+    local_therm();
+  }
+
+  memory->destroy(gptr);
+  memory->destroy(gatom);
+  gptr = gatom = NULL;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to ask for the groups of atoms, as the local "atoms" of
+ * LDOSLoop: locals[i] = i, the atoms of group i being gatom[gptr[i]] to
+ * gatom[gptr[i+1]-1]. nlocal is the # of groups, 0 if none is got. The file
+ * of groups has one group per line, of atom IDs or ranges of them, like
+ * "0 2 10-19"; what follows # is ignored.
+ * ---------------------------------------------------------------------------- */
+void Phonon::AtomGroups()
+{
+  char str[MAXLINE];
+  int nucell = dynmat->nucell;
+  std::vector<std::vector<int> > groups;
+  std::vector<double> where;
+
+  nlocal = 0;
+  printf("\nThe # of atoms per cell is: %d, please choose how to group them:\n", nucell);
+  printf("  1. By atom type;\n");
+  printf("  2. By lists or ranges of atom IDs, one group per line of a file;\n");
+  printf("  3. By layers along a lattice vector;\n");
+  printf("Your choice [1]: ");
+  int kind = 1;
+  if (count_words(fgets(str,MAXLINE,stdin)) > 0) kind = atoi(strtok(str," \t\n\r\f"));
+  if (kind < 1 || kind > 3) return;
+  if (kind != 2 && dynmat->flag_latinfo == 0){
+    printf("\nThe atom types and positions are not available from the binary file.\n");
+    return;
+  }
+
+  if (kind == 1){
+    // one group per type, in ascending order
+    std::vector<int> types(dynmat->attyp, dynmat->attyp + nucell);
+    std::sort(types.begin(), types.end());
+    types.erase(std::unique(types.begin(), types.end()), types.end());
+    groups.resize(types.size());
+    for (int i=0; i<nucell; i++){
+      int ig = std::lower_bound(types.begin(), types.end(), dynmat->attyp[i]) - types.begin();
+      groups[ig].push_back(i);
+    }
+    for (size_t ig=0; ig<types.size(); ig++) where.push_back(double(types[ig]));
+
+  } else if (kind == 2){
+    printf("Please input the file name of the groups: ");
+    if (count_words(fgets(str,MAXLINE,stdin)) < 1) return;
+    char *fname = strtok(str," \t\n\r\f");
+    FILE *fp = fopen(fname, "r");
+    if (fp == NULL){
+      printf("\nError while opening file: %s\n", fname);
+      return;
+    }
+    char line[MAXLINE];
+    while (fgets(line,MAXLINE,fp)){
+      char *ptr = strchr(line,'#');
+      if (ptr) *ptr = '\0';
+      std::vector<int> ids;
+      ptr = strtok(line," \t\n\r\f");
+      while (ptr != NULL){
+        int lo = atoi(ptr), hi = lo;
+        char *sep = strchr(ptr+1,'-');
+        if (sep) hi = atoi(sep+1);
+        for (int id=MAX(0,lo); id<=MIN(hi,nucell-1); id++) ids.push_back(id);
+
+        ptr = strtok(NULL," \t\n\r\f");
+      }
+      if (ids.empty()) continue;
+      std::sort(ids.begin(), ids.end());
+      ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+      groups.push_back(ids);
+    }
+    fclose(fp);
+
+  } else {
+    int ax = sysdim;
+    printf("Please input the lattice vector (1-%d) the layers are stacked along [%d]: ", sysdim, ax);
+    if (count_words(fgets(str,MAXLINE,stdin)) > 0) ax = atoi(strtok(str," \t\n\r\f"));
+    if (ax < 1 || ax > sysdim) return;
+    ax--;
+
+    // the spacing of the lattice planes normal to the other two vectors
+    const double *a = dynmat->basevec, *b = &a[((ax+1)%3)*3], *c = &a[((ax+2)%3)*3];
+    double n[3] = {b[1]*c[2]-b[2]*c[1], b[2]*c[0]-b[0]*c[2], b[0]*c[1]-b[1]*c[0]};
+    double dist = fabs(a[ax*3]*n[0] + a[ax*3+1]*n[1] + a[ax*3+2]*n[2])/sqrt(n[0]*n[0]+n[1]*n[1]+n[2]*n[2]);
+
+    double tol = 0.1;
+    printf("Please input the largest distance between atoms of the same layer [%g]: ", tol);
+    if (count_words(fgets(str,MAXLINE,stdin)) > 0) tol = atof(strtok(str," \t\n\r\f"));
+
+    // sort the atoms by their fractional coordinates along the vector, and
+    // start a new layer at each gap wider than tol
+    std::vector<std::pair<double,int> > xs;
+    for (int i=0; i<nucell; i++){
+      double x = dynmat->basis[i][ax];
+      xs.push_back(std::make_pair(x - floor(x), i));
+    }
+    std::sort(xs.begin(), xs.end());
+    for (int i=0; i<nucell; i++){
+      if (i == 0 || (xs[i].first - xs[i-1].first)*dist > tol){
+        groups.push_back(std::vector<int>());
+        where.push_back(xs[i].first);
+      }
+      groups.back().push_back(xs[i].second);
+    }
+    // the last layer may continue across the cell boundary onto the first
+    if (groups.size() > 1 && (xs[0].first + 1. - xs[nucell-1].first)*dist <= tol){
+      groups[0].insert(groups[0].begin(), groups.back().begin(), groups.back().end());
+      where[0] = where.back() - 1.;
+      groups.pop_back(); where.pop_back();
+    }
+    for (size_t ig=0; ig<groups.size(); ig++) std::sort(groups[ig].begin(), groups[ig].end());
+  }
+  if (groups.empty()) return;
+
+  // flatten the groups
+  int ng = groups.size(), nm = 0;
+  for (int ig=0; ig<ng; ig++) nm += groups[ig].size();
+  memory->destroy(gptr);
+  memory->destroy(gatom);
+  memory->destroy(locals);
+  gptr   = memory->create(gptr,   ng+1, "AtomGroups:gptr");
+  gatom  = memory->create(gatom,  nm,   "AtomGroups:gatom");
+  locals = memory->create(locals, ng,   "AtomGroups:locals");
+  gptr[0] = 0;
+  for (int ig=0; ig<ng; ig++){
+    locals[ig] = ig;
+    gptr[ig+1] = gptr[ig] + groups[ig].size();
+    for (size_t m=0; m<groups[ig].size(); m++) gatom[gptr[ig]+m] = groups[ig][m];
+  }
+  nlocal = ng;
+
+  printf("\nThe projected PDOS of %d group(s) will be computed:\n", ng);
+  for (int ig=0; ig<ng; ig++){
+    printf("  group %d: %d atom(s)", ig, gptr[ig+1]-gptr[ig]);
+    if (kind == 1) printf(" of type %d", int(where[ig]));
+    if (kind == 3) printf(" at %g along the lattice vector", where[ig]);
+    printf("\n");
+  }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to write the projected DOS of the groups of atoms to a file;
+ * each is normalized to 1 per direction, i.e., it is the mean over the atoms
+ * of the group.
+ * ---------------------------------------------------------------------------- */
+void Phonon::writeGDOS()
+{
+  if (ldos == NULL || gptr == NULL) return;
+
+  char str[MAXLINE];
+  printf("\nPlease input the filename to write the PDOS of the groups [gpdos.dat]: ");
+  if (count_words(fgets(str,MAXLINE,stdin)) < 1) strcpy(str, "gpdos.dat");
+  char *fname = strtok(str," \t\n\r\f");
+
+  printf("The projected DOS of the groups will be written to file: %s\n\n", fname);
+  FILE *fp = fopen(fname, "w"); fname = NULL;
+  for (int ig=0; ig<nlocal; ig++){
+    fprintf(fp,"# group %d of %d atom(s):", ig, gptr[ig+1]-gptr[ig]);
+    for (int m=gptr[ig]; m<gptr[ig+1]; m++) fprintf(fp," %d", gatom[m]);
+    fprintf(fp,"\n");
+  }
+  fprintf(fp,"# freq, then for each group: xDOS yDOS zDOS total\n");
+  const double one3 = 1./double(sysdim);
+  double freq = fmin;
+  for (int i=0; i<ndos; i++){
+    fprintf(fp,"%lg", freq);
+    for (int ig=0; ig<nlocal; ig++){
+      double total = 0.;
+      for (int idim=0; idim<sysdim; idim++) {fprintf(fp," %lg",ldos[ig][i][idim]); total += ldos[ig][i][idim];}
+      fprintf(fp," %lg", total*one3);
+    }
+    fprintf(fp,"\n");
+    freq += df;
+  }
+  fclose(fp);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to accumulate the total and local DOSs over the local q-points
+ * ---------------------------------------------------------------------------- */
+void Phonon::LDOSLoop()
+{
+  iqlo = 0; iqhi = nq;
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobLDOSLoop);
+  int ibuf[4];
+  double dbuf[2];
+  ibuf[0] = nlocal; ibuf[1] = ndos; ibuf[2] = flag_all; ibuf[3] = gptr ? gptr[nlocal] : -1;
+  dbuf[0] = fmin;   dbuf[1] = fmax;
+  MPI_Bcast(ibuf, 4, MPI_INT,    0, MPI_COMM_WORLD);
+  MPI_Bcast(dbuf, 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  nlocal = ibuf[0]; ndos = ibuf[1]; flag_all = ibuf[2];
+  fmin   = dbuf[0]; fmax = dbuf[1];
+  df  = (fmax-fmin)/double(ndos-1);
+  rdf = 1./df;
+  if (me != 0){
+    memory->destroy(locals);
+    locals = memory->create(locals, nlocal, "LDOSLoop:locals");
+    memory->destroy(gptr);
+    memory->destroy(gatom);
+    gptr = gatom = NULL;
+    if (ibuf[3] >= 0){
+      gptr  = memory->create(gptr,  nlocal+1,          "LDOSLoop:gptr");
+      gatom = memory->create(gatom, MAX(1,ibuf[3]),    "LDOSLoop:gatom");
     }
+  }
+  MPI_Bcast(locals, nlocal, MPI_INT, 0, MPI_COMM_WORLD);
+  if (ibuf[3] >= 0){
+    MPI_Bcast(gptr,  nlocal+1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(gatom, ibuf[3],  MPI_INT, 0, MPI_COMM_WORLD);
+  }
 
-    if (flag_lat_info_read == 0) { // get unit cell info from file or user input
-      int latsrc = 1;
-      printf("\nPlease select the way to provide the unit cell info:\n");
-      printf("  1. By file;\n  2. Read in.\nYour choice [1]: ");
-      if (count_words(fgets(str,MAXLINE,stdin)) > 0) latsrc = atoi(strtok(str," \t\n\r\f"));
-      latsrc = 2-latsrc%2;
-      /*----------------------------------------------------------------
-       * Ask for lattice info from the user; the format of the file is:
-       * A1_x A1_y A1_z
-       * A2_x A2_y A2_z
-       * A3_x A3_y A3_z
-       * natom
-       * Type_1 sx_1 sy_1 sz_1
-       * ...
-       * Type_n sx_n sy_n sz_n
-       *----------------------------------------------------------------*/
-      if (latsrc == 1){ // to read unit cell info from file; get file name first
-        do printf("Please input the file name containing the unit cell info: ");
-        while (count_words(fgets(str,MAXLINE,stdin)) < 1);
-        char *fname = strtok(str," \t\n\r\f");
-        FILE *fp = fopen(fname,"r"); fname = NULL;
-  
-        if (fp == NULL) latsrc = 2;
-        else {
-          for (int i=0; i<3; i++){ // read unit cell vector info; # of atoms per unit cell
-            if (count_words(fgets(str,MAXLINE,fp)) < 3){
-              latsrc = 2;
-              break;
-            }
-            latvec[0][i] = atof(strtok(str, " \t\n\r\f"));
-            latvec[1][i] = atof(strtok(NULL," \t\n\r\f"));
-            latvec[2][i] = atof(strtok(NULL," \t\n\r\f"));
-          }
-          if (count_words(fgets(str,MAXLINE,fp)) < 1) latsrc = 2;
-          else {
-            num_atom = atoi(strtok(str," \t\n\r\f"));
-            if (num_atom > dynmat->nucell){
-              printf("\nError: # of atoms read from file (%d) is bigger than that given by the dynamical matrix (%d)!\n", num_atom, dynmat->nucell);
-              return;
-            }
-      
-            for (int i=0; i<num_atom; i++){ // read atomic type and fractional positions
-              if (count_words(fgets(str,MAXLINE,fp)) < 4){
-                latsrc = 2;
-                break;
+  mpi_share_qmesh();
+#endif
 
-              } else {
-                attyp[i] = atoi(strtok(str," \t\n\r\f"));
+  // allocate memory for DOS and LDOS
+  memory->destroy(dos);
+  memory->destroy(ldos);
 
-                atpos[i][0] = atof(strtok(NULL," \t\n\r\f"));
-                atpos[i][1] = atof(strtok(NULL," \t\n\r\f"));
-                atpos[i][2] = atof(strtok(NULL," \t\n\r\f"));
-              }
-            }
+  dos  = memory->create(dos, ndos,"ldos_egv:dos");
+  ldos = memory->create(ldos,nlocal,ndos,sysdim,"ldos_egv:ldos");
+
+  for (int i=0; i<ndos; i++) dos[i] = 0.;
+
+  for (int ilocal=0; ilocal<nlocal; ilocal++)
+  for (int i=0; i<ndos; i++)
+  for (int idim=0; idim<sysdim; idim++) ldos[ilocal][i][idim] = 0.;
+
+  int nprint;
+  if (iqhi-iqlo > 10) nprint = (iqhi-iqlo)/10;
+  else nprint = 1;
+
+  // with -b 4, each mode is spread by a Gaussian of width a times the change
+  // of its frequency across a cell of the q-mesh, df/dq_d = v.b_d/N_d, which
+  // is integrated over the bins within 5 widths; B[d] = b_d/N_d in the units
+  // of the velocities
+  int adapt = dynmat->bkind == 4;
+  double B[3][3];
+  if (adapt){
+    const double tpi = 8.*atan(1.);
+    double fac = strcmp(dynmat->funit, "THz") == 0 ? tpi : 1.;
+    for (int d=0; d<3; d++)
+    for (int k=0; k<3; k++) B[d][k] = (dynmat->flag_latinfo ? dynmat->ibasevec[d*3+k] : tpi*double(d == k))/(fac*double(qmesh[d]));
+  }
+
+  // with the irreducible q-points, the projections are averaged over the
+  // symmetry operations, sum_S |R_S e_a|^2 on atom b = S(a), by the squares
+  // of the rows of R_S and the products e_a e_a^H, [nucell][9]
+  int nucell = dynmat->nucell, star = nsym > 0 && qmesh[3] == 2 && nlocal > 0;
+  double **rr = NULL;
+  if (star){
+    if (me == 0) printf("(the local DOSs averaged over the stars of the q-points by %d operations) ", nsym);
+    rr = memory->create(rr, nsym, 27, "LDOSLoop:rr");
+    for (int is=0; is<nsym; is++)
+    for (int d=0; d<3; d++)
+    for (int k=0; k<3; k++)
+    for (int l=0; l<3; l++) rr[is][d*9+k*3+l] = symrot[is][d*3+k]*symrot[is][d*3+l]/double(nsym);
+  }
+
+  // the buffers of each thread; pw holds the squared eigenvector components
+  // on the local atoms, [ndim][nc], whose rows go to the bins of tld, [ndos][nc]
+  int nred = pipe->nreducers(), nc = nlocal*sysdim;
+  double **tdos, **tld, **sq, **pw, **rho, **gk, **ek;
+  tdos = memory->create(tdos, nred, ndos,            "LDOSLoop:tdos");
+  tld  = memory->create(tld,  nred, MAX(1,ndos*nc),  "LDOSLoop:tld");
+  sq   = memory->create(sq,   nred, ndim*ndim,       "LDOSLoop:sq");
+  pw   = memory->create(pw,   nred, MAX(1,ndim*nc),  "LDOSLoop:pw");
+  rho  = memory->create(rho,  nred, star ? nucell*9 : 1, "LDOSLoop:rho");
+  gk   = memory->create(gk,   nred, ndos,            "LDOSLoop:gk");
+  ek   = memory->create(ek,   nred, ndos+1,          "LDOSLoop:ek");
+  for (int t=0; t<nred; t++){
+    for (int i=0; i<ndos; i++) tdos[t][i] = 0.;
+    for (int i=0; i<ndos*nc; i++) tld[t][i] = 0.;
+  }
+
+  const double offset = fmin-0.5*df;
+  auto reduce = [&](QSlot *slot, const int id){
+    const doublecomplex *egvec = slot->DMq;
+    const double *egval = slot->egv, w = slot->wt;
+    double *q = sq[id], *p = pw[id], *g = gk[id], *e = ek[id], *ld = tld[id];
+
+    // the squared components of all atoms in one pass, or their means over
+    // the star of q
+    if (star){
+      double *r = rho[id];
+      for (int idim=0; idim<ndim; idim++){
+        const doublecomplex *v = &egvec[idim*ndim];
+        for (int a=0; a<nucell; a++)
+        for (int k=0; k<3; k++)
+        for (int l=0; l<3; l++) r[a*9+k*3+l] = v[a*3+k].r*v[a*3+l].r + v[a*3+k].i*v[a*3+l].i;
+
+        double *dst = &q[idim*ndim];
+        for (int k=0; k<ndim; k++) dst[k] = 0.;
+        for (int is=0; is<nsym; is++)
+        for (int b=0; b<nucell; b++){
+          const double *ra = &r[symsrc[is][b]*9], *c = rr[is];
+          for (int d=0; d<3; d++){
+            double sum = 0.;
+            for (int kl=0; kl<9; kl++) sum += c[d*9+kl]*ra[kl];
+            dst[b*3+d] += sum;
           }
         }
-        fclose(fp);
       }
-      if (latsrc == 2){
-        for (int i=0; i<3; i++){
-          do printf("Please input the vector A%d: ", i+1);
-          while (count_words(fgets(str,MAXLINE,stdin)) < 3);
-          latvec[0][i] = atof(strtok(str," \t\n\r\f"));
-          latvec[1][i] = atof(strtok(NULL," \t\n\r\f"));
-          latvec[2][i] = atof(strtok(NULL," \t\n\r\f"));
+    } else {
+      for (int k=0; k<ndim*ndim; k++) q[k] = egvec[k].r*egvec[k].r + egvec[k].i*egvec[k].i;
+    }
+
+    // then taken as they are if all atoms are local, or summed over the atoms
+    // of each group, or picked for the local atoms
+    if (flag_all){
+      p = q;
+    } else if (gptr){
+      for (int idim=0; idim<ndim; idim++)
+      for (int ilocal=0; ilocal<nlocal; ilocal++){
+        double *dst = &p[idim*nc + ilocal*sysdim];
+        for (int jdim=0; jdim<sysdim; jdim++) dst[jdim] = 0.;
+        for (int m=gptr[ilocal]; m<gptr[ilocal+1]; m++){
+          const double *src = &q[idim*ndim + gatom[m]*sysdim];
+          for (int jdim=0; jdim<sysdim; jdim++) dst[jdim] += src[jdim];
         }
-  
-        do printf("please input the number of atoms per unit cell: ");
-        while (count_words(fgets(str,MAXLINE,stdin)) < 1);
-        num_atom = atoi(strtok(str," \t\n\r\f"));
-        if (num_atom > dynmat->nucell){
-          printf("\nError: # of atoms input (%d) is bigger than that given by the dynamical matrix (%d)!\n", num_atom, dynmat->nucell);
-          return;
+      }
+    } else {
+      for (int idim=0; idim<ndim; idim++)
+      for (int ilocal=0; ilocal<nlocal; ilocal++){
+        const double *src = &q[idim*ndim + locals[ilocal]*sysdim];
+        double *dst = &p[idim*nc + ilocal*sysdim];
+        for (int jdim=0; jdim<sysdim; jdim++) dst[jdim] = src[jdim];
+      }
+    }
+
+    for (int idim=0; idim<ndim; idim++){
+      // the bins [i0, i1] the mode goes to, with weights g
+      double x = (egval[idim] - offset)*rdf;
+      int i0, i1;
+      if (!adapt){
+        i0 = i1 = int(x);
+        if (i0 < 0 || i0 >= ndos) continue;
+        g[i0] = 1.;
+
+      } else {
+        double s2 = 0.;
+        const double *v = &slot->vel[idim*3];
+        for (int d=0; d<3; d++){
+          double dfd = B[d][0]*v[0] + B[d][1]*v[1] + B[d][2]*v[2];
+          s2 += dfd*dfd;
         }
-  
-        for (int i=0; i<num_atom; i++){
-          do printf("Please input the type, and fractional coordinate of atom No.%d: ", i+1);
-          while (count_words(fgets(str,MAXLINE,stdin)) < 4);
-          attyp[i] = atoi(strtok(str," \t\n\r\f"));
-  
-          atpos[i][0] = atof(strtok(NULL," \t\n\r\f"));
-          atpos[i][1] = atof(strtok(NULL," \t\n\r\f"));
-          atpos[i][2] = atof(strtok(NULL," \t\n\r\f"));
+        double sigma = dynmat->bwidth[0]*sqrt(s2);
+        if (x < -5.*sigma*rdf - 1. || x > double(ndos) + 5.*sigma*rdf + 1.) continue;
+
+        int hit = int(floor(x)), nw = int(5.*sigma*rdf) + 1;
+        i0 = MAX(0, hit-nw); i1 = MIN(ndos-1, hit+nw);
+        if (sigma*rdf < 1.e-3){
+          // narrower than the bins, as a histogram
+          if (hit < 0 || hit >= ndos) continue;
+          i0 = i1 = hit; g[hit] = 1.;
+        } else {
+          double r = 1./(sqrt(2.)*sigma);
+          for (int k=i0; k<=i1+1; k++) e[k-i0] = erf((offset + double(k)*df - egval[idim])*r);
+          for (int k=i0; k<=i1; k++) g[k] = 0.5*(e[k+1-i0] - e[k-i0]);
         }
       }
-    } // end of read from file or input
-  } // end of if (method == 2 && ...
 
-  if (method == 2){
-    int mesh[3], shift[3], is_time_reversal = 1;
-    mesh[0] = nx; mesh[1] = ny; mesh[2] = nz;
-    shift[0] = shift[1] = shift[2] = 0;
-    int num_grid = mesh[0]*mesh[1]*mesh[2];
-    int grid_point[num_grid][3], map[num_grid];
-    double symprec = 1.e-4, pos[num_atom][3];
+      const double *src = &p[idim*nc];
+      for (int k=i0; k<=i1; k++){
+        double c = w*g[k], *dst = &ld[k*nc];
+        tdos[id][k] += c;
+        for (int m=0; m<nc; m++) dst[m] += c*src[m];
+      }
+    }
+  };
+
+  dynmat->set_qmesh(qmesh, qmesh[3]);
+  pipe->start(iqhi-iqlo, &qpts[iqlo], &wt[iqlo], adapt ? 2 : 1, reduce);
+  for (int iq=iqlo; iq<iqhi; iq++){
+    if (me == 0 && (iq+1)%nprint == 0) {printf("."); fflush(stdout);}
+
+    QSlot *slot = pipe->next();
+    wt[iq] = slot->wt;
+    pipe->release(slot);
+  }
+  pipe->stop();
+  dynmat->set_qmesh(NULL, 0);
+
+  // sum up the threads, back to [nlocal][ndos][sysdim]
+  for (int t=0; t<nred; t++){
+    for (int i=0; i<ndos; i++) dos[i] += tdos[t][i];
+    for (int ilocal=0; ilocal<nlocal; ilocal++)
+    for (int i=0; i<ndos; i++)
+    for (int idim=0; idim<sysdim; idim++) ldos[ilocal][i][idim] += tld[t][i*nc + ilocal*sysdim + idim];
+  }
+  memory->destroy(tdos);
+  memory->destroy(tld);
+  memory->destroy(sq);
+  memory->destroy(pw);
+  memory->destroy(rho);
+  memory->destroy(rr);
+  memory->destroy(gk);
+  memory->destroy(ek);
+
+#ifdef UseMPI
+  int nall = nlocal*ndos*sysdim;
+  if (me == 0){
+    MPI_Reduce(MPI_IN_PLACE, dos, ndos, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (nall > 0) MPI_Reduce(MPI_IN_PLACE, ldos[0][0], nall, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  } else {
+    MPI_Reduce(dos, NULL, ndos, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (nall > 0) MPI_Reduce(ldos[0][0], NULL, nall, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  }
+#endif
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to normalize the DOS and/or Local DOS.
+ * Simpson's rule is used for the integration.
+ * ---------------------------------------------------------------------------- */
+void Phonon::Normalize()
+{
+  double odd, even, sum;
+  if (dos){
+    odd = even = 0.;
+    for (int i=1; i<ndos-1; i +=2) odd  += dos[i];
+    for (int i=2; i<ndos-1; i +=2) even += dos[i];
+    sum = dos[0] + dos[ndos-1];
+    sum += 4.*odd + 2.*even;
+    sum = 3.*rdf/sum;
+    for (int i=0; i<ndos; i++) dos[i] *= sum;
+  }
+
+  if (ldos){
+    for (int ilocal=0; ilocal<nlocal; ilocal++)
+    for (int idim=0; idim<sysdim; idim++){
+      odd = even = 0.;
+      for (int i=1; i<ndos-1; i +=2) odd  += ldos[ilocal][i][idim];
+      for (int i=2; i<ndos-1; i +=2) even += ldos[ilocal][i][idim];
+      sum = ldos[ilocal][0][idim] + ldos[ilocal][ndos-1][idim];
+      sum += 4.*odd + 2.*even;
+      sum = 3.*rdf/sum;
+      for (int i=0; i<ndos; i++) ldos[ilocal][i][idim] *= sum;
+    }
+  }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to calculate vibrational frequencies for all q-points
+ * ---------------------------------------------------------------------------- */
+void Phonon::ComputeAll()
+{
+  iqlo = 0; iqhi = nq;
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobComputeAll);
+  mpi_share_qmesh();
+#endif
+
+  int nprint;
+  if (iqhi-iqlo > 10) nprint = (iqhi-iqlo)/10;
+  else nprint = 1;
+  Timer *time = new Timer();
+
+  if (me == 0){printf("\nNow to compute the phonons "); fflush(stdout);}
+  // now to calculate the frequencies at all (local) q-points
+  memory->destroy(eigs);
+  eigs = memory->create(eigs, MAX(1,iqhi-iqlo),ndim,"QMesh_eigs");
+  
+  // the q-points are on the mesh of QMesh, whose DMs can be got by FFT
+  dynmat->set_qmesh(qmesh, qmesh[3]);
+  pipe->start(iqhi-iqlo, &qpts[iqlo], &wt[iqlo], 0);
+  for (int iq=iqlo; iq<iqhi; iq++){
+    if (me == 0 && (iq+1)%nprint == 0) {printf("."); fflush(stdout);}
+
+    QSlot *slot = pipe->next();
+    wt[iq] = slot->wt;
+    if (wt[iq] > 0.) for (int j=0; j<ndim; j++) eigs[iq-iqlo][j] = slot->egv[j];
+    pipe->release(slot);
+  }
+  pipe->stop();
+  dynmat->set_qmesh(NULL, 0);
+
+  // they replace those kept before, and are sorted only if menu 17 asks for them
+  memory->destroy(sfreq);
+  memory->destroy(swsum);
+  sfreq = swsum = NULL;
+  nstore = 0;
+  flag_store = 1;
+#ifdef UseMPI
+  MPI_Barrier(MPI_COMM_WORLD);
+#endif
+  if (me == 0){
+    printf("Done!\n");
+    time->stop(); time->print();
+  }
+  delete time;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to keep the frequencies of the local q-points of the last
+ * ComputeAll sorted, with the prefix sums of their weights, so that the weight
+ * of the modes below any frequency is then got by a binary search, without
+ * solving the q-points again; the range and the total weight of all ranks go
+ * to srange. The modes are sorted by their index into eigs, from which the
+ * frequencies and the sums are then read in order.
+ * ---------------------------------------------------------------------------- */
+void Phonon::StoreFreqs()
+{
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobStoreFreqs);
+#endif
+  int nmode = 0, *idx;
+  idx = memory->create(idx, MAX(1,(iqhi-iqlo)*ndim), "StoreFreqs:idx");
+  for (int iq=iqlo; iq<iqhi; iq++){
+    if (wt[iq] <= 0.) continue;
+    for (int j=0; j<ndim; j++) idx[nmode++] = (iq-iqlo)*ndim+j;
+  }
+  const double *f = eigs[0];
+  std::sort(idx, idx+nmode, [f](const int a, const int b){ return f[a] < f[b]; });
+
+  nstore = nmode;
+  memory->destroy(sfreq);
+  memory->destroy(swsum);
+  sfreq = memory->create(sfreq, MAX(1,nstore), "StoreFreqs:sfreq");
+  swsum = memory->create(swsum, nstore+1, "StoreFreqs:swsum");
+  swsum[0] = 0.;
+  for (int i=0; i<nmode; i++){
+    sfreq[i] = f[idx[i]];
+    swsum[i+1] = swsum[i] + wt[iqlo + idx[i]/ndim];
+  }
+  memory->destroy(idx);
+  flag_store = 2;
+
+  srange[0] = nstore > 0 ? sfreq[0] : 1.e300;
+  srange[1] = nstore > 0 ? sfreq[nstore-1] : -1.e300;
+  srange[2] = swsum[nstore];
+#ifdef UseMPI
+  MPI_Allreduce(MPI_IN_PLACE, &srange[0], 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE, &srange[1], 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE, &srange[2], 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#endif
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the weight of the modes kept by StoreFreqs below each
+ * of n frequencies, edges[n], into counts[n]; summed up on rank 0.
+ * ---------------------------------------------------------------------------- */
+void Phonon::CountBelow(const int n, double *edges, double *counts)
+{
+  int ne = n;
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobCountBelow);
+  MPI_Bcast(&ne, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (me != 0){
+    edges  = memory->create(edges,  ne, "CountBelow:edges");
+    counts = memory->create(counts, ne, "CountBelow:counts");
+  }
+  MPI_Bcast(edges, ne, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+#endif
+
+  for (int i=0; i<ne; i++) counts[i] = swsum[std::lower_bound(sfreq, sfreq+nstore, edges[i]) - sfreq];
+
+#ifdef UseMPI
+  if (me == 0) MPI_Reduce(MPI_IN_PLACE, counts, ne, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  else {
+    MPI_Reduce(counts, NULL, ne, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    memory->destroy(edges);
+    memory->destroy(counts);
+  }
+#endif
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the frequency range of all q-points
+ * ---------------------------------------------------------------------------- */
+void Phonon::FreqRange()
+{
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobFreqRange);
+#endif
+  fmin = 1.e300; fmax = -1.e300;
+  for (int iq=iqlo; iq<iqhi; iq++){
+    for (int j=0; j<ndim; j++){
+      fmin = MIN(fmin, eigs[iq-iqlo][j]);
+      fmax = MAX(fmax, eigs[iq-iqlo][j]);
+    }
+  }
+#ifdef UseMPI
+  MPI_Allreduce(MPI_IN_PLACE, &fmin, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE, &fmax, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+#endif
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to bin the frequencies of the local q-points into the DOS
+ * histogram in [fmin, fmax] with ndos points; summed up on rank 0.
+ * ---------------------------------------------------------------------------- */
+void Phonon::Histogram()
+{
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobHistogram);
+  double dbuf[2];
+  dbuf[0] = fmin; dbuf[1] = fmax;
+  MPI_Bcast(dbuf,  2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&ndos, 1, MPI_INT,    0, MPI_COMM_WORLD);
+  fmin = dbuf[0]; fmax = dbuf[1];
+#endif
+
+  df  = (fmax-fmin)/double(ndos-1);
+  rdf = 1./df;
+  memory->destroy(dos);
+  memory->destroy(ldos);
+  ldos = NULL;
+  dos = memory->create(dos, ndos, "pdos:dos");
+  for (int i=0; i<ndos; i++) dos[i] = 0.;
+
+  double offset = fmin-0.5*df;
+  for (int iq=iqlo; iq<iqhi; iq++){
+    if (wt[iq] > 0.){
+      for (int j=0; j<ndim; j++){
+        int idx = int((eigs[iq-iqlo][j]-offset)*rdf);
+        if (idx>=0 && idx<ndos) dos[idx] += wt[iq];
+      }
+    }
+  }
+#ifdef UseMPI
+  if (me == 0) MPI_Reduce(MPI_IN_PLACE, dos, ndos, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  else MPI_Reduce(dos, NULL, ndos, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+#endif
+
+return;
+}
 
-    for (int i=0; i<num_atom; i++)
-    for (int j=0; j<3; j++) pos[i][j] = atpos[i][j];
+/* ----------------------------------------------------------------------------
+ * Private method to reduce the frequencies of the local q-points, one at a
+ * time, into the DOS histogram in [fmin, fmax] with ndos points, the thermal
+ * sums at the ntemp temperatures (as ThermSums, into tsums[ntemp][5]) and
+ * the moments of the frequencies: stats = {sum w, sum w f, sum w f^2, min f,
+ * max f, weight below fmin, weight above fmax}; all summed up on rank 0.
+ * ---------------------------------------------------------------------------- */
+void Phonon::StreamLoop(double *stats)
+{
+  iqlo = 0; iqhi = nq;
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobStreamLoop);
+  int ibuf[2];
+  double dbuf[2];
+  ibuf[0] = ndos; ibuf[1] = ntemp;
+  dbuf[0] = fmin; dbuf[1] = fmax;
+  MPI_Bcast(ibuf, 2, MPI_INT,    0, MPI_COMM_WORLD);
+  MPI_Bcast(dbuf, 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  ndos = ibuf[0]; ntemp = ibuf[1];
+  fmin = dbuf[0]; fmax = dbuf[1];
+  if (me != 0){
+    memory->destroy(temps);
+    temps = memory->create(temps, ntemp, "StreamLoop:temps");
+  }
+  MPI_Bcast(temps, ntemp, MPI_DOUBLE, 0, MPI_COMM_WORLD);
 
-    //spg_show_symmetry(latvec, pos, attyp,  num_atom, symprec);
+  mpi_share_qmesh();
+#endif
+  df  = (fmax-fmin)/double(ndos-1);
+  rdf = 1./df;
 
-    nq = spg_get_ir_reciprocal_mesh(grid_point, map, num_grid, mesh, shift,  // use this line and comment out the following one, if spglib v 0.7.1 is used
-    //nq = spg_get_ir_reciprocal_mesh(grid_point, map, mesh, shift,  // replace the previous line with this one, if spglib 1.0.3 is used
-                               is_time_reversal, latvec, pos, attyp, num_atom, symprec);
+  memory->destroy(dos);
+  memory->destroy(ldos);
+  memory->destroy(tsums);
+  ldos = NULL;
+  dos   = memory->create(dos, ndos, "StreamLoop:dos");
+  tsums = memory->create(tsums, ntemp, 5, "StreamLoop:tsums");
+  for (int i=0; i<ndos; i++) dos[i] = 0.;
+  for (int it=0; it<ntemp; it++)
+  for (int i=0; i<5; i++) tsums[it][i] = 0.;
+  stats[0] = stats[1] = stats[2] = stats[5] = stats[6] = 0.;
+  stats[3] = 1.e300; stats[4] = -1.e300;
 
-    wt   = memory->create(wt,   nq, "QMesh:wt");
-    qpts = memory->create(qpts, nq,3,"QMesh:qpts");
+  // constants          J.s             J/K
+  const double h = 6.62606896e-34, Kb = 1.380658e-23;
+  double *h_o_KbT = new double[ntemp];
+  for (int it=0; it<ntemp; it++) h_o_KbT[it] = h/(Kb*temps[it])*1.e12;
 
-    int *iq2idx = new int[num_grid];
-    int numq = 0;
-    for (int i=0; i<num_grid; i++){
-      int iq = map[i];
-      if (iq == i) iq2idx[iq] = numq++;
-    }
-    for (int iq=0; iq<nq; iq++) wt[iq] = 0.;
-    numq = 0;
-    for (int i=0; i<num_grid; i++){
-      int iq = map[i];
-      if (iq == i){
-        qpts[numq][0] = double(grid_point[i][0])/double(mesh[0]);
-        qpts[numq][1] = double(grid_point[i][1])/double(mesh[1]);
-        qpts[numq][2] = double(grid_point[i][2])/double(mesh[2]);
-        numq++;
+  int nprint;
+  if (iqhi-iqlo > 10) nprint = (iqhi-iqlo)/10;
+  else nprint = 1;
+
+  double offset = fmin-0.5*df;
+  dynmat->set_qmesh(qmesh, qmesh[3]);
+  pipe->start(iqhi-iqlo, &qpts[iqlo], &wt[iqlo], 0);
+  for (int iq=iqlo; iq<iqhi; iq++){
+    if (me == 0 && (iq+1)%nprint == 0) {printf("."); fflush(stdout);}
+
+    QSlot *slot = pipe->next();
+    wt[iq] = slot->wt;
+    if (wt[iq] > 0.)
+    for (int j=0; j<ndim; j++){
+      double f = slot->egv[j];
+      int idx = int((f-offset)*rdf);
+      if (idx>=0 && idx<ndos) dos[idx] += wt[iq];
+      else if (f < offset) stats[5] += wt[iq];
+      else stats[6] += wt[iq];
+
+      stats[0] += wt[iq];
+      stats[1] += wt[iq]*f;
+      stats[2] += wt[iq]*f*f;
+      stats[3] = MIN(stats[3], f);
+      stats[4] = MAX(stats[4], f);
+
+      if (f <= 0.) continue;
+      for (int it=0; it<ntemp; it++){
+        double x = f * h_o_KbT[it];
+        double expterm = 1./(exp(x)-1.);
+        double *sums = tsums[it];
+        sums[0] += wt[iq]*(0.5+expterm)*x;
+        sums[1] += wt[iq]*(x*expterm - log(1.-exp(-x)));
+        sums[2] += wt[iq]*log(2.*sinh(0.5*x));
+        sums[3] += wt[iq]*x*x*exp(x)*expterm*expterm;
+        sums[4] += wt[iq]*0.5*h*f;
       }
-      wt[iq2idx[iq]] += 1.;
     }
-    delete []iq2idx;
-
-    double wsum = 0.;
-    for (int iq=0; iq<nq; iq++) wsum += wt[iq];
-    for (int iq=0; iq<nq; iq++) wt[iq] /= wsum;
-    
+    pipe->release(slot);
+  }
+  pipe->stop();
+  dynmat->set_qmesh(NULL, 0);
+  delete []h_o_KbT;
+
+#ifdef UseMPI
+  double sbuf[5];
+  sbuf[0] = stats[0]; sbuf[1] = stats[1]; sbuf[2] = stats[2]; sbuf[3] = stats[5]; sbuf[4] = stats[6];
+  if (me == 0){
+    MPI_Reduce(MPI_IN_PLACE, dos, ndos, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(MPI_IN_PLACE, tsums[0], ntemp*5, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(MPI_IN_PLACE, sbuf, 5, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(MPI_IN_PLACE, &stats[3], 1, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+    MPI_Reduce(MPI_IN_PLACE, &stats[4], 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+  } else {
+    MPI_Reduce(dos, NULL, ndos, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(tsums[0], NULL, ntemp*5, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(sbuf, NULL, 5, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&stats[3], NULL, 1, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&stats[4], NULL, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
   }
+  stats[0] = sbuf[0]; stats[1] = sbuf[1]; stats[2] = sbuf[2]; stats[5] = sbuf[3]; stats[6] = sbuf[4];
 #endif
-  printf("Your new q-mesh size would be: %d x %d x %d => %d points\n", nx,ny,nz,nq);
 
 return;
 }
 
 /* ----------------------------------------------------------------------------
- * Private method to calculate the local phonon DOS and total phonon DOS based
- * on the eigenvectors
+ * Private method to evaluate the frequencies along a line in q-space, starting
+ * from qstr with increment qinc, n points in total. Each rank takes one chunk
+ * of the line; the frequencies are gathered in order into egvs[n][ndim] and the
+ * weights (zero for skipped q-points) into wii[n] on rank 0.
  * ---------------------------------------------------------------------------- */
-void Phonon::ldos_egv()
+void Phonon::DispLine(double *qstr, double *qinc, int n, double *egvs, double *wii)
 {
-  // get local position info
-  char str[MAXLINE], *ptr;
-  printf("\nThe # of atoms per cell is: %d, please input the atom IDs to compute\n", dynmat->nucell);
-  printf("local PDOS, IDs begin with 0: ");
-  int nmax = count_words(fgets(str,MAXLINE,stdin));
-  if (nmax < 1) return;
+  int ilo = 0, ihi = n;
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobDispLine);
+  double dbuf[6];
+  if (me == 0)
+  for (int i=0; i<3; i++){dbuf[i] = qstr[i]; dbuf[i+3] = qinc[i];}
+  MPI_Bcast(dbuf, 6, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&n,   1, MPI_INT,    0, MPI_COMM_WORLD);
+  qstr = &dbuf[0]; qinc = &dbuf[3];
+
+  if (me != 0){
+    egvs = memory->create(egvs, n*ndim, "DispLine:egvs");
+    wii  = memory->create(wii,  n,      "DispLine:wii");
+  }
+  ilo = int(bigint(n)*me/nprocs);
+  ihi = int(bigint(n)*(me+1)/nprocs);
+#endif
 
-  memory->destroy(locals);
-  locals = memory->create(locals, nmax, "ldos_egv:locals");
+  // q is accumulated the same way as it is written out
+  double q[3], **qline;
+  qline = memory->create(qline, MAX(1,ihi-ilo), 3, "DispLine:qline");
+  for (int i=0; i<3; i++) q[i] = qstr[i];
+  for (int ii=0; ii<ihi; ii++){
+    if (ii >= ilo) for (int i=0; i<3; i++) qline[ii-ilo][i] = q[i];
+    for (int i=0; i<3; i++) q[i] += qinc[i];
+  }
 
-  nlocal = 0;
-  ptr = strtok(str," \t\n\r\f");
-  while (ptr != NULL){
-    int id = atoi(ptr);
-    if (id >= 0 && id < dynmat->nucell) locals[nlocal++] = id;
+  pipe->start(ihi-ilo, qline, NULL, 0);
+  for (int ii=ilo; ii<ihi; ii++){
+    QSlot *slot = pipe->next();
+    wii[ii] = slot->wt;
+    if (wii[ii] > 0.) for (int j=0; j<ndim; j++) egvs[ii*ndim+j] = slot->egv[j];
+    pipe->release(slot);
+  }
+  pipe->stop();
+  memory->destroy(qline);
+
+#ifdef UseMPI
+  int *counts = new int[nprocs];
+  int *displs = new int[nprocs];
+  for (int ip=0; ip<nprocs; ip++){
+    displs[ip] = int(bigint(n)*ip/nprocs);
+    counts[ip] = int(bigint(n)*(ip+1)/nprocs) - displs[ip];
+  }
+  if (me == 0) MPI_Gatherv(MPI_IN_PLACE, 0, MPI_DOUBLE, wii, counts, displs, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  else MPI_Gatherv(&wii[ilo], ihi-ilo, MPI_DOUBLE, NULL, NULL, NULL, MPI_DOUBLE, 0, MPI_COMM_WORLD);
 
-    ptr = strtok(NULL," \t\n\r\f");
+  for (int ip=0; ip<nprocs; ip++){
+    counts[ip] *= ndim;
+    displs[ip] *= ndim;
   }
-  if (nlocal < 1) return;
+  if (me == 0) MPI_Gatherv(MPI_IN_PLACE, 0, MPI_DOUBLE, egvs, counts, displs, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  else MPI_Gatherv(&egvs[ilo*ndim], (ihi-ilo)*ndim, MPI_DOUBLE, NULL, NULL, NULL, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  delete []counts;
+  delete []displs;
+
+  if (me != 0){
+    memory->destroy(egvs);
+    memory->destroy(wii);
+  }
+#endif
 
-  printf("Local PDOS for atom(s):");
-  for (int i=0; i<nlocal; i++) printf(" %d", locals[i]);
-  printf("  will be computed.\n");
+return;
+}
 
-  fmin = 0.; fmax = 10.;
-  printf("Please input the freqency (nv, THz) range to compute PDOS [%g %g]: ", fmin, fmax);
-  if (count_words(fgets(str,MAXLINE,stdin)) >= 2) {
-    fmin = atof(strtok(str," \t\n\r\f"));
-    fmax = atof(strtok(NULL," \t\n\r\f"));
+/* ----------------------------------------------------------------------------
+ * Private method to evaluate the frequencies and group velocities of the local
+ * q-points; the records are written in mesh order to fp by rank 0, after which
+ * the mean speed of each branch, weighted by the q-points, is reported.
+ * ---------------------------------------------------------------------------- */
+void Phonon::VelocityLoop(FILE *fp)
+{
+  iqlo = 0; iqhi = nq;
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobVelocity);
+  mpi_share_qmesh();
+#endif
+
+  const int nrec = 4 + 4*ndim;
+  int nprint;
+  if (iqhi-iqlo > 10) nprint = (iqhi-iqlo)/10;
+  else nprint = 1;
+
+  double *rec, *sumv;
+  rec  = memory->create(rec, MAX(1,iqhi-iqlo)*nrec, "VelocityLoop:rec");
+  sumv = memory->create(sumv, ndim+1, "VelocityLoop:sumv");
+  for (int j=0; j<=ndim; j++) sumv[j] = 0.;
+
+  if (me == 0){
+    fwrite(&nq,   sizeof(int), 1, fp);
+    fwrite(&ndim, sizeof(int), 1, fp);
   }
-  if (fmax < 0. || fmax < fmin) return;
 
-  ndos = 201;
-  printf("Please input your desired # of points in PDOS [%d]: ", ndos);
-  if (count_words(fgets(str,MAXLINE,stdin)) > 0) ndos = atoi(strtok(str," \t\n\r\f"));
-  if (ndos < 2) return;
-  ndos += (ndos+1)%2;
+  dynmat->set_qmesh(qmesh, qmesh[3]);
+  pipe->start(iqhi-iqlo, &qpts[iqlo], &wt[iqlo], 2);
+  for (int iq=iqlo; iq<iqhi; iq++){
+    if (me == 0 && (iq+1)%nprint == 0) {printf("."); fflush(stdout);}
+
+    QSlot *slot = pipe->next();
+    double *r = &rec[(iq-iqlo)*nrec];
+    for (int i=0; i<3; i++) r[i] = qpts[iq][i];
+    r[3] = slot->wt;
+    for (int j=0; j<4*ndim; j++) r[4+j] = 0.;
+    if (slot->wt > 0.){
+      for (int j=0; j<ndim; j++){
+        r[4+j] = slot->egv[j];
+        double v2 = 0.;
+        for (int i=0; i<3; i++){
+          r[4+ndim+j*3+i] = slot->vel[j*3+i];
+          v2 += slot->vel[j*3+i]*slot->vel[j*3+i];
+        }
+        sumv[j] += slot->wt*sqrt(v2);
+      }
+      sumv[ndim] += slot->wt;
+    }
+    pipe->release(slot);
+  }
+  pipe->stop();
+  dynmat->set_qmesh(NULL, 0);
+  if (me == 0) WriteRecords(fp, rec, iqlo, iqhi-iqlo, nrec);
+
+#ifdef UseMPI
+  // the records of the other ranks follow, in order
+  if (me == 0){
+    for (int ip=1; ip<nprocs; ip++){
+      int nrem = int(bigint(nq)*(ip+1)/nprocs) - int(bigint(nq)*ip/nprocs);
+      double *buf;
+      buf = memory->create(buf, MAX(1,nrem)*nrec, "VelocityLoop:buf");
+      MPI_Recv(buf, nrem*nrec, MPI_DOUBLE, ip, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      WriteRecords(fp, buf, int(bigint(nq)*ip/nprocs), nrem, nrec);
+      memory->destroy(buf);
+    }
+    MPI_Reduce(MPI_IN_PLACE, sumv, ndim+1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  } else {
+    MPI_Send(rec, (iqhi-iqlo)*nrec, MPI_DOUBLE, 0, 0, MPI_COMM_WORLD);
+    MPI_Reduce(sumv, NULL, ndim+1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  }
+#endif
 
-  df = (fmax-fmin)/double(ndos-1);
-  rdf = 1./df;
+  if (me == 0 && sumv[ndim] > 0.){
+    printf("\nMean group velocity of each branch, in %s x length unit of the lattice:\n", dynmat->funit);
+    for (int j=0; j<ndim; j++){
+      printf(" %lg", sumv[j]/sumv[ndim]);
+      if ((j+1)%6 == 0) printf("\n");
+    }
+    printf("\n");
+  }
+  memory->destroy(rec);
+  memory->destroy(sumv);
 
-  // get the q-points
-  QMesh();
+return;
+}
 
-  // allocate memory for DOS and LDOS
-  memory->destroy(dos);
-  memory->destroy(ldos);
+/* ----------------------------------------------------------------------------
+ * Private method to write n records of nrec doubles, those of the q-points
+ * from iq on, to fp after the header of two ints; each goes to the place of
+ * its q-point in mesh order if the q-points have been reordered.
+ * ---------------------------------------------------------------------------- */
+void Phonon::WriteRecords(FILE *fp, const double *rec, const int iq, const int n, const int nrec)
+{
+  if (qperm == NULL){
+    fwrite(rec, sizeof(double), bigint(n)*nrec, fp);
+    return;
+  }
+  for (int i=0; i<n; i++){
+    fseek(fp, 2*sizeof(int) + sizeof(double)*bigint(qperm[iq+i])*nrec, SEEK_SET);
+    fwrite(&rec[bigint(i)*nrec], sizeof(double), nrec, fp);
+  }
 
-  dos  = memory->create(dos, ndos,"ldos_egv:dos");
-  ldos = memory->create(ldos,nlocal,ndos,sysdim,"ldos_egv:ldos");
+return;
+}
 
-  for (int i=0; i<ndos; i++) dos[i] = 0.;
+/* ----------------------------------------------------------------------------
+ * Private method to get the frequencies and projections of all q-points of QMesh
+ * ---------------------------------------------------------------------------- */
+void Phonon::TetraLoop()
+{
+  iqlo = 0; iqhi = nq;
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobTetraLoop);
+  MPI_Bcast(&nlocal, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (me != 0){
+    memory->destroy(locals);
+    locals = memory->create(locals, MAX(1,nlocal), "TetraLoop:locals");
+  }
+  MPI_Bcast(locals, nlocal, MPI_INT, 0, MPI_COMM_WORLD);
 
-  for (int ilocal=0; ilocal<nlocal; ilocal++)
-  for (int i=0; i<ndos; i++)
-  for (int idim=0; idim<sysdim; idim++) ldos[ilocal][i][idim] = 0.;
+  mpi_share_qmesh();
+#endif
+
+  int nproj = nlocal*sysdim;
+  if (flag_store == 1) flag_store = 0;
+  memory->destroy(eigs);
+  memory->destroy(projs);
+  projs = NULL;
+  eigs = memory->create(eigs, MAX(1,nq), ndim, "TetraLoop:eigs");
+  if (nproj > 0) projs = memory->create(projs, MAX(1,nq), ndim*nproj, "TetraLoop:projs");
 
   int nprint;
-  if (nq > 10) nprint = nq/10;
+  if (iqhi-iqlo > 10) nprint = (iqhi-iqlo)/10;
   else nprint = 1;
   Timer *time = new Timer();
+  if (me == 0){printf("\nNow to compute the phonons "); fflush(stdout);}
+
+  dynmat->set_qmesh(qmesh, qmesh[3]);
+  pipe->start(iqhi-iqlo, &qpts[iqlo], &wt[iqlo], nproj > 0);
+  for (int iq=iqlo; iq<iqhi; iq++){
+    if (me == 0 && (iq+1)%nprint == 0) {printf("."); fflush(stdout);}
+
+    // skipped q-points are taken as zero frequency, with no projection
+    QSlot *slot = pipe->next();
+    wt[iq] = slot->wt;
+    for (int j=0; j<ndim; j++) eigs[iq][j] = wt[iq] > 0. ? slot->egv[j] : 0.;
+    for (int j=0; j<ndim; j++)
+    for (int il=0; il<nlocal; il++)
+    for (int idim=0; idim<sysdim; idim++){
+      doublecomplex z = slot->DMq[j*ndim + locals[il]*sysdim + idim];
+      projs[iq][(j*nlocal+il)*sysdim+idim] = wt[iq] > 0. ? z.r*z.r + z.i*z.i : 0.;
+    }
+    pipe->release(slot);
+  }
+  pipe->stop();
+  dynmat->set_qmesh(NULL, 0);
+
+#ifdef UseMPI
+  int *cnt = new int[nprocs], *dsp = new int[nprocs];
+  for (int ip=0; ip<nprocs; ip++){
+    int lo = int(bigint(nq)*ip/nprocs), hi = int(bigint(nq)*(ip+1)/nprocs);
+    cnt[ip] = (hi-lo)*ndim; dsp[ip] = lo*ndim;
+  }
+  MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, eigs[0], cnt, dsp, MPI_DOUBLE, MPI_COMM_WORLD);
+  if (nproj > 0){
+    for (int ip=0; ip<nprocs; ip++){cnt[ip] *= nproj; dsp[ip] *= nproj;}
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, projs[0], cnt, dsp, MPI_DOUBLE, MPI_COMM_WORLD);
+  }
+  delete []cnt;
+  delete []dsp;
+  iqlo = 0; iqhi = nq;
+#endif
+  if (me == 0){
+    printf("Done!\n");
+    time->stop(); time->print();
+  }
+  delete time;
 
-  // memory and pointer for eigenvalues and eigenvectors
-  double egval[ndim], offset=fmin-0.5*df;
-  doublecomplex **egvec = dynmat->DM_q;
+return;
+}
 
-  printf("\nNow to compute the phonons and DOSs "); fflush(stdout);
-  for (int iq=0; iq<nq; iq++){
-    if ((iq+1)%nprint == 0) {printf("."); fflush(stdout);}
+/* ----------------------------------------------------------------------------
+ * Private method to get the total DOS, and the local ones if nlocal > 0, in
+ * [fmin, fmax] with ndos points by the linear tetrahedron method on the full
+ * q-mesh of QMesh, whose points take the frequencies of their q-points by
+ * qmap; the simplices are shared among the ranks, and among the threads of
+ * each rank, and the results are summed up on rank 0. The total DOS is per
+ * unit cell, i.e., it integrates to ndim.
+ * ---------------------------------------------------------------------------- */
+void Phonon::TetraDOS()
+{
+#ifdef UseMPI
+  if (me == 0) mpi_job(JobTetraDOS);
+  int ibuf[2];
+  double dbuf[2];
+  ibuf[0] = nlocal; ibuf[1] = ndos;
+  dbuf[0] = fmin;   dbuf[1] = fmax;
+  MPI_Bcast(ibuf, 2, MPI_INT,    0, MPI_COMM_WORLD);
+  MPI_Bcast(dbuf, 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  nlocal = ibuf[0]; ndos = ibuf[1];
+  fmin   = dbuf[0]; fmax = dbuf[1];
+#endif
+  df  = (fmax-fmin)/double(ndos-1);
+  rdf = 1./df;
 
-    dynmat->getDMq(qpts[iq], &wt[iq]);
-    if (wt[iq] <= 0.) continue;
+  int nall = nlocal*ndos*sysdim;
+  memory->destroy(dos);
+  memory->destroy(ldos);
+  ldos = NULL;
+  dos = memory->create(dos, ndos, "TetraDOS:dos");
+  if (nlocal > 0) ldos = memory->create(ldos, nlocal, ndos, sysdim, "TetraDOS:ldos");
+  for (int i=0; i<ndos; i++) dos[i] = 0.;
+  for (int i=0; i<nall; i++) ldos[0][0][i] = 0.;
+
+  Tetra *tetra = new Tetra(qmesh, dynmat->flag_latinfo ? dynmat->ibasevec : NULL);
+  int slo = int(bigint(tetra->nsimp)*me/nprocs);
+  int shi = int(bigint(tetra->nsimp)*(me+1)/nprocs);
+
+  // each thread sums up its share of the simplices into its own buffers
+  int nth = MAX(1, dynmat->nthreads[0] + dynmat->nthreads[1]);
+  nth = MAX(1, MIN(nth, (shi-slo)/64));
+  double **tdos, **tldos;
+  tdos  = memory->create(tdos,  nth, ndos, "TetraDOS:tdos");
+  tldos = memory->create(tldos, nth, MAX(1,nall), "TetraDOS:tldos");
+  if (nth == 1) TetraSum(tetra, slo, shi, tdos[0], tldos[0]);
+  else {
+    std::vector<std::thread> threads;
+    for (int it=0; it<nth; it++){
+      int lo = slo + int(bigint(shi-slo)*it/nth), hi = slo + int(bigint(shi-slo)*(it+1)/nth);
+      threads.push_back(std::thread(&Phonon::TetraSum, this, tetra, lo, hi, tdos[it], tldos[it]));
+    }
+    for (int it=0; it<nth; it++) threads[it].join();
+  }
+  for (int it=0; it<nth; it++){
+    for (int i=0; i<ndos; i++) dos[i] += tdos[it][i];
+    for (int i=0; i<nall; i++) ldos[0][0][i] += tldos[it][i];
+  }
+  memory->destroy(tdos);
+  memory->destroy(tldos);
+  delete tetra;
+
+#ifdef UseMPI
+  if (me == 0){
+    MPI_Reduce(MPI_IN_PLACE, dos, ndos, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (nall > 0) MPI_Reduce(MPI_IN_PLACE, ldos[0][0], nall, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  } else {
+    MPI_Reduce(dos, NULL, ndos, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (nall > 0) MPI_Reduce(ldos[0][0], NULL, nall, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  }
+#endif
 
-    dynmat->geteigen(&egval[0], 1);
+return;
+}
 
-    for (int idim=0; idim<ndim; idim++){
-      int hit = int((egval[idim] - offset)*rdf);
-      if (hit >= 0 && hit <ndos){
-        dos[hit] += wt[iq];
-
-        for (int ilocal=0; ilocal<nlocal; ilocal++){
-          int ipos = locals[ilocal]*sysdim;
-          for (int jdim=0; jdim<sysdim; jdim++){
-            double dr = egvec[idim][ipos+jdim].r, di = egvec[idim][ipos+jdim].i;
-            double norm = dr * dr + di * di;
-            ldos[ilocal][hit][jdim] += wt[iq] * norm;
-          }
+/* ----------------------------------------------------------------------------
+ * Private method to add the DOS of the simplices [lo, hi) of tetra, for all
+ * branches, to d[ndos], and the local DOS to ld[nlocal][ndos][sysdim], both
+ * zeroed first. Grid point i stands for the bin [f_i - df/2, f_i + df/2], to
+ * which a simplex adds the change of its integrated weights across the bin
+ * over df, so that flat bands and features narrower than df are kept; each
+ * simplex only touches the bins within its range.
+ * ---------------------------------------------------------------------------- */
+void Phonon::TetraSum(Tetra *tetra, const int lo, const int hi, double *d, double *ld)
+{
+  const int nc = tetra->ncorner, nproj = nlocal*sysdim;
+  const double fac = 1./double(tetra->nsimp), offset = fmin-0.5*df;
+  for (int i=0; i<ndos; i++) d[i] = 0.;
+  for (int i=0; i<ndos*nproj; i++) ld[i] = 0.;
+
+  int iqc[4];
+  double e[4], W0[4], W1[4];
+  for (int is=lo; is<hi; is++){
+    for (int m=0; m<nc; m++) iqc[m] = qmap[tetra->simp[is][m]];
+
+    for (int j=0; j<ndim; j++){
+      double emin = 1.e300, emax = -1.e300;
+      for (int m=0; m<nc; m++){
+        e[m] = eigs[iqc[m]][j];
+        emin = MIN(emin, e[m]);
+        emax = MAX(emax, e[m]);
+      }
+      if (emax < offset || emin >= offset + double(ndos)*df) continue;
+      int i0 = MAX(0, int(floor((emin-offset)*rdf)));
+      int i1 = MIN(ndos-1, int(floor((emax-offset)*rdf)));
+
+      double n0 = tetra->integral(e, offset + double(i0)*df, W0);
+      for (int i=i0; i<=i1; i++){
+        double n1 = tetra->integral(e, offset + double(i+1)*df, W1);
+        d[i] += (n1-n0)*fac*rdf;
+        n0 = n1;
+        if (nproj < 1) continue;
+
+        for (int m=0; m<nc; m++){
+          double *p = &projs[iqc[m]][j*nproj], *l = &ld[i*sysdim];
+          double wm = (W1[m]-W0[m])*fac*rdf;
+          for (int il=0; il<nlocal; il++)
+          for (int idim=0; idim<sysdim; idim++) l[il*ndos*sysdim+idim] += wm*p[il*sysdim+idim];
+          W0[m] = W1[m];
         }
       }
     }
   }
-  egvec = NULL;
-  printf("Done!\nNow to normalize the DOSs ..."); fflush(stdout);
-
-  // normalize the measure DOS and LDOS
-  Normalize();
-  printf("Done! ");
-  time->stop(); time->print(); delete time;
-
-  // to write the DOSes
-  writeDOS();
-  writeLDOS();
-
-  // evaluate the local vibrational thermal properties optionally
-  local_therm();
 
 return;
 }
 
+#ifdef UseMPI
 /* ----------------------------------------------------------------------------
- * Private method to normalize the DOS and/or Local DOS.
- * Simpson's rule is used for the integration.
+ * Private method for the ranks other than 0; they wait for rank 0 to tell
+ * which job to share, until rank 0 quits.
  * ---------------------------------------------------------------------------- */
-void Phonon::Normalize()
+void Phonon::mpi_worker()
 {
-  double odd, even, sum;
-  if (dos){
-    odd = even = 0.;
-    for (int i=1; i<ndos-1; i +=2) odd  += dos[i];
-    for (int i=2; i<ndos-1; i +=2) even += dos[i];
-    sum = dos[0] + dos[ndos-1];
-    sum += 4.*odd + 2.*even;
-    sum = 3.*rdf/sum;
-    for (int i=0; i<ndos; i++) dos[i] *= sum;
-  }
-
-  if (ldos){
-    for (int ilocal=0; ilocal<nlocal; ilocal++)
-    for (int idim=0; idim<sysdim; idim++){
-      odd = even = 0.;
-      for (int i=1; i<ndos-1; i +=2) odd  += ldos[ilocal][i][idim];
-      for (int i=2; i<ndos-1; i +=2) even += ldos[ilocal][i][idim];
-      sum = ldos[ilocal][0][idim] + ldos[ilocal][ndos-1][idim];
-      sum += 4.*odd + 2.*even;
-      sum = 3.*rdf/sum;
-      for (int i=0; i<ndos; i++) ldos[ilocal][i][idim] *= sum;
-    }
+  double sums[7];
+  while (1){
+    int job;
+    MPI_Bcast(&job, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if      (job == JobComputeAll)  ComputeAll();
+    else if (job == JobFreqRange)   FreqRange();
+    else if (job == JobHistogram)   Histogram();
+    else if (job == JobThermSums)   ThermSums(0., sums);
+    else if (job == JobLDOSLoop)    LDOSLoop();
+    else if (job == JobDispLine)    DispLine(NULL, NULL, 0, NULL, NULL);
+    else if (job == JobResetInterp) dynmat->reset_interp_method();
+    else if (job == JobVelocity)    VelocityLoop(NULL);
+    else if (job == JobEstimate)    dynmat->estimate_error();
+    else if (job == JobTetraLoop)   TetraLoop();
+    else if (job == JobTetraDOS)    TetraDOS();
+    else if (job == JobStreamLoop)  StreamLoop(sums);
+    else if (job == JobCountBelow)  CountBelow(0, NULL, NULL);
+    else if (job == JobStoreFreqs)  StoreFreqs();
+    else break;
   }
 
 return;
 }
 
 /* ----------------------------------------------------------------------------
- * Private method to calculate vibrational frequencies for all q-points
+ * Private method for rank 0 to tell the other ranks which job comes next
  * ---------------------------------------------------------------------------- */
-void Phonon::ComputeAll()
+void Phonon::mpi_job(const int job)
 {
-  int nprint;
-  if (nq > 10) nprint = nq/10;
-  else nprint = 1;
-  Timer *time = new Timer();
+  int ijob = job;
+  MPI_Bcast(&ijob, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
-  printf("\nNow to compute the phonons "); fflush(stdout);
-  // now to calculate the frequencies at all q-points
-  memory->destroy(eigs);
-  eigs = memory->create(eigs, nq,ndim,"QMesh_eigs");
-  
-  for (int iq=0; iq<nq; iq++){
-    if ((iq+1)%nprint == 0) {printf("."); fflush(stdout);}
+return;
+}
 
-    dynmat->getDMq(qpts[iq], &wt[iq]);
-    if (wt[iq] > 0.) dynmat->geteigen(eigs[iq], 0);
+/* ----------------------------------------------------------------------------
+ * Private method to pass the q-points and weights generated on rank 0 to all
+ * ranks, and to assign each rank a contiguous chunk of the q-points.
+ * ---------------------------------------------------------------------------- */
+void Phonon::mpi_share_qmesh()
+{
+  if (flag_store == 1) flag_store = 0;
+  MPI_Bcast(&nq, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (me != 0){
+    memory->destroy(wt);
+    memory->destroy(qpts);
+    wt   = memory->create(wt,   nq,   "mpi_share_qmesh:wt");
+    qpts = memory->create(qpts, nq,3, "mpi_share_qmesh:qpts");
+  }
+  MPI_Bcast(wt,      nq,   MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  MPI_Bcast(qpts[0], nq*3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  MPI_Bcast(qmesh,   4,    MPI_INT,    0, MPI_COMM_WORLD);
+  int ngrid = qmap ? qmesh[0]*qmesh[1]*qmesh[2] : 0;
+  MPI_Bcast(&ngrid, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (me != 0){
+    memory->destroy(qmap);
+    qmap = NULL;
+    if (ngrid > 0) qmap = memory->create(qmap, ngrid, "mpi_share_qmesh:qmap");
+  }
+  if (ngrid > 0) MPI_Bcast(qmap, ngrid, MPI_INT, 0, MPI_COMM_WORLD);
+
+  MPI_Bcast(&nsym, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (me != 0){
+    memory->destroy(symrot);
+    memory->destroy(symsrc);
+    symrot = NULL;
+    symsrc = NULL;
+    if (nsym > 0){
+      symrot = memory->create(symrot, nsym, 9, "mpi_share_qmesh:symrot");
+      symsrc = memory->create(symsrc, nsym, dynmat->nucell, "mpi_share_qmesh:symsrc");
+    }
+  }
+  if (nsym > 0){
+    MPI_Bcast(symrot[0], nsym*9, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(symsrc[0], nsym*dynmat->nucell, MPI_INT, 0, MPI_COMM_WORLD);
   }
-  printf("Done!\n");
-  time->stop(); time->print(); delete time;
+
+  iqlo = int(bigint(nq)*me/nprocs);
+  iqhi = int(bigint(nq)*(me+1)/nprocs);
 
 return;
 }
+#endif
 
 /*------------------------------------------------------------------------------
  * Method to count # of words in a string, without destroying the string
@@ -6,6 +6,8 @@
 #include <complex>
 #include "dynmat.h"
 #include "memory.h"
+#include "pipeline.h"
+#include "tetra.h"
 
 using namespace std;
 
@@ -19,39 +21,99 @@ public:
 private:
   int nq, ndim, sysdim;
   double **qpts, *wt;
-  double **eigs;
+  int *qperm;               // mesh index of each q-point, if reordered by SortQ; NULL otherwise
+  int *qmap;                // q-point of each point of the full q-mesh of QMesh
+  double **eigs;            // eigenvalues of the local q-points, [iqhi-iqlo][ndim]
+  int nsym;                 // # of symmetry operations the q-points of QMesh stand for, 0 if none
+  double **symrot;          // Cartesian rotation of each operation, [nsym][9]
+  int **symsrc;             // the atom each operation takes onto each atom, [nsym][nucell]
+
+  int qmesh[4];             // size of the q-mesh by QMesh, and the axis it runs slowest along
+  int me, nprocs;           // rank info; only rank 0 talks to the user
+  int iqlo, iqhi;           // range of q-points handled by current rank
 
   int ndos, nlocal, *locals;
+  int flag_all;             // 1 if the local atoms are all atoms, whose LDOS goes to one binary file
+  int *gptr, *gatom;        // atoms of each local group i, gatom[gptr[i]:gptr[i+1]]; NULL if not groups
   double *dos, fmin, fmax, df, rdf;
   double ***ldos;
+  double **projs;           // squared eigenvector components on the local atoms, for tetrahedra
+  int ntemp;                // # of temperatures of the one-pass thermal properties
+  double *temps, **tsums;   // the temperatures, and the thermal sums at each, [ntemp][5]
+  int flag_store;           // 1 if eigs and wt still hold the last ComputeAll, to be sorted once asked; 2 if sorted
+  bigint nstore;            // # of modes of the local q-points kept from the last ComputeAll
+  double *sfreq, *swsum;    // their frequencies in ascending order, and the weight of those before each, [nstore+1]
+  double srange[3];         // lowest and highest frequency kept by all ranks, and their total weight
 
   Memory *memory;
+  Pipeline *pipe;           // to evaluate lists of q-points in stages
 
   void QMesh();
+  void SortQ();
+  double QTraffic();
+  bigint morton(const int *, const int);
+  bigint hilbert(const int *, const int);
   void ComputeAll();
+  void FreqRange();
+  void Histogram();
+  void ThermSums(double, double *);
+  void LDOSLoop();
+  void DispLine(double *, double *, int, double *, double *);
+  void VelocityLoop(FILE *);
+  void WriteRecords(FILE *, const double *, const int, const int, const int);
+  void TetraLoop();
+  void TetraDOS();
+  void TetraSum(Tetra *, const int, const int, double *, double *);
+  void StreamLoop(double *);
+  void AtomGroups();
+  void AskTemps();
+  void StoreFreqs();
+  void CountBelow(const int, double *, double *);
 
   void pdos();
+  void adaptive_dos();
   void pdisp();
   void therm();
+  void pvel();
+  void ptetra();
+  void pstream();
+  void pgroups();
+  void prefine();
+  void prebin();
 
   void ldos_egv();
   void ldos_rsgf();
+  void pkpm();
   void local_therm();
+  void tetra_therm();
 
   void dmanyq();
   void vfanyq();
   void DMdisp();
 
-  void smooth(double *, const int);
+  void smooth();
   void writeDOS();
   void writeLDOS();
+  void writeGDOS();
+  void writeTSums();
   void Normalize();
 
   int count_words(const char *);
 
+#ifdef UseMPI
+  enum {JobExit, JobComputeAll, JobFreqRange, JobHistogram, JobThermSums,
+        JobLDOSLoop, JobDispLine, JobResetInterp, JobVelocity,
+        JobEstimate, JobTetraLoop, JobTetraDOS, JobStreamLoop, JobCountBelow,
+        JobStoreFreqs};
+  void mpi_worker();
+  void mpi_job(const int);
+  void mpi_share_qmesh();
+#endif
+
 #ifdef UseSPG
   int num_atom, *attyp;
   double latvec[3][3], **atpos;
+  void Symmetry(double [][3], const double);
 #endif
 };
 
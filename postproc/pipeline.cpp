@@ -0,0 +1,373 @@
+#include "pipeline.h"
+#include <chrono>
+
+#define MIN(a,b) ((a)>(b)?(b):(a))
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+/* ----------------------------------------------------------------------------
+ * Class Pipeline evaluates a list of q-points in three stages: the
+ * interpolation of the dynamical matrix, its diagonalization, and the
+ * output/reduction done by the caller. The first two stages are run by
+ * their own groups of threads and are connected by a bounded set of
+ * buffers, so that a fast stage is held back once all buffers are in use;
+ * the caller receives the q-points strictly in order via next(), and must
+ * hand each buffer back by release(). Without threads everything is done
+ * inline by next().
+ * ---------------------------------------------------------------------------- */
+Pipeline::Pipeline(DynMat *dm)
+{
+  dynmat = dm;
+  memory = new Memory();
+
+  ni = dynmat->nthreads[0];
+  ne = dynmat->nthreads[1];
+  if (ni < 1 || ne < 1) ni = ne = 0;
+
+  // q-points are interpolated in batches of up to nbatch, about 32 MB of DMs
+  ndim = dynmat->fftdim;
+  nbatch = MAX(1, MIN(16, 2097152/(ndim*ndim)));
+
+  nbuf = dynmat->nbuffer;
+  if (nbuf < 1) nbuf = MAX(1, 2*(ni+ne))*nbatch;
+  nbatch = MAX(1, MIN(nbatch, nbuf/MAX(1, 2*ni)));
+
+  slots = new QSlot[nbuf];
+  done  = new QSlot*[nbuf];
+  inuse = new int[nbuf];
+  egvs = NULL; DMs = NULL;
+  dDs = NULL; vels = NULL;
+  nq = 0;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Deconstructor
+ * ---------------------------------------------------------------------------- */
+Pipeline::~Pipeline()
+{
+  stop();
+
+  delete []slots;
+  delete []done;
+  delete []inuse;
+  delete memory;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to start a job of n q-points; wt, if not NULL, gives the
+ * initial weights, which will be zeroed for q-points that turn out to be
+ * skipped. flag < 0 means no diagonalization is needed, otherwise it is
+ * passed to DynMat::geteigen (1 to get also the eigenvectors); flag = 2 gets
+ * the eigenvectors and the group velocities. If red is set, it is called for
+ * each q-point that is not skipped, right after its diagonalization, by the
+ * thread that did it, whose index in [0, nreducers()) is passed along, so
+ * that the results can be summed up into per-thread buffers.
+ * ---------------------------------------------------------------------------- */
+void Pipeline::start(const int n, double **q, double *wt, const int flag, Reducer red)
+{
+  stop();
+
+  egvs = memory->create(egvs, nbuf, ndim, "Pipeline:egvs");
+  DMs  = memory->create(DMs,  nbuf, ndim*ndim, "Pipeline:DMs");
+  if (flag == 2){
+    // the callers make sure that 3*ndim*ndim fits in int
+    dDs  = memory->create(dDs,  nbuf, 3*ndim*ndim, "Pipeline:dDs");
+    vels = memory->create(vels, nbuf, 3*ndim, "Pipeline:vels");
+  }
+  for (int i=0; i<nbuf; i++){
+    slots[i].egv = egvs[i];
+    slots[i].DMq = DMs[i];
+    slots[i].dDq = dDs ? dDs[i] : NULL;
+    slots[i].vel = vels ? vels[i] : NULL;
+  }
+
+  nq = n; qs = q; wts = wt; flag_egv = flag;
+  reduce = flag >= 0 ? red : nullptr;
+  inext = ieig = iout = 0;
+  busy[0] = busy[1] = busy[2] = 0.;
+  tstart = wtime();
+
+  todo.clear();
+  for (int i=0; i<nbuf; i++){
+    inuse[i] = 0;
+    done[i] = NULL;
+  }
+  if (ni < 1 || nq < 1) return;
+
+  // dlamch initializes itself at its first call, which is not thread-safe
+  dlamch_((char *)"S");
+
+  for (int i=0; i<ni; i++) workers.push_back(std::thread(&Pipeline::interp_worker, this, i));
+  if (flag_egv >= 0) for (int i=0; i<ne; i++) workers.push_back(std::thread(&Pipeline::eigen_worker, this, i));
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to get the next q-point of the job, in order.
+ * ---------------------------------------------------------------------------- */
+QSlot *Pipeline::next()
+{
+  QSlot *slot;
+  if (workers.empty()){
+    // one batch is done right now whenever the done ones are used up
+    if (done[iout%nbuf] == NULL){
+      std::vector<QSlot *> batch(nbatch);
+      int n = take(batch.data());
+
+      double t0 = wtime();
+      interp(batch.data(), n);
+      double t1 = wtime();
+      for (int i=0; i<n; i++){
+        if (flag_egv >= 0) eigen(batch[i], 0);
+        done[batch[i]->iq%nbuf] = batch[i];
+      }
+      busy[0] += t1 - t0;
+      busy[1] += wtime() - t1;
+    }
+    slot = done[iout%nbuf];
+    done[iout++%nbuf] = NULL;
+    tout = wtime();
+
+  } else {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (done[iout%nbuf] == NULL) cv_done.wait(lock);
+    slot = done[iout%nbuf];
+    done[iout++%nbuf] = NULL;
+    tout = wtime();
+  }
+
+return slot;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to hand a buffer obtained from next() back to the pipeline.
+ * ---------------------------------------------------------------------------- */
+void Pipeline::release(QSlot *slot)
+{
+  double t = wtime();
+  std::lock_guard<std::mutex> lock(mtx);
+  busy[2] += t - tout;
+  inuse[slot-slots] = 0;
+  cv_free.notify_all();
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to wait for all threads of the current job, to report the
+ * utilization of each stage, and to free the buffers of the slots.
+ * ---------------------------------------------------------------------------- */
+void Pipeline::stop()
+{
+  if (!workers.empty()) finish();
+
+  memory->destroy(egvs);
+  memory->destroy(DMs);
+  memory->destroy(dDs);
+  memory->destroy(vels);
+  egvs = NULL; DMs = NULL;
+  dDs = NULL; vels = NULL;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to join the threads of the current job and to report the
+ * utilization of each stage.
+ * ---------------------------------------------------------------------------- */
+void Pipeline::finish()
+{
+  {
+    // wake up idle workers in case the job was left unfinished
+    std::lock_guard<std::mutex> lock(mtx);
+    inext = ieig = nq;
+    cv_free.notify_all();
+    cv_todo.notify_all();
+  }
+  for (int i=0; i<(int) workers.size(); i++) workers[i].join();
+  workers.clear();
+
+  double wall = wtime() - tstart;
+  if (dynmat->me == 0 && wall > 0.){
+    printf("\nPipeline: %d q-points in %g seconds; utilization of interpolation: %d x %.1f%%,",
+      nq, wall, ni, busy[0]/(ni*wall)*100.);
+    if (flag_egv >= 0) printf(" eigen: %d x %.1f%%,", ne, busy[1]/(ne*wall)*100.);
+    printf(" output: %.1f%%.\n", busy[2]/wall*100.);
+  }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to get the # of threads that may call the reducer of a job.
+ * ---------------------------------------------------------------------------- */
+int Pipeline::nreducers()
+{
+return MAX(1, ne);
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to take as many consecutive q-points as there are free slots
+ * in a row, up to nbatch and without wrapping around the end of the slots, so
+ * that their buffers follow one another; returns the # taken. To be called
+ * with mtx locked if there are threads.
+ * ---------------------------------------------------------------------------- */
+int Pipeline::take(QSlot **batch)
+{
+  int n = 0;
+  while (n < nbatch && inext < nq && !inuse[inext%nbuf] && (n == 0 || inext%nbuf != 0)){
+    QSlot *slot = &slots[inext%nbuf];
+    inuse[inext%nbuf] = 1;
+    slot->iq = inext++;
+    batch[n++] = slot;
+  }
+
+return n;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method run by the id-th thread of the interpolation stage.
+ * ---------------------------------------------------------------------------- */
+void Pipeline::interp_worker(const int id)
+{
+  // the same cpus as those that first touched the big arrays, if asked
+  Memory::bind_thread(id, ni);
+
+  std::vector<QSlot *> batch(nbatch);
+  while (1){
+    int n = 0;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      while (inext < nq && inuse[inext%nbuf]) cv_free.wait(lock);
+      if (inext >= nq) break;
+
+      n = take(batch.data());
+    }
+    double t0 = wtime();
+    interp(batch.data(), n);
+    double t = wtime() - t0;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    busy[0] += t;
+    for (int i=0; i<n; i++){
+      if (flag_egv >= 0) todo.push_back(batch[i]);
+      else done[batch[i]->iq%nbuf] = batch[i];
+    }
+    if (flag_egv >= 0) cv_todo.notify_all();
+    else cv_done.notify_all();
+  }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method run by the id-th thread of the eigen stage.
+ * ---------------------------------------------------------------------------- */
+void Pipeline::eigen_worker(const int id)
+{
+  // half way between the cpus of the interpolation threads, if asked
+  Memory::bind_thread(2*id+1, 2*ne);
+
+  while (1){
+    QSlot *slot;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      while (todo.empty() && ieig < nq) cv_todo.wait(lock);
+      if (todo.empty()) break;
+
+      slot = todo.front(); todo.pop_front();
+      ieig++;
+    }
+    double t0 = wtime();
+    eigen(slot, id);
+    double t = wtime() - t0;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    busy[1] += t;
+    done[slot->iq%nbuf] = slot;
+    cv_done.notify_all();
+  }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to evaluate the dynamical matrices of n slots by one call,
+ * so that the interpolation can reuse the data of each mesh cell; q-points
+ * found in the cache of DynMat are taken from there instead, except when the
+ * velocities are asked, which need the derivatives of the DMs as well. As the
+ * slots of a batch have consecutive buffers, each run of q-points not found
+ * in the cache is interpolated right into them.
+ * ---------------------------------------------------------------------------- */
+void Pipeline::interp(QSlot **batch, const int n)
+{
+  if (n < 1) return;
+  double (*q)[3] = new double[n][3];
+  double *wt = new double[n];
+  int *miss = new int[n];
+
+  for (int i=0; i<n; i++){
+    QSlot *slot = batch[i];
+    double *qi = qs[slot->iq];
+    slot->wt = 1.;
+    if (wts) slot->wt = wts[slot->iq];
+    for (int idim=0; idim<3; idim++) q[i][idim] = qi[idim];
+    wt[i] = 1.;
+
+    int found = 0;
+    if (flag_egv < 2) found = dynmat->cache_lookup(qi, flag_egv, slot->egv, slot->DMq, &slot->wt);
+    slot->ready = found == 2 && flag_egv >= 0;
+    miss[i] = !found;
+  }
+
+  for (int i=0; i<n; ){
+    if (!miss[i]){i++; continue;}
+    int m = 1;
+    while (i+m < n && miss[i+m]) m++;
+    dynmat->getDMq(&q[i], m, &wt[i], batch[i]->DMq, batch[i]->dDq);
+
+    for (int j=i; j<i+m; j++){
+      QSlot *slot = batch[j];
+      int skip = wt[j] <= 0.;
+      if (skip) slot->wt = 0.;
+      dynmat->cache_store(q[j], skip, slot->DMq, NULL, NULL);
+    }
+    i += m;
+  }
+  delete []q;
+  delete []wt;
+  delete []miss;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to diagonalize the dynamical matrix of a slot, if needed;
+ * the results are kept in the cache of DynMat. The group velocities follow
+ * from the eigenvectors if asked, and then the reducer, if any, is called.
+ * ---------------------------------------------------------------------------- */
+void Pipeline::eigen(QSlot *slot, const int id)
+{
+  if (slot->wt <= 0.) return;
+
+  if (!slot->ready){
+    dynmat->geteigen(slot->egv, flag_egv > 0, slot->DMq);
+    dynmat->cache_store(qs[slot->iq], -1, NULL, slot->egv, flag_egv ? slot->DMq : NULL);
+    if (flag_egv == 2) dynmat->getvelocity(qs[slot->iq], slot->egv, slot->DMq, slot->dDq, slot->vel);
+  }
+  if (reduce) reduce(slot, id);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the wall time in seconds.
+ * ---------------------------------------------------------------------------- */
+double Pipeline::wtime()
+{
+return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
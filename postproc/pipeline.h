@@ -0,0 +1,73 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <functional>
+#include "dynmat.h"
+#include "memory.h"
+
+// a buffer that carries one q-point through the pipeline
+class QSlot {
+public:
+  int iq;              // index of the q-point in current job
+  double wt;           // weight of the q-point; zero if it is skipped
+  int ready;           // 1 if the eigen results were found in the cache
+  double *egv;         // eigenvalues, [ndim]
+  doublecomplex *DMq;  // dynamical matrix, or eigenvectors if asked, [ndim*ndim]
+  doublecomplex *dDq;  // derivatives of the DM with respect to q, if asked, [3*ndim*ndim]
+  double *vel;         // group velocities, if asked, [ndim][3]
+};
+
+class Pipeline {
+public:
+  Pipeline(DynMat *);
+  ~Pipeline();
+
+  // a job done on each solved q-point by the eigen stage, with the index of the thread
+  typedef std::function<void(QSlot *, const int)> Reducer;
+
+  void start(const int, double **, double *, const int, Reducer = nullptr);
+  QSlot *next();
+  void release(QSlot *);
+  void stop();
+  int nreducers();
+
+private:
+  DynMat *dynmat;
+  Memory *memory;
+
+  int ni, ne, nbuf, ndim;       // # of threads per stage, # of buffers, size of DM
+  int nbatch;                   // max # of q-points interpolated by one call
+  int nq, flag_egv;             // # of q-points in current job; what to solve
+  double **qs, *wts;            // q-points and their weights of current job
+  Reducer reduce;               // done on each q-point after its diagonalization, if set
+  QSlot *slots;                 // q-point iq goes to slot iq%nbuf, so a batch has consecutive buffers
+  double **egvs;                // the buffers of the slots, allocated by start() and freed by stop()
+  doublecomplex **DMs;
+  doublecomplex **dDs;          // derivatives of the DMs, only if velocities are asked
+  double **vels;
+
+  int inext, ieig, iout;        // next q to interpolate, to diagonalize, to return
+  QSlot **done;                 // finished slots, indexed by iq%nbuf
+  int *inuse;                   // 1 if the slot is taken and not yet released
+  std::deque<QSlot *> todo;
+  std::vector<std::thread> workers;
+  std::mutex mtx;
+  std::condition_variable cv_free, cv_todo, cv_done;
+
+  double busy[3], tout, tstart; // busy time of each stage, in seconds
+
+  int take(QSlot **);
+  void finish();
+  void interp_worker(const int);
+  void eigen_worker(const int);
+  void interp(QSlot **, const int);
+  void eigen(QSlot *, const int);
+  double wtime();
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "qcache.h"
+#include "math.h"
+
+/* ----------------------------------------------------------------------------
+ * Class QCache keeps the DMs and, once known, the eigenvalues/eigenvectors of
+ * the most recently used q-points, within a budget of memory, so that q-points
+ * evaluated again (end points of the dispersion paths, the same q-mesh for
+ * DOS and thermal properties, etc.) are not interpolated and diagonalized
+ * again. The q-points are told apart by their fractional coordinates to
+ * 2^-28 and by the interpolation method. Thread safe.
+ * ---------------------------------------------------------------------------- */
+QCache::QCache(const int n, const double mb)
+{
+  ndim = n;
+  budget = mb > 0. ? bigint(mb*1048576.) : 0;
+  used = 0;
+  nhit[0] = nhit[1] = nmiss[0] = nmiss[1] = npart = 0;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Deconstructor
+ * ---------------------------------------------------------------------------- */
+QCache::~QCache()
+{
+  clear();
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to look for q: want = -1 for the DM, 0 for the eigenvalues,
+ * 1 for the eigenvalues and eigenvectors. Returns 2 if all wanted are found
+ * and copied into egv and mat (the eigenvectors for want = 1, the DM
+ * otherwise); 1 if only the DM is found and copied into mat; 0 if q is not
+ * known. skip is set to the skip flag of q if it is known.
+ * ---------------------------------------------------------------------------- */
+int QCache::lookup(const double *q, const int method, const int want, double *egv, doublecomplex *mat, int *skip)
+{
+  if (budget < 1) return 0;
+
+  QKey k = key(q, method);
+  std::lock_guard<std::mutex> lock(mtx);
+  std::unordered_map<QKey, QEntry, QKeyHash>::iterator it = map.find(k);
+  if (it == map.end()){
+    nmiss[want >= 0]++;
+    return 0;
+  }
+  QEntry &e = it->second;
+  lru.splice(lru.begin(), lru, e.pos);
+  *skip = e.skip;
+
+  int found = 1;
+  if (want < 0) nhit[0]++;
+  else {
+    if (e.skip || (!e.egv.empty() && (want == 0 || !e.evec.empty()))) found = 2;
+    if (found == 2) nhit[1]++;
+    else npart++;
+  }
+
+  if (found == 2 && want >= 0 && !e.skip){
+    for (int i=0; i<ndim; i++) egv[i] = e.egv[i];
+    if (want == 1) for (int i=0; i<ndim*ndim; i++) mat[i] = e.evec[i];
+  } else for (int i=0; i<ndim*ndim; i++) mat[i] = e.dm[i];
+
+return want < 0 ? 2 : found;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to keep what is known of q: its skip flag, if not negative,
+ * and any of its DM, eigenvalues and eigenvectors that is not NULL; a q-point
+ * not yet known is kept only together with its DM. The least recently used
+ * q-points are dropped once the budget is exceeded.
+ * ---------------------------------------------------------------------------- */
+void QCache::store(const double *q, const int method, const int skip, const doublecomplex *dm,
+                   const double *egv, const doublecomplex *evec)
+{
+  if (budget < 1) return;
+
+  QKey k = key(q, method);
+  std::lock_guard<std::mutex> lock(mtx);
+  std::unordered_map<QKey, QEntry, QKeyHash>::iterator it = map.find(k);
+  if (it == map.end()){
+    if (dm == NULL) return;
+    lru.push_front(k);
+    it = map.insert(std::make_pair(k, QEntry())).first;
+    it->second.pos = lru.begin();
+    it->second.skip = 0;
+  } else {
+    lru.splice(lru.begin(), lru, it->second.pos);
+    used -= size(it->second);
+  }
+
+  QEntry &e = it->second;
+  if (skip >= 0) e.skip = skip;
+  if (dm)   e.dm.assign(dm, dm + ndim*ndim);
+  if (egv)  e.egv.assign(egv, egv + ndim);
+  if (evec) e.evec.assign(evec, evec + ndim*ndim);
+  used += size(e);
+
+  while (used > budget && !lru.empty()){
+    std::unordered_map<QKey, QEntry, QKeyHash>::iterator last = map.find(lru.back());
+    used -= size(last->second);
+    map.erase(last);
+    lru.pop_back();
+  }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to report the hits and misses, given in count as nhit[0],
+ * nmiss[0], nhit[1], nmiss[1] and npart, possibly summed over all ranks.
+ * ---------------------------------------------------------------------------- */
+void QCache::print(const bigint *count)
+{
+  if (count[0]+count[1]+count[2]+count[3]+count[4] < 1) return;
+  printf("\nCache of D(q): %lld hits and %lld misses for the DMs; %lld hits, %lld with the DM only,",
+    (long long) count[0], (long long) count[1], (long long) count[2], (long long) count[4]);
+  printf(" and %lld misses for the eigen results; %.1f of %.1f MB in use.\n",
+    (long long) count[3], double(used)/1048576., double(budget)/1048576.);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to forget all q-points.
+ * ---------------------------------------------------------------------------- */
+void QCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  map.clear();
+  lru.clear();
+  used = 0;
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the key of q.
+ * ---------------------------------------------------------------------------- */
+QKey QCache::key(const double *q, const int method)
+{
+  const double scale = 268435456.; // 2^28
+  QKey k;
+  for (int i=0; i<3; i++){
+    double x = q[i] - floor(q[i]);
+    k.k[i] = int(floor(x*scale+0.5))%268435456;
+  }
+  k.method = method;
+
+return k;
+}
+
+/* ----------------------------------------------------------------------------
+ * Private method to get the # of bytes taken by an entry, roughly.
+ * ---------------------------------------------------------------------------- */
+bigint QCache::size(const QEntry &e)
+{
+  return sizeof(QEntry) + 2*sizeof(QKey) + 64 + sizeof(double)*e.egv.size()
+       + sizeof(doublecomplex)*(e.dm.size() + e.evec.size());
+}
+/* ---------------------------------------------------------------------------- */
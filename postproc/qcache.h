@@ -0,0 +1,67 @@
+#ifndef QCACHE_H
+#define QCACHE_H
+
+#include "stdio.h"
+#include "stdlib.h"
+#include <list>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include "memory.h"
+extern "C"{
+#include "f2c.h"
+}
+
+// key of a q-point: its fractional coordinates wrapped into [0,1) and
+// quantized, together with the interpolation method
+class QKey {
+public:
+  int k[3], method;
+  bool operator==(const QKey &o) const { return k[0]==o.k[0] && k[1]==o.k[1] && k[2]==o.k[2] && method==o.method; }
+};
+
+class QKeyHash {
+public:
+  size_t operator()(const QKey &key) const {
+    size_t h = key.method;
+    for (int i=0; i<3; i++) h = h*1000003 ^ size_t(key.k[i]);
+    return h;
+  }
+};
+
+// what is known of a q-point
+class QEntry {
+public:
+  int skip;                         // 1 if q is to be skipped
+  std::vector<doublecomplex> dm;    // the DM, [ndim*ndim], if kept
+  std::vector<double> egv;          // eigenvalues, [ndim], if known
+  std::vector<doublecomplex> evec;  // eigenvectors, [ndim*ndim], if known
+  std::list<QKey>::iterator pos;    // position in the LRU list
+};
+
+class QCache {
+public:
+  QCache(const int, const double);
+  ~QCache();
+
+  int lookup(const double *, const int, const int, double *, doublecomplex *, int *);
+  void store(const double *, const int, const int, const doublecomplex *, const double *, const doublecomplex *);
+  void print(const bigint *);
+  void clear();
+
+  bigint budget;                    // max # of bytes kept; 0, no cache
+  bigint nhit[2], nmiss[2];         // # of hits/misses when looking for the DMs and for the eigen results
+  bigint npart;                     // # of times only the DM is found when looking for the eigen results
+
+private:
+  int ndim;
+  bigint used;                      // # of bytes kept
+  std::list<QKey> lru;              // cached q-points, the most recently used first
+  std::unordered_map<QKey, QEntry, QKeyHash> map;
+  std::mutex mtx;
+
+  QKey key(const double *, const int);
+  bigint size(const QEntry &);
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "sparse.h"
+#include "math.h"
+
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+/* ----------------------------------------------------------------------------
+ * Class Sparse keeps the real part of a dynamical matrix, times scale, as a
+ * symmetric matrix of natom x natom blocks of sdim x sdim (BSR): the block of
+ * atoms a and b, symmetrized as (D_ab + D_ba^T)/2, is kept if any of its
+ * elements exceeds tol times the largest element of the matrix, so that a and
+ * b are both kept or both dropped; the diagonal blocks are always kept. As
+ * the force constants are short-ranged, a large cell then costs a product
+ * with the matrix of the order of its # of atoms, instead of its square.
+ * ---------------------------------------------------------------------------- */
+Sparse::Sparse(const int natom, const int sdim, doublecomplex **DM, const double scale, const double tol)
+{
+  memory = new Memory();
+  nblock = natom; bs = sdim;
+  n = nblock*bs;
+  int bs2 = bs*bs;
+
+  // the largest element, and the norm of all
+  double hmax = 0., norm = 0.;
+  for (int i=0; i<n; i++)
+  for (int j=0; j<n; j++){
+    double h = 0.5*fabs(DM[i][j].r + DM[j][i].r)*scale;
+    hmax = MAX(hmax, h);
+    norm += h*h;
+  }
+  double cut = tol*hmax;
+
+  // count the blocks kept, and sum up what is dropped
+  double *rsum, *blk;
+  rsum = memory->create(rsum, n, "Sparse:rsum");
+  blk  = memory->create(blk,  bs2, "Sparse:blk");
+  bptr = memory->create(bptr, nblock+1, "Sparse:bptr");
+  for (int i=0; i<n; i++) rsum[i] = 0.;
+  double drop = 0.;
+  bptr[0] = 0;
+  for (int a=0; a<nblock; a++){
+    bptr[a+1] = bptr[a];
+    for (int b=0; b<nblock; b++){
+      double bmax = 0.;
+      for (int k=0; k<bs2; k++){
+        int i = a*bs + k/bs, j = b*bs + k%bs;
+        blk[k] = 0.5*(DM[i][j].r + DM[j][i].r)*scale;
+        bmax = MAX(bmax, fabs(blk[k]));
+      }
+      if (a == b || (bmax > cut && bmax > 0.)) bptr[a+1]++;
+      else for (int k=0; k<bs2; k++){
+        rsum[a*bs + k/bs] += fabs(blk[k]);
+        drop += blk[k]*blk[k];
+      }
+    }
+  }
+  nnzb = bptr[nblock];
+  error = norm > 0. ? sqrt(drop/norm) : 0.;
+  shift = 0.;
+  for (int i=0; i<n; i++) shift = MAX(shift, rsum[i]);
+
+  // now to fill them in
+  bcol = memory->create(bcol, MAX(1,nnzb), "Sparse:bcol");
+  val  = memory->create(val,  MAX(1,nnzb*bs2), "Sparse:val");
+  for (int a=0; a<nblock; a++){
+    bigint p = bptr[a];
+    for (int b=0; b<nblock; b++){
+      double bmax = 0.;
+      for (int k=0; k<bs2; k++){
+        int i = a*bs + k/bs, j = b*bs + k%bs;
+        blk[k] = 0.5*(DM[i][j].r + DM[j][i].r)*scale;
+        bmax = MAX(bmax, fabs(blk[k]));
+      }
+      if (a != b && (bmax <= cut || bmax <= 0.)) continue;
+      bcol[p] = b;
+      for (int k=0; k<bs2; k++) val[p*bs2+k] = blk[k];
+      p++;
+    }
+  }
+  memory->destroy(rsum);
+  memory->destroy(blk);
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Deconstructor
+ * ---------------------------------------------------------------------------- */
+Sparse::~Sparse()
+{
+  memory->destroy(bptr);
+  memory->destroy(bcol);
+  memory->destroy(val);
+  delete memory;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to get y = H x for m vectors at once, x and y being [n][m],
+ * so that the innermost loop runs over the vectors.
+ * ---------------------------------------------------------------------------- */
+void Sparse::multiply(const double *x, double *y, const int m)
+{
+  int bs2 = bs*bs;
+  for (int a=0; a<nblock; a++)
+  for (int r=0; r<bs; r++){
+    double *yi = &y[bigint(a*bs+r)*m];
+    for (int v=0; v<m; v++) yi[v] = 0.;
+    for (bigint p=bptr[a]; p<bptr[a+1]; p++){
+      const double *h = &val[p*bs2 + r*bs];
+      const double *xj = &x[bigint(bcol[p]*bs)*m];
+      for (int c=0; c<bs; c++)
+      for (int v=0; v<m; v++) yi[v] += h[c]*xj[c*m+v];
+    }
+  }
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to print the sparsity and the truncation error; the shift of
+ * the eigenvalues is in the unit of the matrix, i.e., unit^2.
+ * ---------------------------------------------------------------------------- */
+void Sparse::print(const char *unit)
+{
+  double all = double(nblock)*double(nblock);
+  printf("\nThe Hessian keeps %lld of %.0f blocks of %d x %d (%.3g%%, %.1f per atom), in %.3g MB;\n",
+    (long long)nnzb, all, bs, bs, 100.*double(nnzb)/all, double(nnzb)/double(MAX(1,nblock)),
+    double(nnzb)*double(bs*bs*sizeof(double)+sizeof(int))/1048576.);
+  printf("the dropped part has a relative norm of %g, and shifts the eigenvalues by\n", error);
+  printf("at most %g %s^2.\n", shift, unit);
+
+return;
+}
@@ -0,0 +1,30 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include "memory.h"
+
+extern "C"{
+#include "f2c.h"
+}
+
+class Sparse {
+public:
+  Sparse(const int, const int, doublecomplex **, const double, const double);
+  ~Sparse();
+
+  int n, nblock, bs;        // # of rows, of block rows, and the size of the blocks
+  bigint nnzb;              // # of blocks kept
+  bigint *bptr;             // blocks of block row i are bptr[i] to bptr[i+1]-1
+  int *bcol;                // the block column of each block kept
+  double *val;              // elements of the blocks kept, [nnzb][bs*bs], row major
+  double error;             // Frobenius norm of what is dropped, relative to that of all
+  double shift;             // largest row sum of what is dropped, bounding the shift of the eigenvalues
+
+  void multiply(const double *, double *, const int);
+  void print(const char *);
+
+private:
+  Memory *memory;
+};
+
+#endif
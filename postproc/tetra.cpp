@@ -0,0 +1,269 @@
+#include "tetra.h"
+#include "math.h"
+#include <algorithm>
+
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+/* ----------------------------------------------------------------------------
+ * Class Tetra divides the cells of a periodic q-mesh of n[0] x n[1] x n[2]
+ * into simplices for the linear tetrahedron method: tetrahedra for a 3D mesh,
+ * triangles or segments if the mesh is flat along some axes. The simplices of
+ * a cell share its shortest main diagonal, measured by the reciprocal vectors
+ * in the rows of rec (identity if NULL), as done by Bloechl, PRB 49, 16223.
+ * The corners are the indices (i*n[1]+j)*n[2]+k of the mesh points.
+ * ---------------------------------------------------------------------------- */
+Tetra::Tetra(const int *n, const double *rec)
+{
+  memory = new Memory();
+
+  int ax[3];
+  dim = 0;
+  for (int i=0; i<3; i++) if (n[i] > 1) ax[dim++] = i;
+  ncorner = dim+1;
+
+  // pick the diagonal from vertex c0 to its opposite one, the vertices of a
+  // cell being numbered by the bits of their offsets along ax
+  double unit[9] = {1.,0.,0., 0.,1.,0., 0.,0.,1.};
+  if (rec == NULL) rec = unit;
+  int c0 = 0;
+  double lmin = 1.e300;
+  for (int c=0; c<(1<<dim)/2; c++){
+    double d[3] = {0.,0.,0.};
+    for (int b=0; b<dim; b++){
+      double s = ((c>>b)&1) ? -1. : 1.;
+      for (int i=0; i<3; i++) d[i] += s*rec[ax[b]*3+i]/double(n[ax[b]]);
+    }
+    double l = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+    if (l < lmin - 1.e-10*lmin){lmin = l; c0 = c;}
+  }
+
+  // one simplex per path from c0 to the opposite vertex, one axis at a time
+  int nperm = 1;
+  for (int i=2; i<=dim; i++) nperm *= i;
+  int ncell = n[0]*n[1]*n[2];
+  nsimp = dim > 0 ? ncell*nperm : 0;
+  simp = memory->create(simp, MAX(1,nsimp), ncorner, "Tetra:simp");
+
+  int perm[3] = {0, 1, 2}, vtx[4], is = 0;
+  do {
+    vtx[0] = c0;
+    for (int k=1; k<=dim; k++) vtx[k] = vtx[k-1] ^ (1<<perm[k-1]);
+
+    for (int i=0; i<n[0]; i++)
+    for (int j=0; j<n[1]; j++)
+    for (int k=0; k<n[2]; k++){
+      int idx = (i*n[1]+j)*n[2]+k;
+      int ic = idx*nperm + is;
+      for (int m=0; m<ncorner; m++){
+        int off[3] = {0, 0, 0};
+        for (int b=0; b<dim; b++) off[ax[b]] = (vtx[m]>>b)&1;
+        simp[ic][m] = (((i+off[0])%n[0])*n[1] + (j+off[1])%n[1])*n[2] + (k+off[2])%n[2];
+      }
+    }
+    is++;
+  } while (dim > 0 && std::next_permutation(perm, perm+dim));
+
+return;
+}
+
+/* ----------------------------------------------------------------------------
+ * Deconstructor
+ * ---------------------------------------------------------------------------- */
+Tetra::~Tetra()
+{
+  memory->destroy(simp);
+  delete memory;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to get the density g(f) of a quantity that is linear over a
+ * simplex, given its values e at the corners; g is normalized to 1 over f.
+ * w returns the share of each corner in g, i.e., g times the mean barycentric
+ * coordinate of the corner over the level set e = f, so that a projected DOS
+ * is sum_i w_i p_i for corner projections p_i; for tetrahedra, the correction
+ * of Bloechl, g'(f)/40 sum_j (e_j - e_i), is added, which sums up to zero.
+ * ---------------------------------------------------------------------------- */
+double Tetra::weights(const double *e, const double f, double *w)
+{
+  int id[4];
+  double es[4] = {0.,0.,0.,0.}, l[4] = {0.,0.,0.,0.};
+  for (int i=0; i<ncorner; i++){
+    int j = i;
+    while (j > 0 && e[id[j-1]] > e[i]){ id[j] = id[j-1]; j--; }
+    id[j] = i;
+  }
+  for (int i=0; i<ncorner; i++){
+    es[i] = e[id[i]];
+    l[i] = w[i] = 0.;
+  }
+  if (f <= es[0] || f >= es[dim]) return 0.;
+
+  double g = 0., dg = 0.;
+  if (dim == 1){
+    g = 1./(es[1]-es[0]);
+    l[1] = (f-es[0])*g;
+    l[0] = 1.-l[1];
+
+  } else if (dim == 2){
+    // the level set is a segment, from the edge 0-2 to the edge 0-1 or 1-2
+    double t = (f-es[0])/(es[2]-es[0]);
+    l[0] = 0.5*(1.-t); l[2] = 0.5*t;
+    if (f < es[1]){
+      t = (f-es[0])/(es[1]-es[0]);
+      l[0] += 0.5*(1.-t); l[1] += 0.5*t;
+      g = 2.*(f-es[0])/((es[1]-es[0])*(es[2]-es[0]));
+    } else {
+      t = (es[2]-f)/(es[2]-es[1]);
+      l[2] += 0.5*(1.-t); l[1] += 0.5*t;
+      g = 2.*(es[2]-f)/((es[2]-es[0])*(es[2]-es[1]));
+    }
+
+  } else if (f < es[1]){
+    // a triangle cut from the edges 0-1, 0-2 and 0-3
+    double d1 = es[1]-es[0], d2 = es[2]-es[0], d3 = es[3]-es[0], x = f-es[0];
+    g  = 3.*x*x/(d1*d2*d3);
+    dg = 6.*x/(d1*d2*d3);
+    l[1] = x/(3.*d1); l[2] = x/(3.*d2); l[3] = x/(3.*d3);
+    l[0] = 1.-l[1]-l[2]-l[3];
+
+  } else if (f >= es[2]){
+    // a triangle cut from the edges 3-0, 3-1 and 3-2
+    double d0 = es[3]-es[0], d1 = es[3]-es[1], d2 = es[3]-es[2], x = es[3]-f;
+    g  = 3.*x*x/(d0*d1*d2);
+    dg = -6.*x/(d0*d1*d2);
+    l[0] = x/(3.*d0); l[1] = x/(3.*d1); l[2] = x/(3.*d2);
+    l[3] = 1.-l[0]-l[1]-l[2];
+
+  } else {
+    // a quadrilateral P02-P03-P13-P12, split into two triangles; the ratio of
+    // their areas is invariant under the affine map to the unit tetrahedron,
+    // on which the position of a point is given by its barycentric l[1..3]
+    double d02 = es[2]-es[0], d03 = es[3]-es[0], d12 = es[2]-es[1], d13 = es[3]-es[1];
+    double x = f-es[1], s = d02 + d13;
+    g  = (3.*(es[1]-es[0]) + 6.*x - 3.*s*x*x/(d12*d13))/(d02*d03);
+    dg = (6. - 6.*s*x/(d12*d13))/(d02*d03);
+
+    double p[4][4];
+    int ends[4][2] = {{0,2}, {0,3}, {1,3}, {1,2}};
+    for (int v=0; v<4; v++){
+      int a = ends[v][0], b = ends[v][1];
+      double t = (f-es[a])/(es[b]-es[a]);
+      for (int i=0; i<4; i++) p[v][i] = 0.;
+      p[v][a] = 1.-t; p[v][b] = t;
+    }
+    double area[2];
+    int tri[2][3] = {{0,1,2}, {0,2,3}};
+    for (int it=0; it<2; it++){
+      double u[3], v[3];
+      for (int i=0; i<3; i++){
+        u[i] = p[tri[it][1]][i+1] - p[tri[it][0]][i+1];
+        v[i] = p[tri[it][2]][i+1] - p[tri[it][0]][i+1];
+      }
+      double cx = u[1]*v[2]-u[2]*v[1], cy = u[2]*v[0]-u[0]*v[2], cz = u[0]*v[1]-u[1]*v[0];
+      area[it] = sqrt(cx*cx + cy*cy + cz*cz);
+    }
+    double atot = area[0] + area[1];
+    for (int it=0; it<2; it++){
+      double fac = atot > 0. ? area[it]/(3.*atot) : 1./6.;
+      for (int m=0; m<3; m++)
+      for (int i=0; i<4; i++) l[i] += fac*p[tri[it][m]][i];
+    }
+  }
+
+  double esum = 0.;
+  for (int i=0; i<ncorner; i++) esum += es[i];
+  for (int i=0; i<ncorner; i++){
+    w[id[i]] = g*l[i];
+    if (dim == 3) w[id[i]] += dg/40.*(esum - 4.*es[i]);
+  }
+
+return g;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public method to get the integral of the density of weights up to f, i.e.,
+ * the fraction N(f) of the simplex where the quantity is below f; W returns
+ * the integral of w of each corner, the occupation weights of Bloechl with
+ * his correction g(f)/40 sum_j (e_j - e_i) for tetrahedra. The DOS of a bin
+ * is then the change of N across it over its width, which also holds if the
+ * corners are degenerate, where the density of weights has no value.
+ * ---------------------------------------------------------------------------- */
+double Tetra::integral(const double *e, const double f, double *W)
+{
+  int id[4];
+  double es[4] = {0.,0.,0.,0.}, l[4] = {0.,0.,0.,0.};
+  for (int i=0; i<ncorner; i++){
+    int j = i;
+    while (j > 0 && e[id[j-1]] > e[i]){ id[j] = id[j-1]; j--; }
+    id[j] = i;
+  }
+  for (int i=0; i<ncorner; i++){
+    es[i] = e[id[i]];
+    l[i] = 0.;
+  }
+  if (f <= es[0]){
+    for (int i=0; i<ncorner; i++) W[i] = 0.;
+    return 0.;
+  } else if (f >= es[dim]){
+    for (int i=0; i<ncorner; i++) W[i] = 1./double(ncorner);
+    return 1.;
+  }
+
+  if (dim == 1){
+    double d = es[1]-es[0], x = f-es[0];
+    l[1] = 0.5*x*x/(d*d);
+    l[0] = x/d - l[1];
+
+  } else if (dim == 2 && f < es[1]){
+    // the triangle cut from the edges 0-1 and 0-2, whose mean of each
+    // barycentric coordinate is that of its vertices
+    double d1 = es[1]-es[0], d2 = es[2]-es[0], x = f-es[0];
+    double n = x*x/(d1*d2);
+    l[1] = n*x/(3.*d1); l[2] = n*x/(3.*d2);
+    l[0] = n-l[1]-l[2];
+
+  } else if (dim == 2){
+    // all but the triangle cut from the edges 2-0 and 2-1
+    double d0 = es[2]-es[0], d1 = es[2]-es[1], y = es[2]-f;
+    double n = y*y/(d0*d1);
+    l[0] = 1./3. - n*y/(3.*d0); l[1] = 1./3. - n*y/(3.*d1);
+    l[2] = 1./3. - (n - n*y/(3.*d0) - n*y/(3.*d1));
+
+  } else if (f < es[1]){
+    double d1 = es[1]-es[0], d2 = es[2]-es[0], d3 = es[3]-es[0], x = f-es[0];
+    double c = 0.25*x*x*x/(d1*d2*d3);
+    l[1] = c*x/d1; l[2] = c*x/d2; l[3] = c*x/d3;
+    l[0] = c*(4. - x*(1./d1 + 1./d2 + 1./d3));
+
+  } else if (f >= es[2]){
+    double d0 = es[3]-es[0], d1 = es[3]-es[1], d2 = es[3]-es[2], y = es[3]-f;
+    double c = 0.25*y*y*y/(d0*d1*d2);
+    l[0] = 0.25 - c*y/d0; l[1] = 0.25 - c*y/d1; l[2] = 0.25 - c*y/d2;
+    l[3] = 0.25 - c*(4. - y*(1./d0 + 1./d1 + 1./d2));
+
+  } else {
+    double e31 = es[2]-es[0], e41 = es[3]-es[0];
+    double e32 = es[2]-es[1], e42 = es[3]-es[1];
+    double x1 = f-es[0], x2 = f-es[1], x3 = es[2]-f, x4 = es[3]-f;
+    double c1 = 0.25*x1*x1/(e41*e31);
+    double c2 = 0.25*x1*x2*x3/(e41*e32*e31);
+    double c3 = 0.25*x2*x2*x4/(e42*e32*e41);
+    l[0] = c1 + (c1+c2)*x3/e31 + (c1+c2+c3)*x4/e41;
+    l[1] = c1+c2+c3 + (c2+c3)*x3/e32 + c3*x4/e42;
+    l[2] = (c1+c2)*x1/e31 + (c2+c3)*x2/e32;
+    l[3] = (c1+c2+c3)*x1/e41 + c3*x2/e42;
+  }
+
+  double n = 0., esum = 0., g = 0., w[4];
+  for (int i=0; i<ncorner; i++){
+    n += l[i];
+    esum += es[i];
+  }
+  if (dim == 3) g = weights(e, f, w);
+  for (int i=0; i<ncorner; i++){
+    W[id[i]] = l[i];
+    if (dim == 3) W[id[i]] += g/40.*(esum - 4.*es[i]);
+  }
+
+return n;
+}
@@ -0,0 +1,22 @@
+#ifndef TETRA_H
+#define TETRA_H
+
+#include "memory.h"
+
+class Tetra {
+public:
+  Tetra(const int *, const double *);
+  ~Tetra();
+
+  int dim;                  // # of axes of the mesh with more than one point
+  int nsimp, ncorner;       // # of simplices, and of corners of each: dim+1
+  int **simp;               // mesh indices of the corners, [nsimp][ncorner]
+
+  double weights(const double *, const double, double *);
+  double integral(const double *, const double, double *);
+
+private:
+  Memory *memory;
+};
+
+#endif